@@ -0,0 +1,557 @@
+/*
+ * Copyright 2021 Backtrace I/O, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Measures how quickly iterators recover from corruption.
+ *
+ * We build a large record stream in a temporary file (in $TMPDIR, or
+ * /tmp): a seed segment written with `crdb_record_stream_append_buf`,
+ * then copied until the stream reaches the target size.  Each
+ * scenario damages the file in place, iterates over the whole stream
+ * with `next_view`, and restores the original bytes.
+ *
+ * We report iteration throughput and the number of records lost.  We
+ * also time each call to `next_view` that skips records (the
+ * generations in each copy of the seed are consecutive), and report
+ * the resync cost: the total time spent in these calls, divided by
+ * the number of corruption events.  Each measurement is the best of
+ * a few passes.
+ *
+ * Usage: corruption [-b STREAM_BYTES] [-r RECORD_SIZE] [-e EVENTS]
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+#include "record_stream.h"
+
+/* Write this much data with `append_buf`, and copy it after that. */
+#define SEED_BYTES (64UL << 20)
+
+/* Zeroed pages and punched holes are aligned to this many bytes. */
+#define PAGE_SIZE 4096
+
+/* Holes and garbage spans are this long. */
+#define SPAN_SIZE (64UL << 10)
+
+/* The "half garbage" scenario overwrites every other chunk. */
+#define HALF_CHUNK_SIZE (1UL << 20)
+
+/* Iterate this many times for each measurement, and keep the fastest. */
+#define PASSES 3
+
+/* Saved contents for a damaged range of the stream. */
+struct damage {
+	off_t offset;
+	size_t len;
+	uint8_t *saved;
+};
+
+struct stream {
+	int fd;
+	size_t size;
+	size_t num_records;
+	size_t records_per_seed;
+	struct damage *damages;
+	size_t num_damages;
+	size_t damage_capacity;
+};
+
+struct result {
+	size_t found;
+	size_t resyncs;
+	double seconds;
+	double resync_seconds;
+};
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t
+rng(void)
+{
+
+	/* xorshift64*. */
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static void
+die(const char *what)
+{
+
+	perror(what);
+	exit(1);
+}
+
+static void
+pwrite_all(int fd, const void *buf, size_t len, off_t offset)
+{
+
+	while (len > 0) {
+		ssize_t r = pwrite(fd, buf, len, offset);
+
+		if (r < 0)
+			die("pwrite");
+
+		buf = (const uint8_t *)buf + r;
+		len -= r;
+		offset += r;
+	}
+
+	return;
+}
+
+/*
+ * Saves `len` bytes at `offset` before damaging them; everything
+ * saved is written back by `stream_restore`.
+ */
+static void
+stream_save(struct stream *stream, off_t offset, size_t len)
+{
+	struct damage *damage;
+
+	if ((size_t)offset >= stream->size)
+		return;
+
+	if (len > stream->size - offset)
+		len = stream->size - offset;
+
+	if (stream->num_damages == stream->damage_capacity) {
+		size_t capacity = 2 * stream->damage_capacity + 16;
+
+		stream->damages = realloc(stream->damages,
+		    capacity * sizeof(*stream->damages));
+		if (stream->damages == NULL)
+			die("realloc");
+		stream->damage_capacity = capacity;
+	}
+
+	damage = &stream->damages[stream->num_damages++];
+	damage->offset = offset;
+	damage->len = len;
+	damage->saved = malloc(len);
+	if (damage->saved == NULL)
+		die("malloc");
+
+	if (pread(stream->fd, damage->saved, len, offset) != (ssize_t)len)
+		die("pread");
+
+	return;
+}
+
+static void
+stream_restore(struct stream *stream)
+{
+
+	/* Restore in reverse, in case damaged ranges overlap. */
+	while (stream->num_damages > 0) {
+		struct damage *damage =
+		    &stream->damages[--stream->num_damages];
+
+		pwrite_all(stream->fd, damage->saved, damage->len,
+		    damage->offset);
+		free(damage->saved);
+	}
+
+	return;
+}
+
+static void
+stream_build(struct stream *stream, size_t target, size_t record_size)
+{
+	uint8_t buf[CRDB_RECORD_STREAM_MAX_LEN];
+	size_t seed_size, records_per_seed;
+	crdb_error_t ce;
+	int append_fd;
+	char path[64];
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", stream->fd);
+	append_fd = open(path, O_WRONLY | O_APPEND);
+	if (append_fd < 0)
+		die("open");
+
+	for (size_t i = 0; i < record_size; i++)
+		buf[i] = (uint8_t)rng();
+
+	for (records_per_seed = 0;; records_per_seed++) {
+		struct stat st;
+
+		if (records_per_seed % 1024 == 0) {
+			if (fstat(append_fd, &st) != 0)
+				die("fstat");
+			if ((size_t)st.st_size >= SEED_BYTES ||
+			    (size_t)st.st_size >= target) {
+				seed_size = st.st_size;
+				break;
+			}
+		}
+
+		/* Vary the payload a bit, so records aren't all identical. */
+		memcpy(buf, &records_per_seed,
+		    record_size < sizeof(records_per_seed) ?
+		    record_size : sizeof(records_per_seed));
+		if (!crdb_record_stream_append_buf(append_fd,
+		    (uint32_t)records_per_seed, buf, record_size, &ce)) {
+			fprintf(stderr, "append failed: %s\n", ce.message);
+			exit(1);
+		}
+	}
+
+	close(append_fd);
+
+	/* Every copy of the seed is a sequence of complete records. */
+	stream->size = seed_size;
+	stream->num_records = records_per_seed;
+	stream->records_per_seed = records_per_seed;
+	while (stream->size + seed_size <= target) {
+		loff_t in = 0;
+		loff_t out = stream->size;
+		size_t left = seed_size;
+
+		while (left > 0) {
+			ssize_t r = copy_file_range(stream->fd, &in,
+			    stream->fd, &out, left, 0);
+
+			if (r <= 0)
+				die("copy_file_range");
+			left -= r;
+		}
+
+		stream->size += seed_size;
+		stream->num_records += records_per_seed;
+	}
+
+	return;
+}
+
+static struct result
+iterate_once(const struct stream *stream)
+{
+	struct crdb_record_stream_iterator it;
+	uint8_t scratch[CRDB_RECORD_STREAM_BUF_LEN];
+	struct result ret = { 0 };
+	uint64_t begin_tsc, resync_tsc = 0;
+	size_t expected = 0;
+	crdb_error_t ce;
+	double begin;
+
+	begin = now();
+	begin_tsc = __rdtsc();
+	if (!crdb_record_stream_iterator_init_fd(&it, stream->fd, &ce)) {
+		fprintf(stderr, "iterator failed: %s\n", ce.message);
+		exit(1);
+	}
+
+	for (;;) {
+		const uint8_t *data;
+		uint32_t generation;
+		uint64_t call_tsc;
+		size_t len;
+		bool r;
+
+		call_tsc = __rdtsc();
+		r = crdb_record_stream_iterator_next_view(&it, &generation,
+		    &data, &len, scratch);
+		call_tsc = __rdtsc() - call_tsc;
+
+		/*
+		 * A call that doesn't return the next generation (or
+		 * stops before the end of a seed copy) skipped records.
+		 */
+		if (r ? generation != expected : expected != 0) {
+			resync_tsc += call_tsc;
+			ret.resyncs++;
+		}
+
+		if (!r)
+			break;
+
+		ret.found++;
+		expected = (generation + 1) % stream->records_per_seed;
+	}
+
+	crdb_record_stream_iterator_deinit(&it);
+	ret.seconds = now() - begin;
+	/* Convert TSC cycles to seconds with the pass' own rate. */
+	ret.resync_seconds = ret.seconds * resync_tsc /
+	    (double)(__rdtsc() - begin_tsc);
+	return ret;
+}
+
+static struct result
+iterate(const struct stream *stream)
+{
+	struct result ret = iterate_once(stream);
+
+	for (size_t i = 1; i < PASSES; i++) {
+		struct result pass = iterate_once(stream);
+
+		if (pass.seconds < ret.seconds)
+			ret.seconds = pass.seconds;
+		if (pass.resync_seconds < ret.resync_seconds)
+			ret.resync_seconds = pass.resync_seconds;
+	}
+
+	return ret;
+}
+
+static off_t
+random_offset(const struct stream *stream, size_t align, size_t len)
+{
+	size_t range = (stream->size > len) ? stream->size - len : 1;
+
+	return (off_t)((rng() % range) / align * align);
+}
+
+static size_t
+corrupt_bit_flips(struct stream *stream, size_t events)
+{
+
+	for (size_t i = 0; i < events; i++) {
+		off_t offset = random_offset(stream, 1, 1);
+		uint8_t byte;
+
+		stream_save(stream, offset, 1);
+		byte = stream->damages[stream->num_damages - 1].saved[0];
+		byte ^= 1U << (rng() % 8);
+		pwrite_all(stream->fd, &byte, 1, offset);
+	}
+
+	return events;
+}
+
+static size_t
+corrupt_zero_pages(struct stream *stream, size_t events)
+{
+	static const uint8_t zeros[PAGE_SIZE];
+
+	for (size_t i = 0; i < events; i++) {
+		off_t offset = random_offset(stream, PAGE_SIZE, PAGE_SIZE);
+
+		stream_save(stream, offset, PAGE_SIZE);
+		pwrite_all(stream->fd, zeros,
+		    stream->damages[stream->num_damages - 1].len, offset);
+	}
+
+	return events;
+}
+
+static void
+write_garbage(struct stream *stream, off_t offset, size_t len)
+{
+	uint8_t garbage[SPAN_SIZE];
+
+	stream_save(stream, offset, len);
+	len = stream->damages[stream->num_damages - 1].len;
+	while (len > 0) {
+		size_t n = (len < sizeof(garbage)) ? len : sizeof(garbage);
+
+		for (size_t i = 0; i < n; i++)
+			garbage[i] = (uint8_t)rng();
+
+		pwrite_all(stream->fd, garbage, n, offset);
+		offset += n;
+		len -= n;
+	}
+
+	return;
+}
+
+static size_t
+corrupt_garbage(struct stream *stream, size_t events)
+{
+
+	for (size_t i = 0; i < events; i++)
+		write_garbage(stream, random_offset(stream, 1, SPAN_SIZE),
+		    SPAN_SIZE);
+
+	return events;
+}
+
+static size_t
+corrupt_half_garbage(struct stream *stream, size_t events)
+{
+	size_t ret = 0;
+
+	(void)events;
+	for (size_t offset = 0; offset < stream->size;
+	     offset += 2 * HALF_CHUNK_SIZE, ret++)
+		write_garbage(stream, offset, HALF_CHUNK_SIZE);
+
+	return ret;
+}
+
+static size_t
+corrupt_holes(struct stream *stream, size_t events)
+{
+
+	for (size_t i = 0; i < events; i++) {
+		off_t offset = random_offset(stream, PAGE_SIZE, SPAN_SIZE);
+
+		stream_save(stream, offset, SPAN_SIZE);
+		if (fallocate(stream->fd,
+		    FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+		    stream->damages[stream->num_damages - 1].len) != 0)
+			die("fallocate");
+	}
+
+	return events;
+}
+
+static size_t
+corrupt_truncated_tail(struct stream *stream, size_t events)
+{
+	/* Cut the stream in the middle of its last records. */
+	size_t cut = 1 + rng() % CRDB_RECORD_STREAM_BUF_LEN;
+
+	(void)events;
+	if (cut > stream->size)
+		cut = stream->size;
+
+	stream_save(stream, stream->size - cut, cut);
+	if (ftruncate(stream->fd, stream->size - cut) != 0)
+		die("ftruncate");
+
+	return 1;
+}
+
+int
+main(int argc, char **argv)
+{
+	static const struct {
+		const char *name;
+		size_t (*corrupt)(struct stream *, size_t events);
+	} scenarios[] = {
+		{ "bit_flips", corrupt_bit_flips },
+		{ "zero_pages", corrupt_zero_pages },
+		{ "holes", corrupt_holes },
+		{ "garbage", corrupt_garbage },
+		{ "half_garbage", corrupt_half_garbage },
+		{ "truncated_tail", corrupt_truncated_tail },
+	};
+	struct stream stream = { .fd = -1 };
+	size_t target = 1UL << 30;
+	size_t record_size = 64;
+	size_t events = 1000;
+	struct result clean;
+	const char *tmpdir;
+	char path[4096];
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:r:e:")) != -1) {
+		switch (opt) {
+		case 'b':
+			target = strtoull(optarg, NULL, 0);
+			break;
+		case 'r':
+			record_size = strtoull(optarg, NULL, 0);
+			break;
+		case 'e':
+			events = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (target == 0 || record_size == 0 ||
+	    record_size > CRDB_RECORD_STREAM_MAX_LEN)
+		goto usage;
+
+	tmpdir = getenv("TMPDIR");
+	snprintf(path, sizeof(path), "%s/record_stream_corruption.XXXXXX",
+	    (tmpdir != NULL) ? tmpdir : "/tmp");
+	stream.fd = mkstemp(path);
+	if (stream.fd < 0)
+		die("mkstemp");
+	unlink(path);
+
+	stream_build(&stream, target, record_size);
+
+	clean = iterate(&stream);
+	if (clean.found != stream.num_records) {
+		fprintf(stderr, "found %zu records in the clean stream, "
+		    "expected %zu\n", clean.found, stream.num_records);
+		return 1;
+	}
+
+	printf("%zu bytes, %zu records of %zu bytes\n", stream.size,
+	    stream.num_records, record_size);
+	printf("%-16s %8s %12s %12s %8s %8s %14s\n", "scenario", "events",
+	    "records", "lost", "GB/s", "resyncs", "resync us/evt");
+	printf("%-16s %8d %12zu %12d %8.2f %8zu %14s\n", "clean", 0,
+	    clean.found, 0, stream.size / clean.seconds / 1e9, clean.resyncs,
+	    "-");
+
+	for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]);
+	     i++) {
+		struct result result;
+		size_t num_events;
+
+		num_events = scenarios[i].corrupt(&stream, events);
+		result = iterate(&stream);
+		stream_restore(&stream);
+
+		printf("%-16s %8zu %12zu %12zu %8.2f %8zu %14.2f\n",
+		    scenarios[i].name, num_events, result.found,
+		    stream.num_records - result.found,
+		    stream.size / result.seconds / 1e9, result.resyncs,
+		    1e6 * result.resync_seconds / num_events);
+	}
+
+	/* Make sure we restored everything. */
+	clean = iterate_once(&stream);
+	if (clean.found != stream.num_records) {
+		fprintf(stderr, "found %zu records after restoring, "
+		    "expected %zu\n", clean.found, stream.num_records);
+		return 1;
+	}
+
+	close(stream.fd);
+	free(stream.damages);
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-b STREAM_BYTES] [-r RECORD_SIZE] "
+	    "[-e EVENTS]\n", argv[0]);
+	return 1;
+}
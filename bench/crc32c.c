@@ -0,0 +1,124 @@
+/*
+ * Copyright 2021 Backtrace I/O, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Measures the throughput of crdb_crc32c for a range of input sizes,
+ * in cycles per byte (TSC cycles) and GB/s, against the simple 4-byte
+ * serial loop it replaced.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <x86intrin.h>
+
+#include "crdb_crc32c.h"
+
+/* Checksum roughly this many bytes for each measurement. */
+#define BYTES_PER_RUN (256UL << 20)
+
+static uint32_t
+crc32c_reference(uint32_t acc, const void *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + sizeof(uint32_t) <= len; i += sizeof(uint32_t)) {
+		uint32_t bytes;
+
+		memcpy(&bytes, (const uint8_t *)buf + i, sizeof(bytes));
+		acc = _mm_crc32_u32(acc, bytes);
+	}
+
+	for (; i < len; i++)
+		acc = _mm_crc32_u8(acc, ((const uint8_t *)buf)[i]);
+
+	return acc;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/**
+ * Returns the cycles per byte for `fn` on `size`-byte inputs, and
+ * stores the throughput in GB/s in `*gbps`.
+ */
+static double
+measure(uint32_t (*fn)(uint32_t, const void *, size_t), const uint8_t *buf,
+    size_t size, double *gbps)
+{
+	size_t reps = BYTES_PER_RUN / size;
+	volatile uint32_t sink;
+	uint32_t acc = 0;
+	uint64_t begin_tsc, end_tsc;
+	double begin, end;
+
+	begin = now();
+	begin_tsc = __rdtsc();
+	for (size_t i = 0; i < reps; i++)
+		acc = fn(acc, buf, size);
+	end_tsc = __rdtsc();
+	end = now();
+
+	sink = acc;
+	(void)sink;
+	*gbps = (double)reps * size / (end - begin) / 1e9;
+	return (double)(end_tsc - begin_tsc) / ((double)reps * size);
+}
+
+int
+main(void)
+{
+	static const size_t sizes[] = {
+		8, 20, 32, 40, 64, 256, 1024, 4096, 16384, 65536, 1 << 20,
+	};
+	uint8_t *buf;
+
+	buf = malloc(1 << 20);
+	if (buf == NULL)
+		return 1;
+
+	for (size_t i = 0; i < (1 << 20); i++)
+		buf[i] = (uint8_t)(i * 2654435761U >> 24);
+
+	printf("%10s %14s %10s %14s %10s\n", "size", "reference c/B",
+	    "GB/s", "crdb c/B", "GB/s");
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		double ref_cpb, ref_gbps, cpb, gbps;
+
+		ref_cpb = measure(crc32c_reference, buf, sizes[i], &ref_gbps);
+		cpb = measure(crdb_crc32c_update, buf, sizes[i], &gbps);
+		printf("%10zu %14.3f %10.2f %14.3f %10.2f\n", sizes[i],
+		    ref_cpb, ref_gbps, cpb, gbps);
+	}
+
+	free(buf);
+	return 0;
+}
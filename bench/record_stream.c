@@ -0,0 +1,286 @@
+/*
+ * Copyright 2021 Backtrace I/O, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Measures end-to-end record stream throughput: appending records to
+ * a temporary file (in $TMPDIR, or /tmp), then iterating over the
+ * file, for a range of record sizes and densities of forbidden
+ * sequences, in TSC cycles per record and GB/s of raw payload.
+ *
+ * Records up to CRDB_RECORD_STREAM_MAX_LEN use `append_buf` and
+ * `next_view`; longer ones `append_large` and `next_large`.
+ *
+ * Usage: record_stream [-s SIZE]... [-g GAP]...
+ *
+ * The options are the same as for the word_stuff benchmark.
+ */
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+#include "record_stream.h"
+#include "word_stuff.h"
+
+/* Write roughly this many payload bytes for each measurement. */
+#define BYTES_PER_RUN (64UL << 20)
+
+/* But always at least that many records, and at most that many. */
+#define MIN_RECORDS 4
+#define MAX_RECORDS 200000
+
+#define MAX_PARAMS 32
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/*
+ * Fills `buf[0 ... size - 1]` with pseudo-random filler that never
+ * forms a forbidden sequence, and inserts a header after every `gap`
+ * bytes of filler if `gap >= 0`.
+ */
+static void
+fill_payload(uint8_t *buf, size_t size, long gap)
+{
+	uint8_t header[CRDB_WORD_STUFF_HEADER_SIZE];
+	uint32_t state = 2654435761U;
+
+	crdb_word_stuff_header(header);
+	for (size_t i = 0; i < size; i++) {
+		uint8_t byte;
+
+		state = state * 1103515245U + 12345U;
+		byte = (uint8_t)(state >> 24);
+		buf[i] = (byte == header[0]) ? 0 : byte;
+	}
+
+	if (gap < 0)
+		return;
+
+	for (size_t i = (size_t)gap;
+	     i + CRDB_WORD_STUFF_HEADER_SIZE <= size;
+	     i += (size_t)gap + CRDB_WORD_STUFF_HEADER_SIZE)
+		memcpy(buf + i, header, sizeof(header));
+
+	return;
+}
+
+static void
+report(const char *op, size_t size, long gap, size_t count, uint64_t cycles,
+    double seconds)
+{
+
+	printf("%-8s %10zu %6ld %10zu %14.1f %10.2f\n", op, size, gap, count,
+	    (double)cycles / count, (double)count * size / seconds / 1e9);
+	return;
+}
+
+static void
+bench_one(int fd, size_t size, long gap, uint8_t *payload)
+{
+	struct crdb_record_stream_config config = {
+		.max_record_len = size,
+	};
+	struct crdb_record_stream_iterator it;
+	uint8_t scratch[CRDB_RECORD_STREAM_BUF_LEN];
+	bool large = size > CRDB_RECORD_STREAM_MAX_LEN;
+	size_t count = BYTES_PER_RUN / size;
+	size_t found = 0;
+	uint64_t begin_tsc, end_tsc;
+	double begin;
+	crdb_error_t ce;
+
+	if (count < MIN_RECORDS)
+		count = MIN_RECORDS;
+	if (count > MAX_RECORDS)
+		count = MAX_RECORDS;
+
+	fill_payload(payload, size, gap);
+	if (ftruncate(fd, 0) != 0) {
+		perror("ftruncate");
+		exit(1);
+	}
+
+	begin = now();
+	begin_tsc = __rdtsc();
+	for (size_t i = 0; i < count; i++) {
+		bool r;
+
+		if (large) {
+			r = crdb_record_stream_append_large(fd, &config,
+			    (uint32_t)i, payload, size, &ce);
+		} else {
+			r = crdb_record_stream_append_buf(fd, (uint32_t)i,
+			    payload, size, &ce);
+		}
+
+		if (!r) {
+			fprintf(stderr, "append failed: %s\n", ce.message);
+			exit(1);
+		}
+	}
+	end_tsc = __rdtsc();
+	report("append", size, gap, count, end_tsc - begin_tsc,
+	    now() - begin);
+
+	begin = now();
+	begin_tsc = __rdtsc();
+	if (!crdb_record_stream_iterator_init_fd(&it, fd, &ce) ||
+	    (large &&
+	    !crdb_record_stream_iterator_configure(&it, &config, &ce))) {
+		fprintf(stderr, "iterator failed: %s\n", ce.message);
+		exit(1);
+	}
+
+	for (;;) {
+		const uint8_t *data;
+		uint32_t generation;
+		size_t len;
+		bool r;
+
+		if (large) {
+			r = crdb_record_stream_iterator_next_large(&it,
+			    &generation, &data, &len);
+		} else {
+			r = crdb_record_stream_iterator_next_view(&it,
+			    &generation, &data, &len, scratch);
+		}
+
+		if (!r)
+			break;
+
+		found += (len == size && generation == found);
+	}
+
+	crdb_record_stream_iterator_deinit(&it);
+	end_tsc = __rdtsc();
+	report("iterate", size, gap, count, end_tsc - begin_tsc,
+	    now() - begin);
+
+	if (found != count) {
+		fprintf(stderr, "found %zu records out of %zu\n", found, count);
+		exit(1);
+	}
+
+	return;
+}
+
+int
+main(int argc, char **argv)
+{
+	static const size_t default_sizes[] = {
+		8, 20, 32, 64, 256, CRDB_RECORD_STREAM_MAX_LEN, 4096, 65536,
+		1 << 20, CRDB_RECORD_STREAM_LARGE_MAX_LEN,
+	};
+	static const long default_gaps[] = { -1, 64, 0 };
+	size_t sizes[MAX_PARAMS];
+	long gaps[MAX_PARAMS];
+	size_t num_sizes = 0, num_gaps = 0;
+	size_t max_size = 0;
+	char path[4096];
+	const char *tmpdir;
+	uint8_t *payload;
+	int fd, opt;
+
+	while ((opt = getopt(argc, argv, "s:g:")) != -1) {
+		switch (opt) {
+		case 's':
+			if (num_sizes == MAX_PARAMS)
+				goto usage;
+			sizes[num_sizes] = strtoull(optarg, NULL, 0);
+			if (sizes[num_sizes] == 0 ||
+			    sizes[num_sizes] > CRDB_RECORD_STREAM_LARGE_MAX_LEN)
+				goto usage;
+			num_sizes++;
+			break;
+		case 'g':
+			if (num_gaps == MAX_PARAMS)
+				goto usage;
+			gaps[num_gaps++] = strtol(optarg, NULL, 0);
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (num_sizes == 0) {
+		num_sizes = sizeof(default_sizes) / sizeof(default_sizes[0]);
+		memcpy(sizes, default_sizes, sizeof(default_sizes));
+	}
+
+	if (num_gaps == 0) {
+		num_gaps = sizeof(default_gaps) / sizeof(default_gaps[0]);
+		memcpy(gaps, default_gaps, sizeof(default_gaps));
+	}
+
+	for (size_t i = 0; i < num_sizes; i++) {
+		if (sizes[i] > max_size)
+			max_size = sizes[i];
+	}
+
+	payload = malloc(max_size);
+	if (payload == NULL)
+		return 1;
+
+	tmpdir = getenv("TMPDIR");
+	snprintf(path, sizeof(path), "%s/record_stream_bench.XXXXXX",
+	    (tmpdir != NULL) ? tmpdir : "/tmp");
+	fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+
+	/* Appends need O_APPEND. */
+	unlink(path);
+	if (fcntl(fd, F_SETFL, O_APPEND) != 0) {
+		perror("fcntl");
+		return 1;
+	}
+
+	printf("%-8s %10s %6s %10s %14s %10s\n", "op", "size", "gap",
+	    "records", "cycles/record", "GB/s");
+	for (size_t i = 0; i < num_sizes; i++) {
+		for (size_t j = 0; j < num_gaps; j++)
+			bench_one(fd, sizes[i], gaps[j], payload);
+	}
+
+	close(fd);
+	free(payload);
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-s SIZE]... [-g GAP]...\n", argv[0]);
+	return 1;
+}
@@ -0,0 +1,270 @@
+/*
+ * Copyright 2021 Backtrace I/O, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Measures word stuffing encoding (with and without the fused
+ * CRC32C), decoding, and header search, for a range of record sizes
+ * and densities of forbidden sequences, in TSC cycles per record and
+ * GB/s of raw payload.
+ *
+ * Usage: word_stuff [-s SIZE]... [-g GAP]...
+ *
+ * Each `-s` adds a record size, and each `-g` a payload distribution
+ * with a forbidden sequence after every GAP bytes of filler (0 is the
+ * worst case, nothing but forbidden sequences); `-g -1` is filler
+ * only.  Without any option, we run a default grid.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+#include "crdb_crc32c.h"
+#include "record_stream.h"
+#include "word_stuff.h"
+
+/* Process roughly this many payload bytes for each measurement. */
+#define BYTES_PER_RUN (16UL << 20)
+
+/* And always run at least that many records. */
+#define MIN_REPS 4
+
+#define MAX_PARAMS 32
+
+enum op {
+	OP_ENCODE,
+	OP_ENCODE_CRC32C,
+	OP_DECODE,
+	OP_HEADER_FIND,
+	OP_COUNT,
+};
+
+static const char *const op_names[OP_COUNT] = {
+	[OP_ENCODE] = "encode",
+	[OP_ENCODE_CRC32C] = "encode_crc32c",
+	[OP_DECODE] = "decode",
+	[OP_HEADER_FIND] = "header_find",
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/*
+ * Fills `buf[0 ... size - 1]` with pseudo-random filler that never
+ * forms a forbidden sequence, and inserts a header after every `gap`
+ * bytes of filler if `gap >= 0`.
+ */
+static void
+fill_payload(uint8_t *buf, size_t size, long gap)
+{
+	uint8_t header[CRDB_WORD_STUFF_HEADER_SIZE];
+	uint32_t state = 2654435761U;
+
+	crdb_word_stuff_header(header);
+	for (size_t i = 0; i < size; i++) {
+		uint8_t byte;
+
+		state = state * 1103515245U + 12345U;
+		byte = (uint8_t)(state >> 24);
+		/* Avoid the first byte of the header altogether. */
+		buf[i] = (byte == header[0]) ? 0 : byte;
+	}
+
+	if (gap < 0)
+		return;
+
+	for (size_t i = (size_t)gap;
+	     i + CRDB_WORD_STUFF_HEADER_SIZE <= size;
+	     i += (size_t)gap + CRDB_WORD_STUFF_HEADER_SIZE)
+		memcpy(buf + i, header, sizeof(header));
+
+	return;
+}
+
+/**
+ * Runs `op` on `size`-byte records `reps` times, and returns the
+ * elapsed TSC cycles; stores the wall-clock time in `*seconds`.
+ */
+static uint64_t
+run(enum op op, size_t reps, const uint8_t *payload, size_t size,
+    const uint8_t *encoded, size_t encoded_size, uint8_t *dst,
+    double *seconds)
+{
+	volatile uintptr_t sink;
+	uintptr_t acc = 0;
+	uint64_t begin_tsc, end_tsc;
+	double begin;
+
+	begin = now();
+	begin_tsc = __rdtsc();
+	for (size_t i = 0; i < reps; i++) {
+		uint32_t crc = 0;
+
+		switch (op) {
+		case OP_ENCODE:
+			acc += (uintptr_t)crdb_word_stuff_encode(dst,
+			    payload, size);
+			break;
+		case OP_ENCODE_CRC32C:
+			acc += (uintptr_t)crdb_word_stuff_encode_crc32c(dst,
+			    payload, size, &crc);
+			acc += crc;
+			break;
+		case OP_DECODE:
+			acc += (uintptr_t)crdb_word_stuff_decode(dst,
+			    encoded, encoded_size);
+			break;
+		case OP_HEADER_FIND:
+			/* Scan the encoded record, like a reader framing it. */
+			acc += (uintptr_t)crdb_word_stuff_header_find(encoded,
+			    encoded_size);
+			break;
+		case OP_COUNT:
+			abort();
+		}
+	}
+	end_tsc = __rdtsc();
+
+	*seconds = now() - begin;
+	sink = acc;
+	(void)sink;
+	return end_tsc - begin_tsc;
+}
+
+static void
+bench_one(size_t size, long gap, uint8_t *payload, uint8_t *encoded,
+    uint8_t *dst)
+{
+	size_t reps = BYTES_PER_RUN / size;
+	size_t encoded_size;
+
+	if (reps < MIN_REPS)
+		reps = MIN_REPS;
+
+	fill_payload(payload, size, gap);
+	encoded_size = crdb_word_stuff_encode(encoded, payload, size) - encoded;
+
+	/* Make sure the decoder agrees before timing anything. */
+	if (crdb_word_stuff_decode(dst, encoded, encoded_size) != dst + size ||
+	    memcmp(dst, payload, size) != 0) {
+		fprintf(stderr, "round trip failed for size %zu, gap %ld\n",
+		    size, gap);
+		exit(1);
+	}
+
+	for (int op = 0; op < OP_COUNT; op++) {
+		double seconds;
+		uint64_t cycles;
+
+		cycles = run(op, reps, payload, size, encoded, encoded_size,
+		    dst, &seconds);
+		printf("%-14s %10zu %6ld %14.1f %10.2f\n", op_names[op],
+		    size, gap, (double)cycles / reps,
+		    (double)reps * size / seconds / 1e9);
+	}
+
+	return;
+}
+
+int
+main(int argc, char **argv)
+{
+	static const size_t default_sizes[] = {
+		8, 20, 32, 64, 256, CRDB_RECORD_STREAM_MAX_LEN, 4096, 65536,
+		1 << 20, CRDB_RECORD_STREAM_LARGE_MAX_LEN,
+	};
+	static const long default_gaps[] = { -1, 4096, 256, 64, 16, 0 };
+	size_t sizes[MAX_PARAMS];
+	long gaps[MAX_PARAMS];
+	size_t num_sizes = 0, num_gaps = 0;
+	size_t max_size = 0;
+	uint8_t *payload, *encoded, *dst;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:g:")) != -1) {
+		switch (opt) {
+		case 's':
+			if (num_sizes == MAX_PARAMS)
+				goto usage;
+			sizes[num_sizes] = strtoull(optarg, NULL, 0);
+			if (sizes[num_sizes] == 0)
+				goto usage;
+			num_sizes++;
+			break;
+		case 'g':
+			if (num_gaps == MAX_PARAMS)
+				goto usage;
+			gaps[num_gaps++] = strtol(optarg, NULL, 0);
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (num_sizes == 0) {
+		num_sizes = sizeof(default_sizes) / sizeof(default_sizes[0]);
+		memcpy(sizes, default_sizes, sizeof(default_sizes));
+	}
+
+	if (num_gaps == 0) {
+		num_gaps = sizeof(default_gaps) / sizeof(default_gaps[0]);
+		memcpy(gaps, default_gaps, sizeof(default_gaps));
+	}
+
+	for (size_t i = 0; i < num_sizes; i++) {
+		if (sizes[i] > max_size)
+			max_size = sizes[i];
+	}
+
+	payload = malloc(max_size);
+	encoded = malloc(crdb_word_stuffed_size(max_size, false));
+	dst = malloc(crdb_word_stuffed_size(max_size, false));
+	if (payload == NULL || encoded == NULL || dst == NULL)
+		return 1;
+
+	printf("%-14s %10s %6s %14s %10s\n", "op", "size", "gap",
+	    "cycles/record", "GB/s");
+	for (size_t i = 0; i < num_sizes; i++) {
+		for (size_t j = 0; j < num_gaps; j++)
+			bench_one(sizes[i], gaps[j], payload, encoded, dst);
+	}
+
+	free(dst);
+	free(encoded);
+	free(payload);
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-s SIZE]... [-g GAP]...\n", argv[0]);
+	return 1;
+}
@@ -14,8 +14,13 @@ PANDOC_FLAGS="--tab-stop=8 --toc --css $CSS --from markdown+smart --to html5 --s
 SOURCES=$(cat <<'EOF'
 README.md
 doc/2021-01-11-stuff-your-logs.md
+include/crdb_crc32c.h
 include/crdb_error.h
 include/record_stream.h
+include/record_stream_index.h
+include/record_stream_reader.h
+include/record_stream_uring.h
+include/record_stream_writer.h
 include/word_stuff.h
 EOF
 )
@@ -0,0 +1,30 @@
+#pragma once
+
+/**
+ * CRC32C (Castagnoli) checksums, as used to validate record stream
+ * records.
+ *
+ * The checksum starts from a 0 accumulator, without any final
+ * inversion: `crdb_crc32c(buf, len)` is
+ * `crdb_crc32c_update(0, buf, len)`, and a checksum can be computed
+ * piecewise by feeding consecutive byte ranges to
+ * `crdb_crc32c_update`.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Returns the CRC32C accumulator `acc` updated with `buf[0 ... len - 1]`.
+ */
+uint32_t crdb_crc32c_update(uint32_t acc, const void *buf, size_t len);
+
+/**
+ * Returns the CRC32C of `buf[0 ... len - 1]`.
+ */
+static inline uint32_t
+crdb_crc32c(const void *buf, size_t len)
+{
+
+	return crdb_crc32c_update(0, buf, len);
+}
@@ -36,6 +36,43 @@ enum {
 	CRDB_RECORD_STREAM_BUF_LEN = 2 * CRDB_RECORD_STREAM_MAX_LEN,
 };
 
+/**
+ * Large records (e.g., symbolicated stacks or attribute blobs) use
+ * the same format, but must be enabled explicitly, per stream, with a
+ * `crdb_record_stream_config`.  Their buffers live on the heap, and
+ * the configured payload size can't exceed
+ * CRDB_RECORD_STREAM_LARGE_MAX_LEN.
+ *
+ * Readers that aren't configured for large records (including older
+ * versions of this library) only skip records whose encoding is longer
+ * than CRDB_RECORD_STREAM_BUF_LEN bytes.  Large records that encode to
+ * fewer bytes, i.e., payloads a bit longer than
+ * CRDB_RECORD_STREAM_MAX_LEN but short of CRDB_RECORD_STREAM_BUF_LEN
+ * minus the record header and word stuffing overhead, are returned to
+ * these readers like any other record: streams shared with them
+ * should avoid such payloads unless every reader accepts them.
+ */
+#define CRDB_RECORD_STREAM_LARGE_MAX_LEN ((size_t)16 << 20)
+
+struct crdb_record_stream_config {
+	/*
+	 * Maximum payload size, in bytes, for appends; iterators
+	 * accept encoded records up to twice that size, for forward
+	 * compatibility.  0 means the default,
+	 * CRDB_RECORD_STREAM_MAX_LEN.
+	 */
+	size_t max_record_len;
+};
+
+/*
+ * A range of allocated data in a record stream file,
+ * `[begin, end)`, in bytes from the beginning of the file.
+ */
+struct crdb_record_stream_extent {
+	size_t begin;
+	size_t end;
+};
+
 struct crdb_record_stream_iterator {
 	const uint8_t *cursor;
 	const uint8_t *end;
@@ -60,6 +97,35 @@ struct crdb_record_stream_iterator {
 
 	/* Everything in `mapped` before first_nonzero is zero-filled bytes. */
 	const uint8_t *first_nonzero;
+
+	/*
+	 * The data extents in `mapped`, sorted, per SEEK_DATA and
+	 * SEEK_HOLE when the iterator was initialized or last followed.
+	 * Bytes outside these extents are sparse holes, which read as
+	 * zeros and can't contain any header, so searches skip them.
+	 * NULL when everything is data, or when the file system can't
+	 * tell.
+	 */
+	struct crdb_record_stream_extent *extents;
+	size_t num_extents;
+
+	/*
+	 * The last record that failed to decode and ran into `end`
+	 * instead of a header, if any: it may simply be incomplete,
+	 * so `crdb_record_stream_iterator_follow` re-examines it once
+	 * the stream grows.
+	 */
+	const uint8_t *partial_record;
+	bool partial_first_record;
+
+	/*
+	 * Only populated by `crdb_record_stream_iterator_configure`:
+	 * the maximum encoded size accepted by
+	 * `crdb_record_stream_iterator_next_large`, and a heap buffer
+	 * of that size to decode records.
+	 */
+	size_t max_encoded_len;
+	uint8_t *record_buf;
 };
 
 /**
@@ -90,6 +156,43 @@ bool crdb_record_stream_write_initial(FILE *stream, crdb_error_t *);
 bool crdb_record_stream_append_buf(int fd, uint32_t generation,
     const uint8_t *buf, size_t len, crdb_error_t *);
 
+/**
+ * Appends a record containing `buf[0 ... len - 1]` to `fd`, like
+ * `crdb_record_stream_append_buf`, but with the payload size limit in
+ * `config`.
+ *
+ * @param fd a file descriptor opened with O_APPEND.
+ * @param config the stream configuration, or NULL for the defaults.
+ */
+bool crdb_record_stream_append_large(int fd,
+    const struct crdb_record_stream_config *config, uint32_t generation,
+    const uint8_t *buf, size_t len, crdb_error_t *);
+
+/**
+ * One record in a batch: the record's generation and payload
+ * `buf[0 ... len - 1]`.
+ */
+struct crdb_record_iov {
+	uint32_t generation;
+	const uint8_t *buf;
+	size_t len;
+};
+
+/**
+ * Appends the `n` records in `records` to `fd`, in order, with a
+ * single write syscall (barring short writes).
+ *
+ * Records are encoded in one buffer, and retried on failure like for
+ * `crdb_record_stream_append_buf`.  After a short write, retries
+ * resume at the first record that wasn't written whole, behind a
+ * fresh header, so readers never observe a record twice.  No record
+ * is written if any of them is too long.
+ *
+ * @param fd a file descriptor opened with O_APPEND.
+ */
+bool crdb_record_stream_append_batch(int fd,
+    const struct crdb_record_iov *records, size_t n, crdb_error_t *);
+
 /**
  * Writes a record containing `buf[0 ... len - 1]` to `stream`.
  *
@@ -118,6 +221,39 @@ bool crdb_record_stream_write_msg(FILE *stream, uint32_t generation,
     const ProtobufCMessage *message, crdb_error_t *);
 #endif /* HAS_PROTOBUF_C */
 
+enum crdb_record_stream_release_flags {
+	/*
+	 * Remove the released range from the file with
+	 * FALLOC_FL_COLLAPSE_RANGE, instead of punching a hole: every
+	 * remaining record moves `*released` bytes closer to the
+	 * beginning of the file.
+	 */
+	CRDB_RECORD_STREAM_RELEASE_COLLAPSE = 1 << 0,
+};
+
+/**
+ * Releases the disk space used by records that start before
+ * `offset`, without rewriting the stream: the largest prefix of the
+ * file that ends at a block boundary at or before `offset` becomes a
+ * sparse hole.  Iterators skip the hole, and the partial record
+ * between the hole and `offset`, if any, like any other corruption.
+ *
+ * Records that start at or after `offset` are preserved; to keep
+ * everything from a given record, pass the offset returned by
+ * `crdb_record_stream_iterator_record_offset` for that record.
+ *
+ * @param fd a file descriptor for a writable record stream file, on
+ *   a file system that supports FALLOC_FL_PUNCH_HOLE (or
+ *   FALLOC_FL_COLLAPSE_RANGE with CRDB_RECORD_STREAM_RELEASE_COLLAPSE).
+ * @param offset the offset of the first byte to keep, at most the
+ *   file's size.
+ * @param flags a combination of `crdb_record_stream_release_flags`.
+ * @param released if non-NULL, populated with the size of the
+ *   released prefix on success, 0 on failure.
+ */
+bool crdb_record_stream_release_before(int fd, size_t offset,
+    unsigned int flags, size_t *released, crdb_error_t *);
+
 /**
  * Initializes an iterator to scan for records in `buf[0 ... size - 1]`.
  */
@@ -132,6 +268,46 @@ void crdb_record_stream_iterator_init_buf(struct crdb_record_stream_iterator *,
 bool crdb_record_stream_iterator_init_fd(struct crdb_record_stream_iterator *,
     int fd, crdb_error_t *);
 
+/**
+ * Configures an initialized iterator for large records, and allocates
+ * its decoding buffer.  Configured iterators must be deinitialized,
+ * even when they were initialized with
+ * `crdb_record_stream_iterator_init_buf`.
+ *
+ * This only affects `crdb_record_stream_iterator_next_large`: the
+ * other `next` functions decode to fixed-size buffers, and keep
+ * skipping records whose encoding is longer than
+ * CRDB_RECORD_STREAM_BUF_LEN.
+ *
+ * @param config the stream configuration, or NULL for the defaults.
+ */
+bool crdb_record_stream_iterator_configure(struct crdb_record_stream_iterator *,
+    const struct crdb_record_stream_config *config, crdb_error_t *);
+
+/**
+ * Extends an iterator over `fd` to any data appended since it was
+ * initialized or last extended, and resumes from the current cursor.
+ *
+ * This lets consumers tail a live record stream by polling: iterate
+ * until EOF, call `crdb_record_stream_iterator_follow`, and iterate
+ * again.  The mapping grows in place (or moves) with `mremap`, so
+ * pointers into the mapping, e.g., from `next_view`, are invalidated
+ * whenever the stream grew.  A trailing record that was rejected
+ * because it ended at the previous EOF is decoded again, in case it
+ * was only partially written.
+ *
+ * Stop offsets at the previous end of the stream move to the new
+ * end; other stop offsets are preserved.
+ *
+ * @param fd a descriptor for the file the iterator was initialized
+ *   with.  An iterator initialized over an empty file may follow
+ *   any file.
+ *
+ * @return false on error, e.g., if the file shrank.
+ */
+bool crdb_record_stream_iterator_follow(struct crdb_record_stream_iterator *,
+    int fd, crdb_error_t *);
+
 /**
  * Deinitializes an iterator.
  */
@@ -142,6 +318,17 @@ void crdb_record_stream_iterator_deinit(struct crdb_record_stream_iterator *);
  */
 size_t crdb_record_stream_iterator_size(const struct crdb_record_stream_iterator *);
 
+/**
+ * Returns the offset of the last record returned by the iterator: the
+ * offset of its leading header, or of its first byte if it has none.
+ * Only meaningful right after a successful call to a `next` function.
+ *
+ * `crdb_record_stream_iterator_locate_at` at that offset resumes
+ * iteration from the same record.
+ */
+size_t crdb_record_stream_iterator_record_offset(
+    const struct crdb_record_stream_iterator *);
+
 /**
  * Sets the record stream to start looking for valid records at `start_offset`.
  *
@@ -164,6 +351,29 @@ bool crdb_record_stream_iterator_locate_at(struct crdb_record_stream_iterator *,
 void crdb_record_stream_iterator_stop_at(struct crdb_record_stream_iterator *,
     size_t stop_offset);
 
+/**
+ * Moves the iterator to the first record whose generation is at least
+ * `generation`, in a stream that is k-sorted on generations: a record
+ * may only follow records with generations up to `k_slack` higher.
+ *
+ * The search bisects byte offsets, with `locate_at` and a resync to
+ * the next valid record at each probe, until it narrows the range to
+ * a few pages, then scans linearly.  Its cost is logarithmic in the
+ * stream size, plus the records within `k_slack` generations of
+ * `generation`.  It ignores the iterator's current position, but
+ * respects its stop offset.
+ *
+ * Configured iterators accept large records during the search, like
+ * `crdb_record_stream_iterator_next_large`.
+ *
+ * @return true if the next record returned by the iterator is the
+ *   first with a generation at least `generation`, false (and the
+ *   iterator is at EOF) if there is no such record.
+ */
+bool crdb_record_stream_iterator_seek_generation(
+    struct crdb_record_stream_iterator *, uint32_t generation,
+    uint32_t k_slack);
+
 /**
  * Decodes and consumes the next valid record in the iterator.
  *
@@ -177,6 +387,98 @@ bool crdb_record_stream_iterator_next_buf(struct crdb_record_stream_iterator *,
     uint32_t *generation, uint8_t dst[static CRDB_RECORD_STREAM_BUF_LEN],
     size_t *len);
 
+/**
+ * Decodes and consumes the next valid record in the iterator, without
+ * copying it when possible.
+ *
+ * Most records don't contain any forbidden sequence, and their
+ * encoded form is the raw record behind a one-byte run length:
+ * `*data` then points directly into the iterator's buffer (or
+ * mapping), after validating the record's checksum.  Other records
+ * are unstuffed into `scratch`, and `*data` points into `scratch`.
+ *
+ * @param generation populated with the record's generation on success, 0 on failure.
+ * @param data populated with a pointer to the record's contents, valid
+ *   until the iterator is deinitialised or `scratch` is overwritten,
+ *   whichever comes first.  NULL on failure.
+ * @param len populated with the payload size on success, 0 on failure.
+ * @param scratch a buffer for records that must be unstuffed.
+ *
+ * @return true if a valid record was found, false on EOF.
+ */
+bool crdb_record_stream_iterator_next_view(struct crdb_record_stream_iterator *,
+    uint32_t *generation, const uint8_t **data, size_t *len,
+    uint8_t scratch[static CRDB_RECORD_STREAM_BUF_LEN]);
+
+/**
+ * Decodes and consumes the next valid record in a configured iterator,
+ * up to the configured size limit.
+ *
+ * Short records may be returned in place, like with
+ * `crdb_record_stream_iterator_next_view`; others are decoded to the
+ * iterator's heap buffer.
+ *
+ * @param generation populated with the record's generation on success, 0 on failure.
+ * @param data populated with a pointer to the record's contents, valid
+ *   until the next call or until the iterator is deinitialised.  NULL
+ *   on failure.
+ * @param len populated with the payload size on success, 0 on failure.
+ *
+ * @return true if a valid record was found, false on EOF.
+ */
+bool crdb_record_stream_iterator_next_large(struct crdb_record_stream_iterator *,
+    uint32_t *generation, const uint8_t **data, size_t *len);
+
+/**
+ * Callback for parallel scans, invoked once for each valid record.
+ *
+ * Calls may happen concurrently, from arbitrary worker threads, and
+ * in no particular order across workers; a given worker reports its
+ * records in stream order.  `data` is only valid for the duration of
+ * the call.
+ *
+ * @return true to keep scanning, false to stop the scan early.
+ */
+typedef bool crdb_record_stream_scan_fn(void *ctx, uint32_t generation,
+    const uint8_t *data, size_t len);
+
+/**
+ * Calls `callback` on every valid record in `fd`, with up to
+ * `nthreads` threads (including the caller's).
+ *
+ * The mapped file is split in `nthreads` contiguous chunks, and each
+ * worker handles the records whose first byte is in its chunk, with
+ * `crdb_record_stream_iterator_locate_at` and
+ * `crdb_record_stream_iterator_stop_at`.
+ *
+ * @param fd a descriptor for a mmap-able file.  May be repositioned (lseek'ed).
+ * @param nthreads the maximum number of concurrent workers; 0 is
+ *   treated as 1.
+ *
+ * @return true if all records were scanned, false on error or when
+ *   a callback stopped the scan.
+ */
+bool crdb_record_stream_parallel_scan(int fd, size_t nthreads,
+    crdb_record_stream_scan_fn *callback, void *ctx, crdb_error_t *);
+
+/**
+ * Calls `callback` on every valid record in `fd`, like
+ * `crdb_record_stream_parallel_scan`, but with dynamic scheduling.
+ *
+ * The mapped file is split in many ranges of `range_size` bytes, and
+ * each worker repeatedly claims the next unscanned range from a
+ * shared atomic cursor.  Workers that hit cheap ranges (e.g.,
+ * zero-filled or garbage data) simply claim more ranges, so the scan
+ * time tracks the total amount of work, rather than the most
+ * expensive chunk.
+ *
+ * @param range_size the size of each range, in bytes, or 0 for a
+ *   default of 1 MB.
+ */
+bool crdb_record_stream_parallel_scan_dynamic(int fd, size_t nthreads,
+    size_t range_size, crdb_record_stream_scan_fn *callback, void *ctx,
+    crdb_error_t *);
+
 #ifdef HAS_PROTOBUF_C
 /**
  * Deserializes and returns the next valid protobuf message.
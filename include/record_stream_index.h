@@ -0,0 +1,97 @@
+#pragma once
+
+/**
+ * A record stream index is an optional sidecar file that maps record
+ * generations to byte offsets in a record stream, for one entry every
+ * few KB of stream: seeks bisect the in-memory index, and only scan
+ * the stream between two neighbouring entries.
+ *
+ * The index is itself a record stream: each index record has the
+ * generation of an indexed record, and an 8-byte little-endian
+ * payload, the indexed record's offset (as returned by
+ * `crdb_record_stream_iterator_record_offset`).  Writers maintain it
+ * incrementally, with `crdb_record_stream_writer_config.index_fd` and
+ * `index_interval`.
+ *
+ * Entries are only hints.  Seeks check that the entries they use still
+ * point to the record they describe, and otherwise fall back to a
+ * bisection over the whole stream, and mark the index as stale;
+ * readers can then rebuild it lazily, with
+ * `crdb_record_stream_index_rebuild`.  Like
+ * `crdb_record_stream_iterator_seek_generation`, index seeks assume
+ * the stream is k-sorted on generations.
+ *
+ * Indexes are not thread-safe.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "crdb_error.h"
+#include "record_stream.h"
+
+/* The default distance between index entries, in stream bytes. */
+#define CRDB_RECORD_STREAM_INDEX_DEFAULT_INTERVAL ((size_t)64 << 10)
+
+/* The payload of an index record: a little-endian offset. */
+enum { CRDB_RECORD_STREAM_INDEX_ENTRY_LEN = 8 };
+
+struct crdb_record_stream_index;
+
+/**
+ * Loads the index records in `index_fd`.  Index records that don't
+ * look like entries are ignored, and an empty (or missing, with a
+ * negative `index_fd`) index is valid.
+ *
+ * @param index_fd a descriptor for a mmap-able index file, or -1.
+ *   The index does not keep a reference to it.
+ *
+ * @return a new index, or NULL on failure.
+ */
+struct crdb_record_stream_index *crdb_record_stream_index_load(int index_fd,
+    crdb_error_t *);
+
+/**
+ * Releases the index.
+ */
+void crdb_record_stream_index_destroy(struct crdb_record_stream_index *);
+
+/**
+ * Returns the number of entries in the index.
+ */
+size_t crdb_record_stream_index_size(const struct crdb_record_stream_index *);
+
+/**
+ * Returns whether a seek found an entry that doesn't match the
+ * stream since the index was loaded or rebuilt.
+ */
+bool crdb_record_stream_index_stale(const struct crdb_record_stream_index *);
+
+/**
+ * Rebuilds the index from the stream under `it`, with one entry every
+ * `interval` bytes of stream, without moving `it`.
+ *
+ * @param index_fd if non-negative, a descriptor for the index file,
+ *   opened with O_APPEND, which we truncate and rewrite.  Make sure
+ *   no writer appends to that index concurrently.
+ * @param interval the minimum distance between entries, in stream
+ *   bytes; 0 means CRDB_RECORD_STREAM_INDEX_DEFAULT_INTERVAL.
+ */
+bool crdb_record_stream_index_rebuild(struct crdb_record_stream_index *,
+    const struct crdb_record_stream_iterator *it, int index_fd,
+    size_t interval, crdb_error_t *);
+
+/**
+ * Moves `it` to the first record whose generation is at least
+ * `generation`, exactly like
+ * `crdb_record_stream_iterator_seek_generation`, but only bisects the
+ * stream between the index entries around `generation`.
+ *
+ * @return true if the next record returned by the iterator is the
+ *   first with a generation at least `generation`, false (and the
+ *   iterator is at EOF) if there is no such record.
+ */
+bool crdb_record_stream_index_seek(struct crdb_record_stream_index *,
+    struct crdb_record_stream_iterator *it, uint32_t generation,
+    uint32_t k_slack);
@@ -0,0 +1,80 @@
+#pragma once
+
+/**
+ * A record stream reader decodes records from a file descriptor with
+ * read(2) or pread(2), for descriptors that can't be mmap-ed (pipes,
+ * sockets), or where mmap is slow (e.g., some FUSE mounts).
+ *
+ * Readers pull data in a fixed-size buffer, and frame records on
+ * headers across refills, with the same rules as record stream
+ * iterators: memory usage only depends on the maximum record size,
+ * regardless of the stream's size.  Records too long for the
+ * configured limit are skipped without buffering them in full.
+ *
+ * Readers are not thread-safe.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "crdb_error.h"
+#include "record_stream.h"
+
+struct crdb_record_stream_reader;
+
+/**
+ * Creates a reader that consumes `fd` with read(2), from its current
+ * position.
+ *
+ * @param fd a readable descriptor.  The reader does not take
+ *   ownership of `fd`, which must stay open until
+ *   `crdb_record_stream_reader_destroy`.
+ * @param config the stream configuration, or NULL for the defaults.
+ *
+ * @return a new reader, or NULL on failure.
+ */
+struct crdb_record_stream_reader *crdb_record_stream_reader_create(int fd,
+    const struct crdb_record_stream_config *config, crdb_error_t *);
+
+/**
+ * Creates a reader that consumes `fd` with pread(2), from `offset`,
+ * without affecting the descriptor's file position.
+ *
+ * @param offset the file offset at which the record stream starts.
+ */
+struct crdb_record_stream_reader *crdb_record_stream_reader_create_pread(int fd,
+    off_t offset, const struct crdb_record_stream_config *config,
+    crdb_error_t *);
+
+/**
+ * Releases the reader.  Does not close the descriptor.
+ */
+void crdb_record_stream_reader_destroy(struct crdb_record_stream_reader *);
+
+/**
+ * Decodes and consumes the next valid record.
+ *
+ * Calls may block in read(2).  On non-blocking descriptors, this
+ * function fails with EAGAIN when it needs more data; call it again
+ * once the descriptor is readable, and decoding resumes where it
+ * stopped.
+ *
+ * @param generation populated with the record's generation on success, 0 on failure.
+ * @param data populated with a pointer to the record's contents, valid
+ *   until the next call or until the reader is destroyed.  NULL on
+ *   failure.
+ * @param len populated with the payload size on success, 0 on failure.
+ *
+ * @return true if a valid record was found, false on EOF or error.
+ *   `crdb_record_stream_reader_eof` tells them apart.
+ */
+bool crdb_record_stream_reader_next(struct crdb_record_stream_reader *,
+    uint32_t *generation, const uint8_t **data, size_t *len,
+    crdb_error_t *);
+
+/**
+ * Returns whether the reader consumed the whole stream.
+ */
+bool crdb_record_stream_reader_eof(const struct crdb_record_stream_reader *);
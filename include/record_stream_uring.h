@@ -0,0 +1,119 @@
+#pragma once
+
+/**
+ * An io_uring backend for record stream appends.
+ *
+ * A `crdb_record_stream_uring` owns an io_uring instance that appends
+ * encoded records to an O_APPEND file descriptor with
+ * `IORING_OP_WRITEV`.  One thread can thus keep many appends in
+ * flight without blocking in `writev(2)`; each append reports its
+ * outcome to a completion callback.  Appends follow the same retry
+ * and header re-insertion rules as `crdb_record_stream_append_buf`:
+ * failed or short writes are resubmitted (behind a fresh header after
+ * a short write), up to three times.
+ *
+ * Appends may also request a linked `fdatasync`, which only runs
+ * once the write has completed, and must also succeed before the
+ * callback reports success.
+ *
+ * Append functions only queue submissions; the kernel sees them on
+ * the next call to `crdb_record_stream_uring_poll` (or as soon as the
+ * submission queue fills up).  Callbacks only run from the appending
+ * thread, inside `crdb_record_stream_uring_*` calls.
+ *
+ * A uring is not thread-safe: each uring must only be used by one
+ * thread at a time.  Requires Linux 5.3 or later, for the linked
+ * `fdatasync` (`IOSQE_IO_LINK`).
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "crdb_error.h"
+#include "record_stream.h"
+
+struct crdb_record_stream_uring;
+
+/**
+ * Completion callback for io_uring appends.
+ *
+ * @param success whether the records (and the fdatasync, if any) were
+ *   fully written.
+ * @param error describes the failure when `success` is false, NULL
+ *   otherwise.  Only valid for the duration of the call.
+ */
+typedef void crdb_record_stream_uring_cb(void *ctx, bool success,
+    const crdb_error_t *error);
+
+/**
+ * Creates an io_uring instance with room for `depth` in-flight
+ * appends, to append to `fd`.
+ *
+ * Also ensures the descriptor is ready for appends, with
+ * `crdb_record_stream_append_initial`.
+ *
+ * @param fd a file descriptor opened with O_APPEND.  The uring does
+ *   not take ownership of `fd`, which must stay open until
+ *   `crdb_record_stream_uring_destroy`.
+ *
+ * @return a new uring, or NULL on failure (e.g., io_uring is not
+ *   supported).
+ */
+struct crdb_record_stream_uring *crdb_record_stream_uring_create(int fd,
+    unsigned int depth, crdb_error_t *);
+
+/**
+ * Waits for all in-flight appends (their callbacks run as usual),
+ * and releases the uring.  Does not close the descriptor.
+ *
+ * If io_uring fails while we wait, the callbacks for the remaining
+ * appends report that failure: every append's callback runs exactly
+ * once, even here.
+ */
+void crdb_record_stream_uring_destroy(struct crdb_record_stream_uring *);
+
+/**
+ * Queues an append for a record containing `buf[0 ... len - 1]`.
+ * The payload is encoded immediately, so `buf` can be reused as soon
+ * as the call returns.
+ *
+ * @param sync whether to fdatasync the descriptor once the record is
+ *   written.
+ * @param cb the completion callback, or NULL to ignore the outcome.
+ *
+ * @return false if the append could not be queued; `cb` is not called
+ *   in that case.
+ */
+bool crdb_record_stream_uring_append(struct crdb_record_stream_uring *,
+    uint32_t generation, const uint8_t *buf, size_t len, bool sync,
+    crdb_record_stream_uring_cb *cb, void *ctx, crdb_error_t *);
+
+/**
+ * Queues an append for the `n` records in `records`, as a single
+ * `IORING_OP_WRITEV` (barring short writes), like
+ * `crdb_record_stream_append_batch`.  Callback semantics match
+ * `crdb_record_stream_uring_append`: `cb` runs once for the whole
+ * batch.
+ */
+bool crdb_record_stream_uring_append_batch(struct crdb_record_stream_uring *,
+    const struct crdb_record_iov *records, size_t n, bool sync,
+    crdb_record_stream_uring_cb *cb, void *ctx, crdb_error_t *);
+
+/**
+ * Submits any queued append, and processes completions.
+ *
+ * @param min_complete wait until the callbacks for at least that many
+ *   appends have run, or until there is no more in-flight work.
+ *
+ * @return the number of appends whose callback ran, or SIZE_MAX on
+ *   failure.
+ */
+size_t crdb_record_stream_uring_poll(struct crdb_record_stream_uring *,
+    size_t min_complete, crdb_error_t *);
+
+/**
+ * Returns the number of appends whose callback has yet to run.
+ */
+size_t crdb_record_stream_uring_pending(
+    const struct crdb_record_stream_uring *);
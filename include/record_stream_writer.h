@@ -0,0 +1,117 @@
+#pragma once
+
+/**
+ * A record stream writer buffers encoded records in memory, and
+ * appends them to a file descriptor in bulk, with the same retry and
+ * header rules as `crdb_record_stream_append_buf`.
+ *
+ * The word-stuffed encoding is context-free, so buffered records can
+ * simply be concatenated: a writer trades a bounded delay before
+ * records make it to the kernel for fewer write syscalls.  Buffered
+ * records are written when the buffer reaches a size threshold, when
+ * the oldest buffered record reaches a latency threshold, or on
+ * explicit flushes.  Writers can also `fdatasync` their descriptor on
+ * a timer, from a background thread.
+ *
+ * All writer functions are thread-safe.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "crdb_error.h"
+
+struct crdb_record_stream_writer;
+
+struct crdb_record_stream_writer_config {
+	/*
+	 * Write buffered records once they span at least this many
+	 * encoded bytes.  0 means the default, 64 KB.
+	 */
+	size_t flush_bytes;
+	/*
+	 * Write buffered records at most this many microseconds after
+	 * the first one was buffered.  0 disables timed flushes.
+	 */
+	uint64_t flush_latency_us;
+	/*
+	 * `fdatasync` the descriptor every `sync_interval_us`
+	 * microseconds, if anything was written since the last sync.
+	 * 0 disables timed syncs.
+	 */
+	uint64_t sync_interval_us;
+	/*
+	 * Maximum payload size, like
+	 * `crdb_record_stream_config.max_record_len`.  0 means the
+	 * default, CRDB_RECORD_STREAM_MAX_LEN.
+	 */
+	size_t max_record_len;
+	/*
+	 * If non-zero, maintain a sidecar index (see
+	 * record_stream_index.h) in `index_fd`, with an entry for the
+	 * first record written at least `index_interval` bytes after
+	 * the last indexed one.  Entries are appended after each
+	 * flush; failures to update the index are ignored, since
+	 * readers never trust it.  0 disables indexing.
+	 */
+	size_t index_interval;
+	/*
+	 * A file descriptor opened with O_APPEND for the index, which
+	 * must stay open until `crdb_record_stream_writer_destroy`.
+	 * Only used when `index_interval` is non-zero.
+	 */
+	int index_fd;
+};
+
+/**
+ * Creates a writer that appends to `fd`.
+ *
+ * The writer ensures the descriptor is ready for appends, with
+ * `crdb_record_stream_append_initial`, and starts a background thread
+ * if the configuration enables any timer.
+ *
+ * @param fd a file descriptor opened with O_APPEND.  The writer does
+ *   not take ownership of `fd`, which must stay open until
+ *   `crdb_record_stream_writer_destroy`.
+ * @param config the writer configuration, or NULL for the defaults
+ *   (flush 64 KB at a time, without any timer, for records of up to
+ *   CRDB_RECORD_STREAM_MAX_LEN bytes).
+ *
+ * @return a new writer, or NULL on failure.
+ */
+struct crdb_record_stream_writer *crdb_record_stream_writer_create(int fd,
+    const struct crdb_record_stream_writer_config *config, crdb_error_t *);
+
+/**
+ * Flushes any buffered record, stops the background thread, and
+ * releases the writer.  Does not close the descriptor.
+ *
+ * @return false if the final flush or an earlier background flush or
+ *   sync failed.  The writer is destroyed regardless.
+ */
+bool crdb_record_stream_writer_destroy(struct crdb_record_stream_writer *,
+    crdb_error_t *);
+
+/**
+ * Buffers a record containing `buf[0 ... len - 1]`, and writes out
+ * the buffer if it reached the size threshold.
+ *
+ * @return false if the record is invalid, if writing the buffer
+ *   failed, or to report a failed background flush or sync since the
+ *   last call.
+ */
+bool crdb_record_stream_writer_append(struct crdb_record_stream_writer *,
+    uint32_t generation, const uint8_t *buf, size_t len, crdb_error_t *);
+
+/**
+ * Writes all buffered records to the descriptor.
+ */
+bool crdb_record_stream_writer_flush(struct crdb_record_stream_writer *,
+    crdb_error_t *);
+
+/**
+ * Writes all buffered records to the descriptor, and `fdatasync`s it.
+ */
+bool crdb_record_stream_writer_sync(struct crdb_record_stream_writer *,
+    crdb_error_t *);
@@ -53,6 +53,7 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 /**
  * We use a two-byte header.
@@ -63,9 +64,44 @@ enum { CRDB_WORD_STUFF_HEADER_SIZE = 2 };
  * Returns a pointer to the first byte of the first occurrence of the
  * word stuffing header in `data[0 ... num - 1]`, or `data + num` if
  * none.
+ *
+ * The search uses the widest SIMD kernel (SSE2, AVX2, or AVX-512BW)
+ * available on the current CPU, as detected once at load time.
  */
 const uint8_t *crdb_word_stuff_header_find(const uint8_t *data, size_t num);
 
+/**
+ * Finds every occurrence of the word stuffing header in
+ * `data[0 ... num - 1]` in one pass, and marks them in `bitmap`: bit
+ * `i % 64` of `bitmap[i / 64]` is set iff a header begins at
+ * `data[i]`.  All other bits in the first `ceil(num / 64)` words are
+ * cleared.
+ *
+ * This lets callers frame a large buffer (e.g., a whole mmap-ed
+ * record stream) once, instead of searching for the next header
+ * once per record.
+ *
+ * @param bitmap must have room for `(num + 63) / 64` words.
+ *
+ * @return the number of headers found.
+ */
+size_t crdb_word_stuff_header_bitmap(uint64_t *bitmap, const uint8_t *data,
+    size_t num);
+
+/**
+ * Writes the offsets of the first `capacity` (or fewer) occurrences
+ * of the word stuffing header in `data[0 ... num - 1]` to `offsets`,
+ * in increasing order.
+ *
+ * When the return value equals `capacity`, there may be more
+ * headers: headers never overlap, so callers can resume the search
+ * at `data + offsets[capacity - 1] + CRDB_WORD_STUFF_HEADER_SIZE`.
+ *
+ * @return the number of offsets written to `offsets`.
+ */
+size_t crdb_word_stuff_header_offsets(uint64_t *offsets, size_t capacity,
+    const uint8_t *data, size_t num);
+
 /**
  * Returns the worst-case stuffed size for an input of `in_size` bytes.
  *
@@ -104,6 +140,75 @@ uint8_t *crdb_word_stuff_header(uint8_t dst[static CRDB_WORD_STUFF_HEADER_SIZE])
  */
 uint8_t *crdb_word_stuff_encode(uint8_t *dst, const void *src, size_t src_size);
 
+/**
+ * Word stuffs `src[0 ... src_size - 1]` into `dst`, exactly like
+ * `crdb_word_stuff_encode`, and updates the CRC32C accumulator `*crc`
+ * with every source byte in the same pass.
+ *
+ * @return a pointer to one past the last byte written in `dst`.
+ */
+uint8_t *crdb_word_stuff_encode_crc32c(uint8_t *dst, const void *src,
+    size_t src_size, uint32_t *crc);
+
+/**
+ * An incremental word stuffing encoder, for inputs that aren't
+ * contiguous in memory.  Feeding the input in any number of pieces
+ * produces exactly the same bytes as `crdb_word_stuff_encode` on the
+ * concatenated input, including when a forbidden sequence straddles
+ * two pieces.
+ *
+ * The encoder writes directly to its destination, and backpatches
+ * run sizes when each run ends: the destination must have room for
+ * `crdb_word_stuffed_size(total_size, false)` bytes.
+ *
+ * All fields are private.
+ */
+struct crdb_word_stuff_encoder {
+	uint8_t *dst;
+	/* Where to write the current run's size, once it's known. */
+	uint8_t *run_size_dst;
+	size_t run_size;
+	size_t max_run_size;
+	uint32_t crc;
+	bool checksum;
+	/*
+	 * The last byte fed was the first byte of the header, and
+	 * may be the beginning of a forbidden sequence.
+	 */
+	bool pending_header_byte;
+};
+
+/**
+ * Initializes `encoder` to write to `dst`.
+ */
+void crdb_word_stuff_encoder_init(struct crdb_word_stuff_encoder *encoder,
+    uint8_t *dst);
+
+/**
+ * Initializes `encoder` to write to `dst`, and to update the CRC32C
+ * accumulator `crc` with every source byte, like
+ * `crdb_word_stuff_encode_crc32c`.
+ */
+void crdb_word_stuff_encoder_init_crc32c(
+    struct crdb_word_stuff_encoder *encoder, uint8_t *dst, uint32_t crc);
+
+/**
+ * Encodes `src[0 ... src_size - 1]`, after all the bytes fed so far.
+ */
+void crdb_word_stuff_encoder_feed(struct crdb_word_stuff_encoder *encoder,
+    const void *src, size_t src_size);
+
+/**
+ * Completes the encoding.
+ *
+ * @param crc if non-NULL, populated with the CRC32C accumulator for
+ *   encoders initialized with `crdb_word_stuff_encoder_init_crc32c`.
+ *
+ * @return a pointer to one past the last byte written in `dst`.
+ */
+uint8_t *crdb_word_stuff_encoder_finish(struct crdb_word_stuff_encoder *encoder,
+    uint32_t *crc);
+
 /**
  * Decodes the word-stuffed input in `src` into `dst`, which must have room
  * for `src_size - 1` bytes.
@@ -112,3 +217,140 @@ uint8_t *crdb_word_stuff_encode(uint8_t *dst, const void *src, size_t src_size);
  *   decidedly invalid input.
  */
 uint8_t *crdb_word_stuff_decode(uint8_t *dst, const void *src, size_t src_size);
+
+/**
+ * Word stuffs the concatenation of `src[0 ... src_count - 1]`,
+ * exactly like `crdb_word_stuff_encode`, without copying any literal:
+ * the encoded output is described by `dst[0 ... *dst_count - 1]`,
+ * with run sizes in the side buffer `meta`, and literal runs pointing
+ * into `src` buffers.  This lets callers pass long payloads straight
+ * to writev(2).
+ *
+ * Adjacent output bytes are coalesced into the same iovec, so a long
+ * payload without any forbidden sequence only needs two iovecs for
+ * every MAX_REMAINING_RUN (64008) bytes.
+ *
+ * @param dst_count populated with the number of iovecs written on
+ *   success.
+ * @param meta the side buffer for run sizes, of `meta_capacity`
+ *   bytes.  It needs 2 bytes for each run (i.e., for each forbidden
+ *   sequence in the input).
+ *
+ * @return false if `dst` or `meta` is too small for that input.
+ */
+bool crdb_word_stuff_encode_iov(struct iovec *dst, size_t dst_capacity,
+    size_t *dst_count, uint8_t *meta, size_t meta_capacity,
+    const struct iovec *src, size_t src_count);
+
+/**
+ * A resumable word stuffing decoder, for encoded inputs that aren't
+ * contiguous in memory.  Feeding the input in any number of
+ * fragments produces exactly the same bytes as
+ * `crdb_word_stuff_decode` on the concatenated input, and fails on
+ * exactly the same inputs.
+ *
+ * The decoder writes directly to its destination, which must have
+ * room for `total_size - 1` bytes, like for `crdb_word_stuff_decode`.
+ * The implicit header after a short run is only written once the
+ * next run's size is known, so the decoder never writes more than
+ * that, even for invalid input.
+ *
+ * All fields are private.
+ */
+struct crdb_word_stuff_decoder {
+	uint8_t *dst;
+	/* Literals left to copy in the current run. */
+	size_t run_remaining;
+	/* The current run's size limit, or 0 before the first run. */
+	size_t max_run_size;
+	uint32_t crc;
+	size_t crc_skip;
+	bool checksum;
+	/* Whether the previous run is followed by an implicit header. */
+	bool implicit_header;
+	/* The first byte of a 2-byte run size split across fragments. */
+	bool has_run_size_low;
+	uint8_t run_size_low;
+	bool failed;
+};
+
+/**
+ * Initializes `decoder` to write to `dst`.
+ */
+void crdb_word_stuff_decoder_init(struct crdb_word_stuff_decoder *decoder,
+    uint8_t *dst);
+
+/**
+ * Initializes `decoder` to write to `dst`, and to update the CRC32C
+ * accumulator `crc` with the decoded bytes, except for the first
+ * `crc_skip`, like `crdb_word_stuff_decode_crc32c`.
+ */
+void crdb_word_stuff_decoder_init_crc32c(
+    struct crdb_word_stuff_decoder *decoder, uint8_t *dst, size_t crc_skip,
+    uint32_t crc);
+
+/**
+ * Decodes `src[0 ... src_size - 1]`, after all the bytes fed so far.
+ *
+ * @return false if the input is already known to be invalid.  Once
+ *   a decoder fails, it ignores further input.
+ */
+bool crdb_word_stuff_decoder_feed(struct crdb_word_stuff_decoder *decoder,
+    const void *src, size_t src_size);
+
+/**
+ * Completes the decoding.
+ *
+ * @param crc if non-NULL, populated with the CRC32C accumulator for
+ *   decoders initialized with `crdb_word_stuff_decoder_init_crc32c`.
+ *
+ * @return a pointer to one past the last byte written in `dst`, or
+ *   NULL if the whole input was invalid or truncated.
+ */
+uint8_t *crdb_word_stuff_decoder_finish(struct crdb_word_stuff_decoder *decoder,
+    uint32_t *crc);
+
+/**
+ * Decodes the word-stuffed input in `buf[0 ... size - 1]` onto
+ * itself, like `crdb_word_stuff_decode`: the decoded bytes start at
+ * `buf[0]`.
+ *
+ * Decoding only ever shrinks the data, and each write trails the
+ * reads by at least one byte, so callers that read encoded records in
+ * a private buffer don't need a second buffer to decode them.  On
+ * failure, the contents of `buf` are unspecified.
+ *
+ * @return a pointer to one past the last decoded byte in `buf`, or
+ *   NULL on decidedly invalid input.
+ */
+uint8_t *crdb_word_stuff_decode_inplace(uint8_t *buf, size_t size);
+
+/**
+ * Returns the decoded contents of `src[0 ... src_size - 1]` in place,
+ * when the input is a single literal run: that's always the case for
+ * inputs shorter than 252 bytes without the forbidden sequence.
+ *
+ * @param len populated with the decoded size on success.
+ *
+ * @return a pointer to the first decoded byte in `src`, or NULL if
+ *   the input isn't a valid single run; callers must then fall back
+ *   to `crdb_word_stuff_decode`.
+ */
+const uint8_t *crdb_word_stuff_decode_view(const void *src, size_t src_size,
+    size_t *len);
+
+/**
+ * Decodes the word-stuffed input in `src` into `dst`, exactly like
+ * `crdb_word_stuff_decode`, and updates the CRC32C accumulator `*crc`
+ * with the decoded bytes as they are written, except for the first
+ * `crc_skip` decoded bytes.
+ *
+ * This lets callers validate a checksummed record in the same pass
+ * as the decoding, rather than reading the decoded bytes again.  On
+ * failure, `*crc` is left in an unspecified state.
+ *
+ * @return a pointer to one past the last byte written in `dst`, or NULL on
+ *   decidedly invalid input.
+ */
+uint8_t *crdb_word_stuff_decode_crc32c(uint8_t *dst, const void *src,
+    size_t src_size, size_t crc_skip, uint32_t *crc);
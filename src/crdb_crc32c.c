@@ -0,0 +1,224 @@
+/*
+ * Copyright 2021 Backtrace I/O, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "crdb_crc32c.h"
+
+#include <immintrin.h>
+#include <string.h>
+
+/*
+ * The crc32 instruction has a latency of 3 cycles, but a throughput
+ * of one per cycle.  A serial chain of 8-byte steps is thus only
+ * good for ~2.7 bytes/cycle.  For long inputs, we instead checksum
+ * three independent blocks in parallel, and merge the three partial
+ * CRCs by shifting them with carry-less multiplications.
+ *
+ * Each round handles three blocks of LONG_BLOCK or SHORT_BLOCK bytes;
+ * whatever's left goes through the serial loop.
+ */
+#define LONG_BLOCK 4096
+#define SHORT_BLOCK 256
+
+/*
+ * Inputs shorter than this don't benefit from interleaving, and
+ * always take the inline serial path, without any indirect call.
+ */
+#define INTERLEAVE_MIN (3 * SHORT_BLOCK)
+
+/* CRC32C polynomial, bit-reflected, without the x^32 term. */
+#define POLY 0x82F63B78UL
+
+/*
+ * Multiplying a partial CRC by x^(8n) mod P appends n zero bytes to
+ * the corresponding message.  With bit-reflected operands, the
+ * carry-less product of two 32-bit values is shifted by one bit, and
+ * the crc32 instruction multiplies its 64-bit input by x^32 before
+ * reducing: multiplying by the constant x^(8n - 33) mod P and
+ * reducing with crc32 thus yields the shifted CRC.
+ */
+struct shift_constants {
+	uint32_t long_block;
+	uint32_t long_block2;
+	uint32_t short_block;
+	uint32_t short_block2;
+};
+
+static struct shift_constants shifts;
+
+typedef uint32_t crc32c_fn(uint32_t, const uint8_t *, size_t);
+
+static inline uint32_t
+crc32c_serial(uint32_t acc, const uint8_t *buf, size_t len)
+{
+	uint64_t acc64 = acc;
+
+	while (len >= sizeof(uint64_t)) {
+		uint64_t bytes;
+
+		memcpy(&bytes, buf, sizeof(bytes));
+		acc64 = _mm_crc32_u64(acc64, bytes);
+		buf += sizeof(bytes);
+		len -= sizeof(bytes);
+	}
+
+	acc = (uint32_t)acc64;
+	if (len & 4) {
+		uint32_t bytes;
+
+		memcpy(&bytes, buf, sizeof(bytes));
+		acc = _mm_crc32_u32(acc, bytes);
+		buf += sizeof(bytes);
+	}
+
+	if (len & 2) {
+		uint16_t bytes;
+
+		memcpy(&bytes, buf, sizeof(bytes));
+		acc = _mm_crc32_u16(acc, bytes);
+		buf += sizeof(bytes);
+	}
+
+	if (len & 1)
+		acc = _mm_crc32_u8(acc, *buf);
+
+	return acc;
+}
+
+static uint32_t
+crc32c_serial_fn(uint32_t acc, const uint8_t *buf, size_t len)
+{
+
+	return crc32c_serial(acc, buf, len);
+}
+
+/**
+ * Returns x^n mod P, bit-reflected.  This is only used to compute
+ * the shift constants once, so we simply multiply by x n times.
+ */
+static uint32_t
+xn_mod_p(size_t n)
+{
+	/* x^0 */
+	uint32_t ret = 0x80000000UL;
+
+	for (size_t i = 0; i < n; i++)
+		ret = (ret >> 1) ^ ((ret & 1) ? POLY : 0);
+
+	return ret;
+}
+
+__attribute__((__target__("pclmul")))
+static inline uint32_t
+crc32c_shift(uint32_t crc, uint32_t constant)
+{
+	__m128i product;
+
+	product = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc),
+	    _mm_cvtsi32_si128(constant), 0);
+	return _mm_crc32_u64(0, _mm_cvtsi128_si64(product));
+}
+
+/**
+ * Checksums three consecutive blocks of `block` bytes each, and
+ * returns the combined CRC for all `3 * block` bytes.
+ */
+__attribute__((__always_inline__, __target__("pclmul")))
+static inline uint32_t
+crc32c_3way(uint32_t acc, const uint8_t *buf, size_t block,
+    uint32_t shift_block, uint32_t shift_block2)
+{
+	uint64_t crc0 = acc, crc1 = 0, crc2 = 0;
+
+	for (size_t i = 0; i < block; i += sizeof(uint64_t)) {
+		uint64_t bytes0, bytes1, bytes2;
+
+		memcpy(&bytes0, buf + i, sizeof(bytes0));
+		memcpy(&bytes1, buf + block + i, sizeof(bytes1));
+		memcpy(&bytes2, buf + 2 * block + i, sizeof(bytes2));
+		crc0 = _mm_crc32_u64(crc0, bytes0);
+		crc1 = _mm_crc32_u64(crc1, bytes1);
+		crc2 = _mm_crc32_u64(crc2, bytes2);
+	}
+
+	return crc32c_shift(crc0, shift_block2) ^
+	    crc32c_shift(crc1, shift_block) ^ (uint32_t)crc2;
+}
+
+__attribute__((__target__("pclmul")))
+static uint32_t
+crc32c_pclmul(uint32_t acc, const uint8_t *buf, size_t len)
+{
+
+	while (len >= 3 * LONG_BLOCK) {
+		acc = crc32c_3way(acc, buf, LONG_BLOCK,
+		    shifts.long_block, shifts.long_block2);
+		buf += 3 * LONG_BLOCK;
+		len -= 3 * LONG_BLOCK;
+	}
+
+	while (len >= 3 * SHORT_BLOCK) {
+		acc = crc32c_3way(acc, buf, SHORT_BLOCK,
+		    shifts.short_block, shifts.short_block2);
+		buf += 3 * SHORT_BLOCK;
+		len -= 3 * SHORT_BLOCK;
+	}
+
+	return crc32c_serial(acc, buf, len);
+}
+
+/*
+ * Only select the interleaved kernel once the shift constants are
+ * ready; until then, long inputs use the serial loop.
+ */
+static crc32c_fn *crc32c_long = crc32c_serial_fn;
+
+__attribute__((__constructor__))
+static void
+crc32c_init(void)
+{
+
+	__builtin_cpu_init();
+	if (!__builtin_cpu_supports("pclmul"))
+		return;
+
+	shifts = (struct shift_constants) {
+		.long_block = xn_mod_p(8 * LONG_BLOCK - 33),
+		.long_block2 = xn_mod_p(8 * 2 * LONG_BLOCK - 33),
+		.short_block = xn_mod_p(8 * SHORT_BLOCK - 33),
+		.short_block2 = xn_mod_p(8 * 2 * SHORT_BLOCK - 33),
+	};
+
+	__atomic_store_n(&crc32c_long, crc32c_pclmul, __ATOMIC_RELEASE);
+	return;
+}
+
+uint32_t
+crdb_crc32c_update(uint32_t acc, const void *buf, size_t len)
+{
+
+	/* The common case: a 20-40 byte record. */
+	if (__builtin_expect(len < INTERLEAVE_MIN, 1))
+		return crc32c_serial(acc, buf, len);
+
+	return __atomic_load_n(&crc32c_long, __ATOMIC_ACQUIRE)(acc, buf, len);
+}
@@ -26,7 +26,9 @@
 
 #include <assert.h>
 #include <errno.h>
-#include <smmintrin.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -34,29 +36,29 @@
 #include <sys/uio.h>
 #include <unistd.h>
 
+#include "crdb_crc32c.h"
+#include "record_stream_internal.h"
 #include "word_stuff.h"
 
-#define CRDB_ARRAY_SIZE(X) (sizeof(X) / sizeof(*(X)))
-
-#define CRDB_ERROR_SET_(E, M, N, ...) ({ _crdb_error_set(E, M, (N)); false; })
-
-#define crdb_error_set(E, M, ...) CRDB_ERROR_SET_((E), (M), ##__VA_ARGS__, 0)
+/* Zero skipping looks at blocks of this many bytes. */
+#define ZERO_SKIP_BLOCK 64
 
 /*
- * Fill the record_header.crc field with CRC_INITIAL_VALUE when
- * computing the checksum: crc32c is vulnerable to 0-prefixing,
- * so we make sure the initial bytes are non-zero.
+ * Generation seeks stop bisecting once the candidate range is at most
+ * this many bytes long, and scan the rest linearly.
  */
-#define CRC_INITIAL_VALUE ((uint32_t)-1)
-
-struct record_header {
-	uint32_t crc;
-	uint32_t generation;
-};
+#define SEEK_LINEAR_SPAN 8192
 
-struct write_record {
-	struct record_header header;
-	uint8_t data[CRDB_RECORD_STREAM_MAX_LEN];
+/*
+ * A record's payload: a buffer or, with protobuf-c, a message that
+ * we pack straight into the encoder.  `len` is the (packed) size.
+ */
+struct record_payload {
+	const uint8_t *buf;
+	size_t len;
+#ifdef HAS_PROTOBUF_C
+	const ProtobufCMessage *message;
+#endif /* HAS_PROTOBUF_C */
 };
 
 struct read_record {
@@ -64,68 +66,131 @@ struct read_record {
 	uint8_t data[CRDB_RECORD_STREAM_BUF_LEN];
 };
 
-static inline void
-_crdb_error_set(struct crdb_error *error, const char *message,
-    unsigned long long n)
+/**
+ * Overwrites the crc field in an encoded record, which was encoded
+ * with CRC_INITIAL_VALUE in that field.
+ *
+ * The placeholder never contains a forbidden sequence, so the first
+ * run always starts with the 4 crc bytes, at `encoded[1 ... 4]`.
+ *
+ * @return false if the patched bytes introduce a forbidden sequence,
+ *   in which case the caller must re-encode the record.
+ */
+static bool
+patch_encoded_crc(uint8_t *encoded, uint32_t crc)
 {
+	enum {
+		/* Run size byte + crc + the byte after the crc. */
+		PATCH_WINDOW = 1 + sizeof(crc) + 1,
+	};
 
-	if (error == NULL)
-		return;
+	static_assert(offsetof(struct record_header, crc) == 0,
+	    "The crc must be the first field in a record.");
 
-	error->message = message;
-	error->error = n;
-	return;
+	/*
+	 * The first run is at least as long as the crc field, and
+	 * there's always a generation after the crc, so the encoded
+	 * record spans at least PATCH_WINDOW bytes.
+	 */
+	memcpy(&encoded[1], &crc, sizeof(crc));
+	return crdb_word_stuff_header_find(encoded, PATCH_WINDOW) ==
+	    encoded + PATCH_WINDOW;
 }
 
-/**
- * This is our internal reference implementation.  You probably want
- * something else that has higher performance.
+#ifdef HAS_PROTOBUF_C
+/*
+ * Adapts a word stuffing encoder to protobuf-c's buffer interface,
+ * so messages are packed and encoded in one pass.
  */
-static uint32_t
-crdb_crc32c(const void *buf, size_t len)
+struct encoder_buffer {
+	ProtobufCBuffer base;
+	struct crdb_word_stuff_encoder *encoder;
+};
+
+static void
+encoder_buffer_append(ProtobufCBuffer *base, size_t len, const uint8_t *data)
 {
-        uint32_t acc = 0;
-        size_t i;
+	struct encoder_buffer *buffer = (struct encoder_buffer *)base;
 
-        for (i = 0; i + sizeof(uint32_t) <= len; i += sizeof(uint32_t)) {
-                uint32_t bytes;
+	crdb_word_stuff_encoder_feed(buffer->encoder, data, len);
+	return;
+}
+#endif /* HAS_PROTOBUF_C */
 
-                memcpy(&bytes, (const uint8_t *)buf + i, sizeof(bytes));
-                acc = _mm_crc32_u32(acc, bytes);
-        }
+/**
+ * Feeds the record's header and payload to `encoder`, without
+ * staging them in a contiguous buffer.
+ */
+static void
+feed_record(struct crdb_word_stuff_encoder *encoder,
+    const struct record_header *header, const struct record_payload *payload)
+{
 
-        for (; i < len; i++)
-                acc = _mm_crc32_u8(acc, ((const uint8_t *)buf)[i]);
+	crdb_word_stuff_encoder_feed(encoder, header, sizeof(*header));
+#ifdef HAS_PROTOBUF_C
+	if (payload->message != NULL) {
+		struct encoder_buffer buffer = {
+			.base.append = encoder_buffer_append,
+			.encoder = encoder,
+		};
+		size_t serialized_size;
+
+		serialized_size = protobuf_c_message_pack_to_buffer(
+		    payload->message, &buffer.base);
+		assert(serialized_size <= payload->len);
+		(void)serialized_size;
+		return;
+	}
+#endif /* HAS_PROTOBUF_C */
 
-        return acc;
+	crdb_word_stuff_encoder_feed(encoder, payload->buf, payload->len);
+	return;
 }
 
 /**
- * Encodes the write record to `encoded[0 ... *encoded_size - 1]`.
+ * Encodes the record to `encoded[0 ... *encoded_size - 1]`.
+ *
+ * @param encoded a buffer of at least
+ *   `CRDB_RECORD_STREAM_ENCODED_BOUND(payload->len)` bytes.
  */
 static bool
-encode_record(
-    uint8_t encoded[static CRDB_WORD_STUFFED_BOUND(sizeof(struct write_record))],
-    size_t *encoded_size, struct write_record *record, size_t data_len,
-    crdb_error_t *ce)
+encode_record(uint8_t *encoded, size_t *encoded_size, uint32_t generation,
+    const struct record_payload *payload, crdb_error_t *ce)
 {
-	enum { MAX_ENCODED = CRDB_WORD_STUFFED_BOUND(sizeof(struct write_record)) };
-	size_t record_size;
+	struct record_header header = {
+		.crc = CRC_INITIAL_VALUE,
+		.generation = generation,
+	};
+	struct crdb_word_stuff_encoder encoder;
 	uint8_t *write_ptr;
+	uint32_t crc;
 
-	static_assert((size_t)MAX_ENCODED <= CRDB_RECORD_STREAM_BUF_LEN,
+	static_assert(CRDB_RECORD_STREAM_ENCODED_MAX <= CRDB_RECORD_STREAM_BUF_LEN,
 	    "The maximum encoded size must fit in the read record size limit.");
 
-	if (data_len > CRDB_RECORD_STREAM_MAX_LEN)
+	if (payload->len > CRDB_RECORD_STREAM_LARGE_MAX_LEN)
 		return crdb_error_set(ce, "crdb_record_stream data too long");
 
-	record->header.crc = CRC_INITIAL_VALUE;
-	record_size = sizeof(struct record_header) + data_len;
-	record->header.crc = crdb_crc32c(record, record_size);
+	assert(crdb_word_stuffed_size(sizeof(header) + payload->len, true) <=
+	    CRDB_RECORD_STREAM_ENCODED_BOUND(payload->len));
 
-	assert(crdb_word_stuffed_size(record_size, true) <= MAX_ENCODED);
+	/*
+	 * Checksum the record while we encode it with the placeholder
+	 * crc field, and patch the encoded crc bytes at the end.  That
+	 * only fails when the actual crc bytes form a forbidden
+	 * sequence (about 1 in 16K records): re-encode from scratch
+	 * in that case.
+	 */
+	crdb_word_stuff_encoder_init_crc32c(&encoder, encoded, 0);
+	feed_record(&encoder, &header, payload);
+	write_ptr = crdb_word_stuff_encoder_finish(&encoder, &crc);
+	if (patch_encoded_crc(encoded, crc) == false) {
+		header.crc = crc;
+		crdb_word_stuff_encoder_init(&encoder, encoded);
+		feed_record(&encoder, &header, payload);
+		write_ptr = crdb_word_stuff_encoder_finish(&encoder, NULL);
+	}
 
-	write_ptr = crdb_word_stuff_encode(encoded, record, record_size);
 	/*
 	 * The beginning and end of file act as implicit headers, and
 	 * we simply have to separate records with the 2-byte header;
@@ -142,42 +207,133 @@ encode_record(
 	return true;
 }
 
+/*
+ * Zero-copy appends of large records pass at most this many iovecs
+ * to writev(2), well under IOV_MAX, and use this many bytes for run
+ * sizes; payloads with too many forbidden sequences fall back to an
+ * encoded copy.
+ */
+enum {
+	APPEND_IOV_MAX = 256,
+	APPEND_META_SIZE = 2 * APPEND_IOV_MAX,
+};
+
+size_t
+crdb_record_stream_resume_offset(const struct iovec *iov, size_t iov_count,
+    size_t written)
+{
+	size_t base = 0;
+	size_t ret = 0;
+
+	/*
+	 * Encoded records only contain a header at their very end, so
+	 * headers mark record boundaries.  A header that starts after
+	 * `written` doesn't matter, and no header straddles two
+	 * buffers: the trailing header never shares a buffer with
+	 * stuffed data.
+	 */
+	for (size_t i = 0; i < iov_count && base <= written; i++) {
+		const uint8_t *data = iov[i].iov_base;
+		size_t limit = written - base + CRDB_WORD_STUFF_HEADER_SIZE;
+		const uint8_t *end = data +
+		    ((iov[i].iov_len < limit) ? iov[i].iov_len : limit);
+		const uint8_t *cursor = data;
+
+		for (;;) {
+			const uint8_t *header;
+			size_t offset;
+
+			header = crdb_word_stuff_header_find(cursor,
+			    end - cursor);
+			if (header == end)
+				break;
+
+			/*
+			 * The record is safe if its trailing header made
+			 * it whole, or not at all: the header we insert
+			 * before the retry then terminates it.  A lone
+			 * first byte would corrupt it.
+			 */
+			offset = base + (header - data);
+			if (offset + CRDB_WORD_STUFF_HEADER_SIZE <= written ||
+			    offset == written)
+				ret = offset + CRDB_WORD_STUFF_HEADER_SIZE;
+
+			cursor = header + CRDB_WORD_STUFF_HEADER_SIZE;
+		}
+
+		base += iov[i].iov_len;
+	}
+
+	return ret;
+}
+
 /**
- * Repeatedly attempts to write `buf` to `fd`, which is expected to be
- * in O_APPEND mode.
+ * Skips the first `skip` bytes in `iov[0 ... end - iov - 1]`, and
+ * returns the first buffer with data left (or `end`).
+ */
+static struct iovec *
+iov_skip(struct iovec *iov, struct iovec *end, size_t skip)
+{
+
+	for (; iov < end; iov++) {
+		if (skip < iov->iov_len) {
+			iov->iov_base = (uint8_t *)iov->iov_base + skip;
+			iov->iov_len -= skip;
+			return iov;
+		}
+
+		skip -= iov->iov_len;
+	}
+
+	assert(skip == 0);
+	return end;
+}
+
+/**
+ * Repeatedly attempts to write `iov[1 ... iov_count - 1]` to `fd`,
+ * which is expected to be in O_APPEND mode.
  *
- * The buffer is word-stuffed and ends with a header for the next record.
+ * The buffers are one or more word-stuffed records, each ending with
+ * a header for the next record.  `iov[0]` is reserved for a header
+ * before the buffers, when a previous attempt was short.
  */
 static bool
-append_to_fd(int fd, const void *buf, size_t count, crdb_error_t *ce)
+append_iov_to_fd(int fd, struct iovec *iov, size_t iov_count,
+    crdb_error_t *ce)
 {
 	static const size_t num_tries = 3;
+	struct iovec *const iov_end = iov + iov_count;
+	/* The first buffer with data left to write. */
+	struct iovec *first = iov + 1;
 	uint8_t header[CRDB_WORD_STUFF_HEADER_SIZE];
-	struct iovec iov[] = {
-		{
-			/*
-			 * The first write does not include a header:
-			 * we assume the previous write inserted one
-			 * for us.
-			 */
-			.iov_base = header,
-			.iov_len = 0
-		},
-		{
-			.iov_base = (void *)buf,
-			.iov_len = count,
-		}
-	};
-	size_t expected = count;
+	size_t count = 0;
+	size_t expected;
 	ssize_t written;
 	int err;
 	/* Flip to true when at least one write was short. */
 	bool partial_write = false;
 
+	assert(iov_count <= IOV_MAX);
+	/*
+	 * The first write does not include a header: we assume the
+	 * previous write inserted one for us.
+	 */
+	iov[0] = (struct iovec) {
+		.iov_base = header,
+		.iov_len = 0,
+	};
+
+	for (size_t i = 1; i < iov_count; i++)
+		count += iov[i].iov_len;
+
+	expected = count;
 	for (size_t i = 0; i < num_tries; i++) {
 		const uint8_t *end;
+		size_t header_len = first[-1].iov_len;
+		size_t resume;
 
-		written = writev(fd, iov, CRDB_ARRAY_SIZE(iov));
+		written = writev(fd, first - 1, iov_end - (first - 1));
 		if ((size_t)written == expected)
 			break;
 
@@ -196,11 +352,40 @@ append_to_fd(int fd, const void *buf, size_t count, crdb_error_t *ce)
 		 * after the short write, we may also lose that
 		 * record... but we expect write failures to be sticky
 		 * (media failure or exhausted storage quotas).
+		 *
+		 * Records that made it to disk whole are done: only
+		 * retry from the first one that didn't, so readers
+		 * never see a record twice.
 		 */
 		partial_write = true;
+
+		/*
+		 * A record before the header may only be complete with
+		 * that header: finish writing it, rather than leave a
+		 * stray byte behind.
+		 */
+		if ((size_t)written < header_len) {
+			first[-1].iov_base = (uint8_t *)first[-1].iov_base +
+			    written;
+			first[-1].iov_len -= (size_t)written;
+			expected -= (size_t)written;
+			continue;
+		}
+
+		resume = crdb_record_stream_resume_offset(first,
+		    iov_end - first,
+		    ((size_t)written > header_len) ?
+		    (size_t)written - header_len : 0);
+		count -= resume;
+		first = iov_skip(first, iov_end, resume);
+
+		/* Everything before `first` is written; reuse a slot. */
 		end = crdb_word_stuff_header(header);
 		assert(end == header + sizeof(header));
-		iov[0].iov_len = sizeof(header);
+		first[-1] = (struct iovec) {
+			.iov_base = header,
+			.iov_len = sizeof(header),
+		};
 		expected = count + sizeof(header);
 	}
 
@@ -217,7 +402,7 @@ append_to_fd(int fd, const void *buf, size_t count, crdb_error_t *ce)
 		 * life, and there's not much we can do against what
 		 * is probably a storage media or quota problem.
 		 */
-		r = write(fd, iov[0].iov_base, iov[0].iov_len);
+		r = write(fd, header, sizeof(header));
 		(void)r;
 	}
 
@@ -231,34 +416,166 @@ append_to_fd(int fd, const void *buf, size_t count, crdb_error_t *ce)
 }
 
 /**
- * Dumps an encoded version of `record` to `fd`. The record's header
- * will be updated in-place to contain the correct crc.
+ * Repeatedly attempts to write `buf` to `fd`, which is expected to be
+ * in O_APPEND mode.
+ *
+ * The buffer is word-stuffed and ends with a header for the next record.
+ */
+static bool
+append_to_fd(int fd, const void *buf, size_t count, crdb_error_t *ce)
+{
+	struct iovec iov[] = {
+		/* Header slot. */
+		{ 0 },
+		{
+			.iov_base = (void *)buf,
+			.iov_len = count,
+		},
+	};
+
+	return append_iov_to_fd(fd, iov, CRDB_ARRAY_SIZE(iov), ce);
+}
+
+/**
+ * Appends a large record without copying its payload: we describe the
+ * encoded record with iovecs into `buf`, and pass them straight to
+ * writev(2).
+ *
+ * @return false if the payload needs too many iovecs.  Otherwise,
+ *   true, and `*ret` is the result of the append.
+ */
+static bool
+append_record_iov(int fd, uint32_t generation, const uint8_t *buf,
+    size_t len, bool *ret, crdb_error_t *ce)
+{
+	struct record_header header = {
+		.crc = CRC_INITIAL_VALUE,
+		.generation = generation,
+	};
+	const struct iovec src[] = {
+		{
+			.iov_base = &header,
+			.iov_len = sizeof(header),
+		},
+		{
+			.iov_base = (void *)buf,
+			.iov_len = len,
+		},
+	};
+	struct iovec iov[APPEND_IOV_MAX];
+	uint8_t meta[APPEND_META_SIZE];
+	uint8_t *trailer = meta + sizeof(meta) - CRDB_WORD_STUFF_HEADER_SIZE;
+	size_t count;
+
+	/* We can't patch the crc afterwards: compute it upfront. */
+	header.crc = crdb_crc32c_update(crdb_crc32c(&header, sizeof(header)),
+	    buf, len);
+
+	/* Leave room for the header slot and the trailing header. */
+	if (crdb_word_stuff_encode_iov(iov + 1, APPEND_IOV_MAX - 2, &count,
+	    meta, trailer - meta, src, CRDB_ARRAY_SIZE(src)) == false)
+		return false;
+
+	/* See encode_record for the trailing header. */
+	crdb_word_stuff_header(trailer);
+	iov[count + 1] = (struct iovec) {
+		.iov_base = trailer,
+		.iov_len = CRDB_WORD_STUFF_HEADER_SIZE,
+	};
+
+	*ret = append_iov_to_fd(fd, iov, count + 2, ce);
+	return true;
+}
+
+/**
+ * Dumps an encoded version of the record to `fd`.
  *
  * We guarantee that the encoded record (header + data) fits in
  * CRDB_RECORD_STREAM_BUF_LEN bytes.
  */
 static bool
-record_stream_append_record(int fd, struct write_record *record,
-    size_t data_len, crdb_error_t *ce)
+record_stream_append_record(int fd, uint32_t generation,
+    const struct record_payload *payload, crdb_error_t *ce)
 {
-	uint8_t encoded[CRDB_WORD_STUFFED_BOUND(sizeof(*record))];
+	uint8_t encoded[CRDB_RECORD_STREAM_ENCODED_MAX];
 	size_t encoded_size;
 
-	if (encode_record(encoded, &encoded_size, record, data_len, ce) == false)
+	assert(payload->len <= CRDB_RECORD_STREAM_MAX_LEN);
+	if (encode_record(encoded, &encoded_size, generation, payload,
+	    ce) == false)
 		return false;
 
 	return append_to_fd(fd, encoded, encoded_size, ce);
 }
 
+bool
+crdb_record_stream_encode(
+    uint8_t encoded[static CRDB_RECORD_STREAM_ENCODED_MAX],
+    size_t *encoded_size, uint32_t generation, const uint8_t *buf,
+    size_t len, crdb_error_t *ce)
+{
+	const struct record_payload payload = {
+		.buf = buf,
+		.len = len,
+	};
+
+	*encoded_size = 0;
+	if (len > CRDB_RECORD_STREAM_MAX_LEN)
+		return crdb_error_set(ce, "crdb_record_stream data too long");
+
+	return encode_record(encoded, encoded_size, generation, &payload, ce);
+}
+
+bool
+crdb_record_stream_encode_large(uint8_t *encoded, size_t *encoded_size,
+    uint32_t generation, const uint8_t *buf, size_t len, crdb_error_t *ce)
+{
+	const struct record_payload payload = {
+		.buf = buf,
+		.len = len,
+	};
+
+	*encoded_size = 0;
+	return encode_record(encoded, encoded_size, generation, &payload, ce);
+}
+
+bool
+crdb_record_stream_config_max_len(
+    const struct crdb_record_stream_config *config, size_t *max_record_len,
+    crdb_error_t *ce)
+{
+	size_t max_len = CRDB_RECORD_STREAM_MAX_LEN;
+
+	if (config != NULL && config->max_record_len != 0)
+		max_len = config->max_record_len;
+
+	if (max_len > CRDB_RECORD_STREAM_LARGE_MAX_LEN)
+		return crdb_error_set(ce,
+		    "crdb_record_stream max_record_len too large");
+
+	*max_record_len = max_len;
+	return true;
+}
+
+bool
+crdb_record_stream_append_encoded(int fd, const void *buf, size_t count,
+    crdb_error_t *ce)
+{
+
+	return append_to_fd(fd, buf, count, ce);
+}
+
 static bool
-record_stream_write_record(FILE *stream, struct write_record *record,
-    size_t data_len, crdb_error_t *ce)
+record_stream_write_record(FILE *stream, uint32_t generation,
+    const struct record_payload *payload, crdb_error_t *ce)
 {
-	uint8_t encoded[CRDB_WORD_STUFFED_BOUND(sizeof(*record))];
+	uint8_t encoded[CRDB_RECORD_STREAM_ENCODED_MAX];
 	size_t encoded_size;
 	size_t written;
 
-	if (encode_record(encoded, &encoded_size, record, data_len, ce) == false)
+	assert(payload->len <= CRDB_RECORD_STREAM_MAX_LEN);
+	if (encode_record(encoded, &encoded_size, generation, payload,
+	    ce) == false)
 		return false;
 
 	written = fwrite(encoded, encoded_size, 1, stream);
@@ -327,30 +644,119 @@ bool
 crdb_record_stream_append_buf(int fd, uint32_t generation,
     const uint8_t *buf, size_t len, crdb_error_t *ce)
 {
-	struct write_record record = {
-		.header.generation = generation,
+	const struct record_payload payload = {
+		.buf = buf,
+		.len = len,
 	};
 
 	if (len > CRDB_RECORD_STREAM_MAX_LEN)
 		return crdb_error_set(ce, "crdb_record_stream data too long");
 
-	memcpy(&record.data, buf, len);
-	return record_stream_append_record(fd, &record, len, ce);
+	return record_stream_append_record(fd, generation, &payload, ce);
+}
+
+bool
+crdb_record_stream_append_large(int fd,
+    const struct crdb_record_stream_config *config, uint32_t generation,
+    const uint8_t *buf, size_t len, crdb_error_t *ce)
+{
+	uint8_t *encoded;
+	size_t encoded_size;
+	size_t max_len;
+	bool ret;
+
+	if (crdb_record_stream_config_max_len(config, &max_len, ce) == false)
+		return false;
+
+	if (len > max_len)
+		return crdb_error_set(ce, "crdb_record_stream data too long");
+
+	/* Short records don't need any heap allocation. */
+	if (len <= CRDB_RECORD_STREAM_MAX_LEN)
+		return crdb_record_stream_append_buf(fd, generation, buf, len,
+		    ce);
+
+	if (append_record_iov(fd, generation, buf, len, &ret, ce))
+		return ret;
+
+	encoded = malloc(CRDB_RECORD_STREAM_ENCODED_BOUND(len));
+	if (encoded == NULL)
+		return crdb_error_set(ce,
+		    "failed to allocate crdb_record_stream record", errno);
+
+	ret = crdb_record_stream_encode_large(encoded, &encoded_size,
+	    generation, buf, len, ce) &&
+	    append_to_fd(fd, encoded, encoded_size, ce);
+	free(encoded);
+	return ret;
+}
+
+bool
+crdb_record_stream_append_batch(int fd, const struct crdb_record_iov *records,
+    size_t n, crdb_error_t *ce)
+{
+	enum { MAX_ENCODED = CRDB_RECORD_STREAM_ENCODED_MAX };
+	uint8_t *encoded;
+	size_t encoded_size = 0;
+	bool ret;
+
+	if (n == 0)
+		return true;
+
+	/* Fail before encoding anything if any record is too long. */
+	for (size_t i = 0; i < n; i++) {
+		if (records[i].len > CRDB_RECORD_STREAM_MAX_LEN)
+			return crdb_error_set(ce,
+			    "crdb_record_stream data too long");
+	}
+
+	if (n > SIZE_MAX / MAX_ENCODED)
+		return crdb_error_set(ce, "crdb_record_stream batch too large");
+
+	encoded = malloc(n * MAX_ENCODED);
+	if (encoded == NULL)
+		return crdb_error_set(ce,
+		    "failed to allocate crdb_record_stream batch", errno);
+
+	/*
+	 * Each encoded record ends with a header, so we can simply
+	 * concatenate them, exactly as if we had appended them one
+	 * at a time.
+	 */
+	for (size_t i = 0; i < n; i++) {
+		const struct record_payload payload = {
+			.buf = records[i].buf,
+			.len = records[i].len,
+		};
+		size_t record_size;
+
+		if (encode_record(encoded + encoded_size, &record_size,
+		    records[i].generation, &payload, ce) == false) {
+			free(encoded);
+			return false;
+		}
+
+		encoded_size += record_size;
+	}
+
+	ret = append_to_fd(fd, encoded, encoded_size, ce);
+	free(encoded);
+	return ret;
 }
 
 bool
 crdb_record_stream_write_buf(FILE *stream, uint32_t generation,
     const uint8_t *buf, size_t len, crdb_error_t *ce)
 {
-	struct write_record record = {
-		.header.generation = generation,
+	const struct record_payload payload = {
+		.buf = buf,
+		.len = len,
 	};
 
 	if (len > CRDB_RECORD_STREAM_MAX_LEN)
 		return crdb_error_set(ce, "crdb_record_stream data too long");
 
-	memcpy(&record.data, buf, len);
-	return record_stream_write_record(stream, &record, len, ce);
+	return record_stream_write_record(stream, generation, &payload, ce);
 }
 
 #ifdef HAS_PROTOBUF_C
@@ -358,43 +764,89 @@ bool
 crdb_record_stream_append_msg(int fd, uint32_t generation,
     const ProtobufCMessage *message, crdb_error_t *ce)
 {
-	struct write_record record = {
-		.header.generation = generation,
+	struct record_payload payload = {
+		.message = message,
 	};
-	size_t packed_size;
-	size_t serialized_size;
 
-	packed_size = protobuf_c_message_get_packed_size(message);
-	if (packed_size > CRDB_RECORD_STREAM_MAX_LEN)
+	payload.len = protobuf_c_message_get_packed_size(message);
+	if (payload.len > CRDB_RECORD_STREAM_MAX_LEN)
 		return crdb_error_set(ce,
 		    "crdb_record_stream message too large.");
 
-	serialized_size = protobuf_c_message_pack(message, record.data);
-	assert(serialized_size <= packed_size);
-	return record_stream_append_record(fd, &record, serialized_size, ce);
+	return record_stream_append_record(fd, generation, &payload, ce);
 }
 
 bool
 crdb_record_stream_write_msg(FILE *stream, uint32_t generation,
     const ProtobufCMessage *message, crdb_error_t *ce)
 {
-	struct write_record record = {
-		.header.generation = generation,
+	struct record_payload payload = {
+		.message = message,
 	};
-	size_t packed_size;
-	size_t serialized_size;
 
-	packed_size = protobuf_c_message_get_packed_size(message);
-	if (packed_size > CRDB_RECORD_STREAM_MAX_LEN)
+	payload.len = protobuf_c_message_get_packed_size(message);
+	if (payload.len > CRDB_RECORD_STREAM_MAX_LEN)
 		return crdb_error_set(ce,
 		    "crdb_record_stream message too large.");
 
-	serialized_size = protobuf_c_message_pack(message, record.data);
-	assert(serialized_size <= packed_size);
-	return record_stream_write_record(stream, &record, serialized_size, ce);
+	return record_stream_write_record(stream, generation, &payload, ce);
 }
 #endif /* HAS_PROTOBUF_C */
 
+bool
+crdb_record_stream_release_before(int fd, size_t offset, unsigned int flags,
+    size_t *released, crdb_error_t *ce)
+{
+	struct stat st;
+	size_t block_size;
+	size_t prefix;
+
+	if (released != NULL)
+		*released = 0;
+
+	if (fstat(fd, &st) == -1)
+		return crdb_error_set(ce, "failed to fstat record stream",
+		    errno);
+
+	if (offset > (size_t)st.st_size)
+		return crdb_error_set(ce,
+		    "release offset past the end of the record stream");
+
+	/*
+	 * Only release whole blocks: the record that starts at
+	 * `offset`, and its leading header, stay intact, and readers
+	 * resynchronise on that header after the hole.
+	 */
+	block_size = (st.st_blksize > 0) ? (size_t)st.st_blksize : 4096;
+	prefix = offset - offset % block_size;
+	if (prefix == 0)
+		return true;
+
+	if ((flags & CRDB_RECORD_STREAM_RELEASE_COLLAPSE) != 0) {
+		/*
+		 * Collapsed ranges must end before EOF; collapsing
+		 * the whole file is a truncation.
+		 */
+		if (prefix == (size_t)st.st_size) {
+			if (ftruncate(fd, 0) == -1)
+				return crdb_error_set(ce,
+				    "failed to truncate record stream", errno);
+		} else if (fallocate(fd, FALLOC_FL_COLLAPSE_RANGE, 0,
+		    prefix) == -1) {
+			return crdb_error_set(ce,
+			    "failed to collapse record stream range", errno);
+		}
+	} else if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+	    0, prefix) == -1) {
+		return crdb_error_set(ce,
+		    "failed to punch hole in record stream", errno);
+	}
+
+	if (released != NULL)
+		*released = prefix;
+	return true;
+}
+
 void
 crdb_record_stream_iterator_init_buf(struct crdb_record_stream_iterator *it,
     const uint8_t *buf, size_t size)
@@ -411,23 +863,206 @@ crdb_record_stream_iterator_init_buf(struct crdb_record_stream_iterator *it,
 	return;
 }
 
-static const uint8_t *
-find_first_nonzero(const uint8_t *cursor, const uint8_t *end)
+const uint8_t *
+crdb_record_stream_find_first_nonzero(const uint8_t *cursor,
+    const uint8_t *end)
 {
 
+	/*
+	 * Zero-filled pages are common after crashes: OR together 64
+	 * bytes at a time (the compiler vectorises this) until we find
+	 * a block with a non-zero byte.
+	 */
+	while ((size_t)(end - cursor) >= ZERO_SKIP_BLOCK) {
+		uint64_t acc = 0;
+
+		for (size_t i = 0; i < ZERO_SKIP_BLOCK; i += sizeof(uint64_t)) {
+			uint64_t word;
+
+			memcpy(&word, cursor + i, sizeof(word));
+			acc |= word;
+		}
+
+		if (acc != 0)
+			break;
+
+		cursor += ZERO_SKIP_BLOCK;
+	}
+
 	while (cursor < end && cursor[0] == 0)
 		cursor++;
 
 	return cursor;
 }
 
+/**
+ * Populates `it->extents` with the data extents in the first
+ * `it->map_size` bytes of `fd`.  Extents are only a hint, so we
+ * fall back to treating everything as data on any failure.
+ */
+static void
+iterator_load_extents(struct crdb_record_stream_iterator *it, int fd)
+{
+	struct crdb_record_stream_extent *extents = NULL;
+	const size_t size = it->map_size;
+	size_t capacity = 0;
+	size_t num = 0;
+	size_t offset = 0;
+
+	free(it->extents);
+	it->extents = NULL;
+	it->num_extents = 0;
+
+	while (offset < size) {
+		off_t data, hole;
+
+		data = lseek(fd, offset, SEEK_DATA);
+		if (data < 0) {
+			/* ENXIO means there's only holes until EOF. */
+			if (errno == ENXIO)
+				break;
+
+			goto unknown;
+		}
+
+		if ((size_t)data >= size)
+			break;
+
+		hole = lseek(fd, data, SEEK_HOLE);
+		if (hole <= data)
+			goto unknown;
+
+		if ((size_t)hole > size)
+			hole = size;
+
+		if (num == capacity) {
+			struct crdb_record_stream_extent *grown;
+
+			capacity = 2 * capacity + 4;
+			grown = realloc(extents, capacity * sizeof(*extents));
+			if (grown == NULL)
+				goto unknown;
+
+			extents = grown;
+		}
+
+		extents[num++] = (struct crdb_record_stream_extent) {
+			.begin = data,
+			.end = hole,
+		};
+		offset = hole;
+	}
+
+	/* A single extent for the whole file tells us nothing. */
+	if (num == 1 && extents[0].begin == 0 && extents[0].end == size)
+		goto unknown;
+
+	/* No extent at all means the file is one big hole. */
+	if (extents == NULL) {
+		extents = malloc(sizeof(*extents));
+		if (extents == NULL)
+			goto unknown;
+	}
+
+	it->extents = extents;
+	it->num_extents = num;
+	return;
+
+unknown:
+	free(extents);
+	return;
+}
+
+/**
+ * Returns the index of the first extent that ends after `offset`.
+ */
+static size_t
+iterator_extent_search(const struct crdb_record_stream_iterator *it,
+    size_t offset)
+{
+	size_t lo = 0;
+	size_t hi = it->num_extents;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (it->extents[mid].end <= offset) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+/**
+ * Returns the first non-zero byte in `[from, it->end)`, or `it->end`
+ * if none, without looking at holes.
+ */
+static const uint8_t *
+iterator_find_first_nonzero(const struct crdb_record_stream_iterator *it,
+    const uint8_t *from)
+{
+	size_t offset = from - it->begin;
+
+	if (it->extents == NULL)
+		return crdb_record_stream_find_first_nonzero(from, it->end);
+
+	for (size_t i = iterator_extent_search(it, offset);
+	     i < it->num_extents; i++) {
+		const struct crdb_record_stream_extent *extent = &it->extents[i];
+		const uint8_t *extent_end = it->begin + extent->end;
+		const uint8_t *found;
+		size_t lo;
+
+		lo = (offset > extent->begin) ? offset : extent->begin;
+		found = crdb_record_stream_find_first_nonzero(it->begin + lo,
+		    extent_end);
+		if (found < extent_end)
+			return found;
+	}
+
+	return it->end;
+}
+
+/**
+ * Returns the first header in `[from, it->end)`, or `it->end` if
+ * none, without looking at holes.  Headers never straddle an extent
+ * boundary: holes are all zeros, and extents are separated by holes.
+ */
+static const uint8_t *
+iterator_header_find(const struct crdb_record_stream_iterator *it,
+    const uint8_t *from)
+{
+	size_t offset = from - it->begin;
+
+	if (it->extents == NULL)
+		return crdb_word_stuff_header_find(from, it->end - from);
+
+	for (size_t i = iterator_extent_search(it, offset);
+	     i < it->num_extents; i++) {
+		const struct crdb_record_stream_extent *extent = &it->extents[i];
+		const uint8_t *extent_end = it->begin + extent->end;
+		const uint8_t *found;
+		size_t lo;
+
+		lo = (offset > extent->begin) ? offset : extent->begin;
+		found = crdb_word_stuff_header_find(it->begin + lo,
+		    extent->end - lo);
+		if (found < extent_end)
+			return found;
+	}
+
+	return it->end;
+}
+
 bool
 crdb_record_stream_iterator_init_fd(struct crdb_record_stream_iterator *it,
     int fd, crdb_error_t *ce)
 {
 	struct stat st;
 	void *mapped;
-	off_t first_data = -1;
 
 	if (fstat(fd, &st) == -1)
 		return crdb_error_set(ce, "failed to fstat record stream",
@@ -438,8 +1073,6 @@ crdb_record_stream_iterator_init_fd(struct crdb_record_stream_iterator *it,
 		return true;
 	}
 
-	/* Skip any sparse hole at the head. */
-	first_data = lseek(fd, 0, SEEK_DATA);
 	mapped = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
 	if (mapped == MAP_FAILED)
 		return crdb_error_set(ce, "failed to mmap record stream",
@@ -455,19 +1088,117 @@ crdb_record_stream_iterator_init_fd(struct crdb_record_stream_iterator *it,
 		.first_record = true,
 	};
 
-	/* If we found a hole, advance the cursor. */
-	if (first_data > 0) {
-		if (first_data >= st.st_size)
-			first_data = st.st_size;
-
-		it->cursor += first_data;
-	}
+	iterator_load_extents(it, fd);
 
 	/*
-	 * And now, skip zeros: we know any valid record starts with a
-	 * (non-zero) two-byte header.
+	 * Skip sparse holes and zeros at the head: we know any valid
+	 * record starts with a (non-zero) two-byte header.
 	 */
-	it->cursor = it->first_nonzero = find_first_nonzero(it->cursor, it->end);
+	it->cursor = it->first_nonzero =
+	    iterator_find_first_nonzero(it, it->cursor);
+	return true;
+}
+
+bool
+crdb_record_stream_iterator_follow(struct crdb_record_stream_iterator *it,
+    int fd, crdb_error_t *ce)
+{
+	const size_t old_size = it->end - it->begin;
+	size_t cursor_offset, stop_offset, first_nonzero_offset;
+	size_t header_offset, partial_offset;
+	struct stat st;
+	uint8_t *mapped;
+
+	/* Buffer iterators have nothing to follow. */
+	if (it->mapped == NULL && it->begin != NULL)
+		return crdb_error_set(ce,
+		    "can't follow a record stream iterator over a buffer");
+
+	if (fstat(fd, &st) == -1)
+		return crdb_error_set(ce, "failed to fstat record stream",
+		    errno);
+
+	if ((size_t)st.st_size < old_size)
+		return crdb_error_set(ce, "followed record stream shrank");
+
+	if ((size_t)st.st_size == old_size)
+		return true;
+
+	cursor_offset = it->cursor - it->begin;
+	stop_offset = it->stop_at - it->begin;
+	first_nonzero_offset = it->first_nonzero - it->begin;
+	/* Both arms of each ?: must be size_t, to avoid -Wsign-compare. */
+	header_offset = (it->header != NULL) ?
+	    (size_t)(it->header - it->begin) : 0;
+	partial_offset = (it->partial_record != NULL) ?
+	    (size_t)(it->partial_record - it->begin) : SIZE_MAX;
+
+	if (it->mapped == NULL) {
+		mapped = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	} else {
+		mapped = mremap(it->mapped, it->map_size, st.st_size,
+		    MREMAP_MAYMOVE);
+	}
+
+	if (mapped == MAP_FAILED)
+		return crdb_error_set(ce, "failed to remap record stream",
+		    errno);
+
+	it->mapped = mapped;
+	it->map_size = st.st_size;
+	it->begin = mapped;
+	it->end = mapped + st.st_size;
+	it->cursor = mapped + cursor_offset;
+	it->stop_at = mapped + stop_offset;
+	if (stop_offset == old_size)
+		it->stop_at = it->end;
+	it->first_nonzero = mapped + first_nonzero_offset;
+	it->header = (it->header != NULL) ? mapped + header_offset : NULL;
+	iterator_load_extents(it, fd);
+
+	if (it->first_record == true && it->cursor == it->first_nonzero) {
+		/* We haven't found anything yet; skip new zeros too. */
+		it->cursor = it->first_nonzero =
+		    iterator_find_first_nonzero(it, it->first_nonzero);
+	} else if (partial_offset != SIZE_MAX) {
+		/* Give the incomplete record another chance. */
+		it->cursor = mapped + partial_offset;
+		it->first_record = it->partial_first_record;
+	} else if (cursor_offset >= old_size &&
+	    old_size >= CRDB_WORD_STUFF_HEADER_SIZE - 1) {
+		/*
+		 * We scanned everything without finding any header,
+		 * but the last bytes may be the beginning of one.
+		 */
+		it->cursor = mapped + old_size -
+		    (CRDB_WORD_STUFF_HEADER_SIZE - 1);
+	}
+
+	it->partial_record = NULL;
+	it->partial_first_record = false;
+	return true;
+}
+
+bool
+crdb_record_stream_iterator_configure(struct crdb_record_stream_iterator *it,
+    const struct crdb_record_stream_config *config, crdb_error_t *ce)
+{
+	size_t max_len;
+	size_t max_encoded_len;
+	uint8_t *record_buf;
+
+	if (crdb_record_stream_config_max_len(config, &max_len, ce) == false)
+		return false;
+
+	max_encoded_len = crdb_record_stream_max_encoded_len(max_len);
+	record_buf = malloc(max_encoded_len);
+	if (record_buf == NULL)
+		return crdb_error_set(ce,
+		    "failed to allocate record stream iterator buffer", errno);
+
+	free(it->record_buf);
+	it->record_buf = record_buf;
+	it->max_encoded_len = max_encoded_len;
 	return true;
 }
 
@@ -477,6 +1208,10 @@ crdb_record_stream_iterator_deinit(struct crdb_record_stream_iterator *it)
 
 	if (it->mapped != NULL)
 		munmap(it->mapped, it->map_size);
+	free(it->extents);
+	it->extents = NULL;
+	free(it->record_buf);
+	it->record_buf = NULL;
 	return;
 }
 
@@ -487,6 +1222,17 @@ crdb_record_stream_iterator_size(const struct crdb_record_stream_iterator *it)
 	return it->end - it->begin;
 }
 
+size_t
+crdb_record_stream_iterator_record_offset(
+    const struct crdb_record_stream_iterator *it)
+{
+
+	if (it->header == NULL)
+		return 0;
+
+	return it->header - it->begin;
+}
+
 bool
 crdb_record_stream_iterator_locate_at(struct crdb_record_stream_iterator *it,
     size_t start_offset)
@@ -501,6 +1247,7 @@ crdb_record_stream_iterator_locate_at(struct crdb_record_stream_iterator *it,
 	    start_offset > (size_t)(it->stop_at - it->begin))
 		return false;
 
+	it->partial_record = NULL;
 	if (start_offset == (size_t)(it->first_nonzero - it->begin)) {
 		it->first_record = true;
 		it->cursor = it->first_nonzero;
@@ -524,29 +1271,129 @@ crdb_record_stream_iterator_stop_at(struct crdb_record_stream_iterator *it,
 	return;
 }
 
+/**
+ * Returns the checksum of the contiguous decoded record in
+ * `decoded[0 ... decoded_len - 1]`, with CRC_INITIAL_VALUE in lieu of
+ * the crc field itself.
+ */
+static uint32_t
+decoded_record_crc(const uint8_t *decoded, size_t decoded_len)
+{
+	const uint32_t initial = CRC_INITIAL_VALUE;
+	uint32_t crc;
+
+	crc = crdb_crc32c(&initial, sizeof(initial));
+	if (decoded_len < sizeof(initial))
+		return crc;
+
+	return crdb_crc32c_update(crc, decoded + sizeof(initial),
+	    decoded_len - sizeof(initial));
+}
+
+/**
+ * Makes sure `decoded[0 ... decoded_len - 1]` holds a full header,
+ * and that the header's checksum matches `crc`.
+ *
+ * @return true and populates `out` if the record is valid.
+ */
 static bool
-crc_matches(struct read_record *record, size_t total_len)
+decoded_record_validate(const uint8_t *decoded, size_t decoded_len,
+    uint32_t crc, struct record_view *out)
 {
-	uint32_t expected = record->header.crc;
+	struct record_header header;
 
-	record->header.crc = CRC_INITIAL_VALUE;
-	return expected == crdb_crc32c(record, total_len);
+	if (decoded_len < sizeof(header))
+		return false;
+
+	memcpy(&header, decoded, sizeof(header));
+	if (header.crc != crc)
+		return false;
+
+	*out = (struct record_view) {
+		.generation = header.generation,
+		.data = decoded + sizeof(header),
+		.len = decoded_len - sizeof(header),
+	};
+	return true;
+}
+
+bool
+crdb_record_stream_decode(const uint8_t *encoded, size_t encoded_len,
+    uint8_t *scratch, bool zero_copy, struct record_view *out)
+{
+	const uint32_t initial = CRC_INITIAL_VALUE;
+	uint8_t *decoded_end;
+	uint32_t crc;
+
+	if (zero_copy) {
+		const uint8_t *decoded;
+		size_t decoded_len;
+
+		decoded = crdb_word_stuff_decode_view(encoded, encoded_len,
+		    &decoded_len);
+		if (decoded != NULL) {
+			return decoded_record_validate(decoded, decoded_len,
+			    decoded_record_crc(decoded, decoded_len), out);
+		}
+	}
+
+	/*
+	 * Otherwise, unstuff the bytes, and checksum them on the fly.
+	 * Decoding never expands the number of bytes, so we know this
+	 * won't overflow scratch.
+	 */
+	crc = crdb_crc32c(&initial, sizeof(initial));
+	decoded_end = crdb_word_stuff_decode_crc32c(scratch, encoded,
+	    encoded_len, sizeof(initial), &crc);
+	if (decoded_end == NULL)
+		return false;
+
+	return decoded_record_validate(scratch, decoded_end - scratch, crc,
+	    out);
+}
+
+bool
+crdb_record_stream_decode_inplace(uint8_t *encoded, size_t encoded_len,
+    struct record_view *out)
+{
+	const uint8_t *decoded;
+	uint8_t *decoded_end;
+	size_t decoded_len;
+
+	/* Records without any forbidden sequence don't need a move. */
+	decoded = crdb_word_stuff_decode_view(encoded, encoded_len,
+	    &decoded_len);
+	if (decoded == NULL) {
+		decoded_end = crdb_word_stuff_decode_inplace(encoded,
+		    encoded_len);
+		if (decoded_end == NULL)
+			return false;
+
+		decoded = encoded;
+		decoded_len = decoded_end - encoded;
+	}
+
+	return decoded_record_validate(decoded, decoded_len,
+	    decoded_record_crc(decoded, decoded_len), out);
 }
 
 /**
  * Consumes and attempts to decode the next record.
  *
  * @param it a non-empty iterator.
+ * @param scratch a buffer of at least `max_encoded_len` bytes.
+ * @param max_encoded_len reject records with more encoded bytes.
  *
- * @return the size of the decoded record data on success, -1 on failure.
+ * @return true and populates `out` on success, false on failure.
  */
-static ssize_t
+static bool
 record_stream_iterator_next_record(struct crdb_record_stream_iterator *it,
-    struct read_record *dst)
+    uint8_t *scratch, size_t max_encoded_len, bool zero_copy,
+    struct record_view *out)
 {
 	const uint8_t *encoded_data;
 	size_t encoded_len;
-	size_t decoded_len;
+	bool first_record = it->first_record;
 
 	/*
 	 * Skip to the next header, except for the initial record,
@@ -562,8 +1409,7 @@ record_stream_iterator_next_record(struct crdb_record_stream_iterator *it,
 	} else {
 		const uint8_t *first_header;
 
-		first_header = crdb_word_stuff_header_find(it->cursor,
-		    it->end - it->cursor);
+		first_header = iterator_header_find(it, it->cursor);
 		/* No header found -> consume everything and bail. */
 		if (first_header >= it->stop_at)
 			goto eof;
@@ -583,14 +1429,23 @@ record_stream_iterator_next_record(struct crdb_record_stream_iterator *it,
 	{
 		const uint8_t *next_header;
 
-		next_header = crdb_word_stuff_header_find(encoded_data,
-		    it->end - encoded_data);
+		next_header = iterator_header_find(it, encoded_data);
 		/*
 		 * We found where the next record starts; decode
 		 * everything up to that byte.
 		 */
 		it->cursor = next_header;
 		encoded_len = next_header - encoded_data;
+
+		/*
+		 * Remember where this record starts if it runs to EOF:
+		 * it may only be partially written yet.  We forget it
+		 * as soon as we decode a record successfully.
+		 */
+		if (next_header == it->end) {
+			it->partial_record = it->header;
+			it->partial_first_record = first_record;
+		}
 	}
 
 	/*
@@ -599,61 +1454,41 @@ record_stream_iterator_next_record(struct crdb_record_stream_iterator *it,
 	 */
 
 	/* This is clearly too much data. Reject early. */
-	if (encoded_len > CRDB_RECORD_STREAM_BUF_LEN)
-		return -1;
-
-	/* Unstuff the bytes. */
-	{
-		uint8_t *decoded_begin = (uint8_t *)dst;
-		uint8_t *decoded_end;
-
-		/*
-		 * Decoding never expands the number of bytes, so we
-		 * know this won't overflow dst.
-		 */
-		decoded_end = crdb_word_stuff_decode(decoded_begin,
-		    encoded_data, encoded_len);
-		if (decoded_end == NULL)
-			return -1;
-		decoded_len = decoded_end - decoded_begin;
-	}
-
-	/*
-	 * Make sure we decoded a full header, and that the header's
-	 * checksum is correct.
-	 */
-	if (decoded_len < sizeof(dst->header) ||
-	    crc_matches(dst, decoded_len) == false)
-		return -1;
+	if (encoded_len > max_encoded_len)
+		return false;
 
-	return decoded_len - sizeof(dst->header);
+	return crdb_record_stream_decode(encoded_data, encoded_len, scratch,
+	    zero_copy, out);
 
 eof:
 	it->cursor = it->end;
-	return -1;
+	return false;
 }
 
 /**
- * Writes the next valid record to `dst`.
+ * Finds the next valid record.
  *
- * @return the size of the decoded record data on success, -1 on failure.
+ * @return true and populates `out` on success, false on EOF.
  */
-static ssize_t
+static bool
 record_stream_iterator_next(struct crdb_record_stream_iterator *it,
-    struct read_record *dst)
+    uint8_t *scratch, size_t max_encoded_len, bool zero_copy,
+    struct record_view *out)
 {
 
 	while (it->cursor < it->stop_at) {
-		ssize_t r;
-
-		r = record_stream_iterator_next_record(it, dst);
-		if (r >= 0)
-			return r;
+		if (record_stream_iterator_next_record(it, scratch,
+		    max_encoded_len, zero_copy, out)) {
+			it->partial_record = NULL;
+			return true;
+		}
 	}
 
-	it->cursor = NULL;
-	it->end = NULL;
-	return -1;
+	/*
+	 * Leave the cursor at or after `stop_at`: further calls keep
+	 * returning EOF, and followers can resume from there.
+	 */
+	return false;
 }
 
 bool
@@ -662,21 +1497,174 @@ crdb_record_stream_iterator_next_buf(struct crdb_record_stream_iterator *it,
     size_t *len)
 {
 	struct read_record buf;
-	ssize_t payload_size;
+	struct record_view view;
+
+	*generation = 0;
+	*len = 0;
+	/*
+	 * Records that don't need unstuffing are copied straight from
+	 * the iterator's buffer to `dst`.
+	 */
+	if (record_stream_iterator_next(it, (uint8_t *)&buf,
+	    CRDB_RECORD_STREAM_BUF_LEN, true, &view) == false)
+		return false;
+
+	assert(view.len <= CRDB_RECORD_STREAM_BUF_LEN);
+	*generation = view.generation;
+	memcpy(dst, view.data, view.len);
+	*len = view.len;
+	return true;
+}
+
+bool
+crdb_record_stream_iterator_next_view(struct crdb_record_stream_iterator *it,
+    uint32_t *generation, const uint8_t **data, size_t *len,
+    uint8_t scratch[static CRDB_RECORD_STREAM_BUF_LEN])
+{
+	struct record_view view;
+
+	*generation = 0;
+	*data = NULL;
+	*len = 0;
+	if (record_stream_iterator_next(it, scratch,
+	    CRDB_RECORD_STREAM_BUF_LEN, true, &view) == false)
+		return false;
+
+	*generation = view.generation;
+	*data = view.data;
+	*len = view.len;
+	return true;
+}
+
+bool
+crdb_record_stream_iterator_next_large(struct crdb_record_stream_iterator *it,
+    uint32_t *generation, const uint8_t **data, size_t *len)
+{
+	struct record_view view;
+
+	assert(it->record_buf != NULL &&
+	    "crdb_record_stream_iterator_next_large needs a configured iterator");
 
 	*generation = 0;
+	*data = NULL;
 	*len = 0;
-	payload_size = record_stream_iterator_next(it, &buf);
-	if (payload_size < 0)
+	if (record_stream_iterator_next(it, it->record_buf,
+	    it->max_encoded_len, true, &view) == false)
 		return false;
 
-	assert(payload_size <= CRDB_RECORD_STREAM_BUF_LEN);
-	*generation = buf.header.generation;
-	memcpy(dst, buf.data, payload_size);
-	*len = (size_t)payload_size;
+	*generation = view.generation;
+	*data = view.data;
+	*len = view.len;
 	return true;
 }
 
+/**
+ * Points `*scratch` and `*max_encoded_len` at the decoding buffer
+ * for `it`: the iterator's heap buffer if it was configured, or `buf`.
+ */
+static void
+iterator_scratch(const struct crdb_record_stream_iterator *it,
+    struct read_record *buf, uint8_t **scratch, size_t *max_encoded_len)
+{
+
+	if (it->record_buf != NULL) {
+		*scratch = it->record_buf;
+		*max_encoded_len = it->max_encoded_len;
+		return;
+	}
+
+	*scratch = (uint8_t *)buf;
+	*max_encoded_len = CRDB_RECORD_STREAM_BUF_LEN;
+	return;
+}
+
+bool
+crdb_record_stream_iterator_probe(const struct crdb_record_stream_iterator *it,
+    size_t offset, uint32_t *generation, size_t *record_offset)
+{
+	struct crdb_record_stream_iterator probe = *it;
+	struct read_record buf;
+	struct record_view view;
+	uint8_t *scratch;
+	size_t max_encoded_len;
+
+	iterator_scratch(it, &buf, &scratch, &max_encoded_len);
+	if (crdb_record_stream_iterator_locate_at(&probe, offset) == false)
+		return false;
+
+	if (record_stream_iterator_next(&probe, scratch, max_encoded_len,
+	    true, &view) == false)
+		return false;
+
+	*generation = view.generation;
+	*record_offset = crdb_record_stream_iterator_record_offset(&probe);
+	return true;
+}
+
+bool
+crdb_record_stream_iterator_seek_range(struct crdb_record_stream_iterator *it,
+    size_t lo, size_t hi, uint32_t generation, uint32_t k_slack)
+{
+	struct read_record buf;
+	uint8_t *scratch;
+	size_t max_encoded_len;
+	/*
+	 * Any record with a generation less than `safe` is only
+	 * preceded by records with generations less than `generation`.
+	 */
+	uint32_t safe = (generation > k_slack) ? generation - k_slack : 0;
+
+	/*
+	 * Invariant: no record that starts before `lo` has a generation
+	 * at least `generation`, and the first valid record at or
+	 * after `hi` is either missing or not safe.
+	 */
+	while (hi > lo && hi - lo > SEEK_LINEAR_SPAN) {
+		size_t mid = lo + (hi - lo) / 2;
+		size_t record_offset;
+		uint32_t probed;
+
+		if (crdb_record_stream_iterator_probe(it, mid, &probed,
+		    &record_offset) == false ||
+		    record_offset >= hi || probed >= safe) {
+			hi = mid;
+			continue;
+		}
+
+		lo = record_offset;
+	}
+
+	if (crdb_record_stream_iterator_locate_at(it, lo) == false)
+		return false;
+
+	iterator_scratch(it, &buf, &scratch, &max_encoded_len);
+	for (;;) {
+		struct record_view view;
+
+		if (record_stream_iterator_next(it, scratch, max_encoded_len,
+		    true, &view) == false)
+			return false;
+
+		if (view.generation >= generation)
+			break;
+	}
+
+	/* Rewind, so that the next call returns that record again. */
+	return crdb_record_stream_iterator_locate_at(it,
+	    crdb_record_stream_iterator_record_offset(it));
+}
+
+bool
+crdb_record_stream_iterator_seek_generation(
+    struct crdb_record_stream_iterator *it, uint32_t generation,
+    uint32_t k_slack)
+{
+
+	return crdb_record_stream_iterator_seek_range(it,
+	    it->first_nonzero - it->begin, it->stop_at - it->begin,
+	    generation, k_slack);
+}
+
 #ifdef HAS_PROTOBUF_C
 void *
 crdb_record_stream_iterator_next_msg(struct crdb_record_stream_iterator *it,
@@ -684,24 +1672,23 @@ crdb_record_stream_iterator_next_msg(struct crdb_record_stream_iterator *it,
     ProtobufCAllocator *allocator)
 {
 	struct read_record buf;
+	struct record_view view;
 	ProtobufCMessage *ret = NULL;
 
 	*generation = 0;
 
 	/* We may fail to parse a buffer; keep scanning if that happens. */
 	while (ret == NULL) {
-		ssize_t payload_size;
-
-		payload_size = record_stream_iterator_next(it, &buf);
-		if (payload_size < 0)
+		if (record_stream_iterator_next(it, (uint8_t *)&buf,
+		    CRDB_RECORD_STREAM_BUF_LEN, true, &view) == false)
 			return NULL;
 
-		assert(payload_size <= CRDB_RECORD_STREAM_BUF_LEN);
+		assert(view.len <= CRDB_RECORD_STREAM_BUF_LEN);
 		ret = protobuf_c_message_unpack(descriptor, allocator,
-		    payload_size, buf.data);
+		    view.len, view.data);
 	}
 
-	*generation = buf.header.generation;
+	*generation = view.generation;
 	return ret;
 }
 #endif /* HAS_PROTOBUF_C */
@@ -0,0 +1,356 @@
+/*
+ * Copyright 2021 Backtrace I/O, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "record_stream_index.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "record_stream.h"
+#include "record_stream_internal.h"
+
+/* Rebuilds write index records this many at a time. */
+#define REBUILD_BATCH 256
+
+struct index_entry {
+	uint32_t generation;
+	uint64_t offset;
+};
+
+struct crdb_record_stream_index {
+	/* Sorted by offset. */
+	struct index_entry *entries;
+	size_t num_entries;
+	size_t capacity;
+	bool stale;
+};
+
+static bool
+entries_push(struct index_entry **entries, size_t *num, size_t *capacity,
+    uint32_t generation, uint64_t offset, crdb_error_t *ce)
+{
+
+	if (*num == *capacity) {
+		size_t new_capacity = 2 * *capacity + 64;
+		struct index_entry *grown;
+
+		grown = realloc(*entries, new_capacity * sizeof(*grown));
+		if (grown == NULL)
+			return crdb_error_set(ce,
+			    "failed to grow record stream index", errno);
+
+		*entries = grown;
+		*capacity = new_capacity;
+	}
+
+	(*entries)[(*num)++] = (struct index_entry) {
+		.generation = generation,
+		.offset = offset,
+	};
+	return true;
+}
+
+static int
+entry_cmp(const void *va, const void *vb)
+{
+	const struct index_entry *a = va;
+	const struct index_entry *b = vb;
+
+	if (a->offset != b->offset)
+		return (a->offset < b->offset) ? -1 : 1;
+
+	return 0;
+}
+
+struct crdb_record_stream_index *
+crdb_record_stream_index_load(int index_fd, crdb_error_t *ce)
+{
+	struct crdb_record_stream_index *index;
+	struct crdb_record_stream_iterator it;
+	uint8_t buf[CRDB_RECORD_STREAM_BUF_LEN];
+	uint32_t generation;
+	size_t len;
+	bool sorted = true;
+
+	index = calloc(1, sizeof(*index));
+	if (index == NULL) {
+		crdb_error_set(ce, "failed to allocate record stream index",
+		    errno);
+		return NULL;
+	}
+
+	if (index_fd < 0)
+		return index;
+
+	if (crdb_record_stream_iterator_init_fd(&it, index_fd, ce) == false)
+		goto fail;
+
+	while (crdb_record_stream_iterator_next_buf(&it, &generation, buf,
+	    &len)) {
+		uint64_t offset;
+
+		if (len != CRDB_RECORD_STREAM_INDEX_ENTRY_LEN)
+			continue;
+
+		offset = crdb_record_stream_index_entry_decode(buf);
+		if (index->num_entries > 0 &&
+		    index->entries[index->num_entries - 1].offset > offset)
+			sorted = false;
+
+		if (entries_push(&index->entries, &index->num_entries,
+		    &index->capacity, generation, offset, ce) == false) {
+			crdb_record_stream_iterator_deinit(&it);
+			goto fail;
+		}
+	}
+
+	crdb_record_stream_iterator_deinit(&it);
+
+	/*
+	 * Writers append entries in stream order, but concurrent
+	 * writers or a rebuild racing with a writer may interleave
+	 * them.
+	 */
+	if (sorted == false) {
+		qsort(index->entries, index->num_entries,
+		    sizeof(*index->entries), entry_cmp);
+	}
+
+	return index;
+
+fail:
+	crdb_record_stream_index_destroy(index);
+	return NULL;
+}
+
+void
+crdb_record_stream_index_destroy(struct crdb_record_stream_index *index)
+{
+
+	if (index == NULL)
+		return;
+
+	free(index->entries);
+	free(index);
+	return;
+}
+
+size_t
+crdb_record_stream_index_size(const struct crdb_record_stream_index *index)
+{
+
+	return index->num_entries;
+}
+
+bool
+crdb_record_stream_index_stale(const struct crdb_record_stream_index *index)
+{
+
+	return index->stale;
+}
+
+/**
+ * Appends `entries[0 ... num - 1]` to `index_fd`, after truncating it.
+ */
+static bool
+index_write(int index_fd, const struct index_entry *entries, size_t num,
+    crdb_error_t *ce)
+{
+	struct crdb_record_iov records[REBUILD_BATCH];
+	uint8_t payloads[REBUILD_BATCH][CRDB_RECORD_STREAM_INDEX_ENTRY_LEN];
+
+	if (ftruncate(index_fd, 0) != 0)
+		return crdb_error_set(ce,
+		    "failed to truncate record stream index", errno);
+
+	if (crdb_record_stream_append_initial(index_fd, ce) == false)
+		return false;
+
+	for (size_t i = 0; i < num; i += REBUILD_BATCH) {
+		size_t n = num - i;
+
+		if (n > REBUILD_BATCH)
+			n = REBUILD_BATCH;
+
+		for (size_t j = 0; j < n; j++) {
+			crdb_record_stream_index_entry_encode(payloads[j],
+			    entries[i + j].offset);
+			records[j] = (struct crdb_record_iov) {
+				.generation = entries[i + j].generation,
+				.buf = payloads[j],
+				.len = sizeof(payloads[j]),
+			};
+		}
+
+		if (crdb_record_stream_append_batch(index_fd, records, n,
+		    ce) == false)
+			return false;
+	}
+
+	return true;
+}
+
+bool
+crdb_record_stream_index_rebuild(struct crdb_record_stream_index *index,
+    const struct crdb_record_stream_iterator *it, int index_fd,
+    size_t interval, crdb_error_t *ce)
+{
+	struct crdb_record_stream_iterator scan = *it;
+	struct index_entry *entries = NULL;
+	size_t num = 0;
+	size_t capacity = 0;
+	uint8_t scratch[CRDB_RECORD_STREAM_BUF_LEN];
+
+	if (interval == 0)
+		interval = CRDB_RECORD_STREAM_INDEX_DEFAULT_INTERVAL;
+
+	/* Index the whole stream, regardless of where `it` is. */
+	crdb_record_stream_iterator_stop_at(&scan,
+	    crdb_record_stream_iterator_size(&scan));
+	crdb_record_stream_iterator_locate_at(&scan,
+	    scan.first_nonzero - scan.begin);
+	for (;;) {
+		const uint8_t *data;
+		uint32_t generation;
+		size_t len, offset;
+		bool r;
+
+		if (scan.record_buf != NULL) {
+			r = crdb_record_stream_iterator_next_large(&scan,
+			    &generation, &data, &len);
+		} else {
+			r = crdb_record_stream_iterator_next_view(&scan,
+			    &generation, &data, &len, scratch);
+		}
+
+		if (r == false)
+			break;
+
+		offset = crdb_record_stream_iterator_record_offset(&scan);
+		if (num > 0 && offset - entries[num - 1].offset < interval)
+			continue;
+
+		if (entries_push(&entries, &num, &capacity, generation,
+		    offset, ce) == false) {
+			free(entries);
+			return false;
+		}
+	}
+
+	/* The in-memory index is up to date, even if we fail to write it. */
+	free(index->entries);
+	index->entries = entries;
+	index->num_entries = num;
+	index->capacity = capacity;
+	index->stale = false;
+
+	if (index_fd < 0)
+		return true;
+
+	return index_write(index_fd, entries, num, ce);
+}
+
+/**
+ * Checks that `entry` still describes the first valid record at its
+ * offset, and marks the index stale otherwise.
+ */
+static bool
+entry_validate(struct crdb_record_stream_index *index,
+    const struct crdb_record_stream_iterator *it,
+    const struct index_entry *entry)
+{
+	uint32_t generation;
+	size_t offset;
+
+	if (crdb_record_stream_iterator_probe(it, entry->offset, &generation,
+	    &offset) == true && offset == entry->offset &&
+	    generation == entry->generation)
+		return true;
+
+	index->stale = true;
+	return false;
+}
+
+bool
+crdb_record_stream_index_seek(struct crdb_record_stream_index *index,
+    struct crdb_record_stream_iterator *it, uint32_t generation,
+    uint32_t k_slack)
+{
+	uint32_t safe = (generation > k_slack) ? generation - k_slack : 0;
+	size_t lo = it->first_nonzero - it->begin;
+	size_t hi = it->stop_at - it->begin;
+	size_t num = index->num_entries;
+	size_t lo_i, hi_i;
+
+	/* Entries at or after the stop offset are useless here. */
+	while (num > 0 && index->entries[num - 1].offset >= hi)
+		num--;
+
+	if (num == 0)
+		goto search;
+
+	/*
+	 * Find neighbouring entries with a generation less than `safe`
+	 * and at least `safe`, in the same way the stream bisection
+	 * does: entries are only k-sorted, but any such pair brackets
+	 * the first record with a generation at least `generation`.
+	 * We bisect over `[lo_i, hi_i)`, shifted by one so that 0
+	 * stands for "no entry before".
+	 */
+	lo_i = 0;
+	hi_i = num + 1;
+	while (hi_i - lo_i > 1) {
+		size_t mid = lo_i + (hi_i - lo_i) / 2;
+
+		if (index->entries[mid - 1].generation < safe) {
+			lo_i = mid;
+		} else {
+			hi_i = mid;
+		}
+	}
+
+	if (lo_i > 0) {
+		const struct index_entry *entry = &index->entries[lo_i - 1];
+
+		if (entry_validate(index, it, entry) == false)
+			goto search;
+
+		lo = entry->offset;
+	}
+
+	if (hi_i <= num) {
+		const struct index_entry *entry = &index->entries[hi_i - 1];
+
+		if (entry_validate(index, it, entry) == false) {
+			lo = it->first_nonzero - it->begin;
+			goto search;
+		}
+
+		hi = entry->offset;
+	}
+
+search:
+	return crdb_record_stream_iterator_seek_range(it, lo, hi, generation,
+	    k_slack);
+}
@@ -0,0 +1,214 @@
+#pragma once
+
+/*
+ * Helpers shared by the record stream translation units.  Nothing in
+ * here is part of the public interface.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "crdb_error.h"
+#include "record_stream.h"
+#include "word_stuff.h"
+
+#define CRDB_ARRAY_SIZE(X) (sizeof(X) / sizeof(*(X)))
+
+#define CRDB_ERROR_SET_(E, M, N, ...) ({ _crdb_error_set(E, M, (N)); false; })
+
+#define crdb_error_set(E, M, ...) CRDB_ERROR_SET_((E), (M), ##__VA_ARGS__, 0)
+
+static inline void
+_crdb_error_set(struct crdb_error *error, const char *message,
+    unsigned long long n)
+{
+
+	if (error == NULL)
+		return;
+
+	error->message = message;
+	error->error = n;
+	return;
+}
+
+/*
+ * Fill the record_header.crc field with CRC_INITIAL_VALUE when
+ * computing the checksum: crc32c is vulnerable to 0-prefixing,
+ * so we make sure the initial bytes are non-zero.
+ */
+#define CRC_INITIAL_VALUE ((uint32_t)-1)
+
+struct record_header {
+	uint32_t crc;
+	uint32_t generation;
+};
+
+/*
+ * Maximum size of an encoded record of at most `LEN` payload bytes,
+ * including the trailing header.
+ */
+#define CRDB_RECORD_STREAM_ENCODED_BOUND(LEN)				\
+	CRDB_WORD_STUFFED_BOUND(sizeof(struct record_header) + (LEN))
+
+#define CRDB_RECORD_STREAM_ENCODED_MAX					\
+	CRDB_RECORD_STREAM_ENCODED_BOUND(CRDB_RECORD_STREAM_MAX_LEN)
+
+/**
+ * Returns the first non-zero byte in `[cursor, end)`, or `end` if
+ * none.
+ */
+const uint8_t *crdb_record_stream_find_first_nonzero(const uint8_t *cursor,
+    const uint8_t *end);
+
+/**
+ * Finds the first valid record at or after `offset` and before the
+ * stop offset of `it`, without moving `it`.
+ *
+ * @return true and populates `generation` and `record_offset` on
+ *   success, false if there is no such record.
+ */
+bool crdb_record_stream_iterator_probe(
+    const struct crdb_record_stream_iterator *it, size_t offset,
+    uint32_t *generation, size_t *record_offset);
+
+/**
+ * Implements `crdb_record_stream_iterator_seek_generation`, given
+ * offsets `lo` and `hi` such that no record that starts before `lo`
+ * has a generation of at least `generation`, and the first valid
+ * record at or after `hi`, if any, has a generation of at least
+ * `generation - k_slack`.
+ */
+bool crdb_record_stream_iterator_seek_range(
+    struct crdb_record_stream_iterator *it, size_t lo, size_t hi,
+    uint32_t generation, uint32_t k_slack);
+
+/**
+ * Encodes and decodes the payload of record stream index records,
+ * a little-endian 64-bit offset.
+ */
+static inline void
+crdb_record_stream_index_entry_encode(uint8_t dst[static 8], uint64_t offset)
+{
+
+	for (size_t i = 0; i < 8; i++)
+		dst[i] = (uint8_t)(offset >> (8 * i));
+
+	return;
+}
+
+static inline uint64_t
+crdb_record_stream_index_entry_decode(const uint8_t src[static 8])
+{
+	uint64_t ret = 0;
+
+	for (size_t i = 0; i < 8; i++)
+		ret |= (uint64_t)src[i] << (8 * i);
+
+	return ret;
+}
+
+/**
+ * Validates `config` (NULL for the defaults), and populates
+ * `max_record_len` with its payload size limit.
+ */
+bool crdb_record_stream_config_max_len(
+    const struct crdb_record_stream_config *config, size_t *max_record_len,
+    crdb_error_t *);
+
+/**
+ * Returns the maximum encoded size readers accept for payloads of up
+ * to `max_record_len` bytes: the same headroom as
+ * CRDB_RECORD_STREAM_BUF_LEN, and never less than the fixed-size
+ * readers.
+ */
+static inline size_t
+crdb_record_stream_max_encoded_len(size_t max_record_len)
+{
+	size_t ret = 2 * max_record_len;
+
+	if (ret < CRDB_RECORD_STREAM_BUF_LEN)
+		ret = CRDB_RECORD_STREAM_BUF_LEN;
+
+	assert(CRDB_RECORD_STREAM_ENCODED_BOUND(max_record_len) <= ret);
+	return ret;
+}
+
+/**
+ * A decoded record's generation and payload, which may point into
+ * the encoded buffer, or into a scratch buffer.
+ */
+struct record_view {
+	uint32_t generation;
+	const uint8_t *data;
+	size_t len;
+};
+
+/**
+ * Decodes and validates the encoded record in
+ * `encoded[0 ... encoded_len - 1]`, without its framing headers.
+ *
+ * @param scratch a buffer of at least `encoded_len - 1` bytes, to
+ *   receive the decoded record when we must unstuff it.
+ * @param zero_copy whether to return a view directly into `encoded`
+ *   when the record does not need any unstuffing.
+ *
+ * @return true and populates `out` if the record is valid.
+ */
+bool crdb_record_stream_decode(const uint8_t *encoded, size_t encoded_len,
+    uint8_t *scratch, bool zero_copy, struct record_view *out);
+
+/**
+ * Decodes and validates the encoded record in
+ * `encoded[0 ... encoded_len - 1]` like `crdb_record_stream_decode`,
+ * but unstuffs the record onto its encoded bytes when necessary.
+ * `out` may thus point anywhere in `encoded`.
+ */
+bool crdb_record_stream_decode_inplace(uint8_t *encoded, size_t encoded_len,
+    struct record_view *out);
+
+/**
+ * Encodes a record containing `buf[0 ... len - 1]` to
+ * `encoded[0 ... *encoded_size - 1]`, trailing header included.
+ *
+ * Encoded records can be concatenated, and appended with
+ * `crdb_record_stream_append_encoded`.
+ */
+bool crdb_record_stream_encode(
+    uint8_t encoded[static CRDB_RECORD_STREAM_ENCODED_MAX],
+    size_t *encoded_size, uint32_t generation, const uint8_t *buf,
+    size_t len, crdb_error_t *);
+
+/**
+ * Encodes a record like `crdb_record_stream_encode`, without any
+ * payload size limit: callers must check `len` against their
+ * configuration.
+ *
+ * @param encoded a buffer of at least
+ *   `CRDB_RECORD_STREAM_ENCODED_BOUND(len)` bytes.
+ */
+bool crdb_record_stream_encode_large(uint8_t *encoded, size_t *encoded_size,
+    uint32_t generation, const uint8_t *buf, size_t len, crdb_error_t *);
+
+/**
+ * Appends `buf[0 ... count - 1]`, one or more encoded records, to
+ * `fd`, with the same retry and header re-insertion logic as
+ * `crdb_record_stream_append_buf`.  Retries after a short write
+ * resume at the first record that wasn't written whole.
+ *
+ * @param fd a file descriptor opened with O_APPEND.
+ */
+bool crdb_record_stream_append_encoded(int fd, const void *buf, size_t count,
+    crdb_error_t *);
+
+/**
+ * Returns where to resume appending the encoded records in the
+ * `iov_count` buffers `iov`, after a short write of their first
+ * `written` bytes: the end of the last record that reached the file
+ * whole, or whose trailing header didn't reach it at all.  The retry
+ * must insert a header before that offset.
+ */
+size_t crdb_record_stream_resume_offset(const struct iovec *iov,
+    size_t iov_count, size_t written);
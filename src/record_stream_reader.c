@@ -0,0 +1,290 @@
+/*
+ * Copyright 2021 Backtrace I/O, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "record_stream_reader.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "record_stream.h"
+#include "record_stream_internal.h"
+#include "word_stuff.h"
+
+/* Refill the buffer at least this many bytes at a time. */
+#define READ_SIZE (64UL << 10)
+
+struct crdb_record_stream_reader {
+	int fd;
+	/* Read with pread(2) at `offset` if true, read(2) otherwise. */
+	bool use_pread;
+	off_t offset;
+
+	size_t max_encoded_len;
+
+	/*
+	 * Buffered bytes are in `buf[start ... used - 1]`.  When we
+	 * need more data, we slide them to the beginning of the
+	 * buffer, and read after them: the buffer always has room for
+	 * a maximal encoded record, its header, the first byte of the
+	 * next header, and one more read.
+	 */
+	uint8_t *buf;
+	size_t start;
+	size_t used;
+	size_t capacity;
+
+	/* The next record starts at `start`, without any header. */
+	bool first_record;
+	/* The descriptor reached EOF. */
+	bool eof;
+	/* ... and we consumed all the buffered bytes. */
+	bool done;
+};
+
+static struct crdb_record_stream_reader *
+reader_create(int fd, bool use_pread, off_t offset,
+    const struct crdb_record_stream_config *config, crdb_error_t *ce)
+{
+	struct crdb_record_stream_reader *reader;
+	size_t max_len;
+
+	if (crdb_record_stream_config_max_len(config, &max_len, ce) == false)
+		return NULL;
+
+	reader = calloc(1, sizeof(*reader));
+	if (reader == NULL) {
+		crdb_error_set(ce, "failed to allocate record stream reader",
+		    errno);
+		return NULL;
+	}
+
+	reader->fd = fd;
+	reader->use_pread = use_pread;
+	reader->offset = offset;
+	reader->max_encoded_len = crdb_record_stream_max_encoded_len(max_len);
+	/*
+	 * reader_next refills with up to `max_encoded_len + 1` bytes
+	 * of record after its header.
+	 */
+	reader->capacity = reader->max_encoded_len +
+	    2 * CRDB_WORD_STUFF_HEADER_SIZE - 1 + READ_SIZE;
+	reader->first_record = true;
+
+	reader->buf = malloc(reader->capacity);
+	if (reader->buf == NULL) {
+		crdb_error_set(ce,
+		    "failed to allocate record stream reader buffer", errno);
+		crdb_record_stream_reader_destroy(reader);
+		return NULL;
+	}
+
+	return reader;
+}
+
+struct crdb_record_stream_reader *
+crdb_record_stream_reader_create(int fd,
+    const struct crdb_record_stream_config *config, crdb_error_t *ce)
+{
+
+	return reader_create(fd, false, 0, config, ce);
+}
+
+struct crdb_record_stream_reader *
+crdb_record_stream_reader_create_pread(int fd, off_t offset,
+    const struct crdb_record_stream_config *config, crdb_error_t *ce)
+{
+
+	if (offset < 0) {
+		crdb_error_set(ce, "negative record stream reader offset");
+		return NULL;
+	}
+
+	return reader_create(fd, true, offset, config, ce);
+}
+
+void
+crdb_record_stream_reader_destroy(struct crdb_record_stream_reader *reader)
+{
+
+	if (reader == NULL)
+		return;
+
+	free(reader->buf);
+	free(reader);
+	return;
+}
+
+/**
+ * Slides the unconsumed bytes to the beginning of the buffer, and
+ * reads more data after them.  Sets `reader->eof` on EOF.
+ */
+static bool
+reader_fill(struct crdb_record_stream_reader *reader, crdb_error_t *ce)
+{
+	ssize_t r;
+
+	if (reader->start > 0) {
+		memmove(reader->buf, reader->buf + reader->start,
+		    reader->used - reader->start);
+		reader->used -= reader->start;
+		reader->start = 0;
+	}
+
+	assert(reader->capacity - reader->used >= READ_SIZE);
+	do {
+		if (reader->use_pread) {
+			r = pread(reader->fd, reader->buf + reader->used,
+			    reader->capacity - reader->used, reader->offset);
+		} else {
+			r = read(reader->fd, reader->buf + reader->used,
+			    reader->capacity - reader->used);
+		}
+	} while (r < 0 && errno == EINTR);
+
+	if (r < 0)
+		return crdb_error_set(ce, "record stream read(2) failed.",
+		    errno);
+
+	if (r == 0)
+		reader->eof = true;
+
+	reader->used += r;
+	reader->offset += r;
+	return true;
+}
+
+bool
+crdb_record_stream_reader_next(struct crdb_record_stream_reader *reader,
+    uint32_t *generation, const uint8_t **data, size_t *len,
+    crdb_error_t *ce)
+{
+
+	*generation = 0;
+	*data = NULL;
+	*len = 0;
+	while (reader->done == false) {
+		const uint8_t *cursor = reader->buf + reader->start;
+		const uint8_t *end = reader->buf + reader->used;
+		const uint8_t *encoded;
+		const uint8_t *next_header;
+		struct record_view view;
+		size_t encoded_len;
+
+		if (reader->first_record == true) {
+			/*
+			 * Like iterators, skip zeros before the first
+			 * record, which may not have any prefixing
+			 * header.
+			 */
+			cursor = crdb_record_stream_find_first_nonzero(cursor,
+			    end);
+
+			reader->start = cursor - reader->buf;
+			if (cursor == end)
+				goto refill;
+
+			encoded = cursor;
+		} else {
+			const uint8_t *header;
+
+			header = crdb_word_stuff_header_find(cursor,
+			    end - cursor);
+			if (header == end) {
+				/*
+				 * Nothing to see here, except maybe
+				 * the first byte of a header.
+				 */
+				if ((size_t)(end - cursor) >=
+				    CRDB_WORD_STUFF_HEADER_SIZE)
+					cursor = end -
+					    (CRDB_WORD_STUFF_HEADER_SIZE - 1);
+				reader->start = cursor - reader->buf;
+				goto refill;
+			}
+
+			/* Hold on to the header while we refill. */
+			reader->start = header - reader->buf;
+			encoded = header + CRDB_WORD_STUFF_HEADER_SIZE;
+		}
+
+		next_header = crdb_word_stuff_header_find(encoded,
+		    end - encoded);
+		if (next_header == end && reader->eof == false) {
+			/*
+			 * The record may continue after the buffered
+			 * bytes.  Refill, unless it's already too long,
+			 * even if the last byte starts the next header.
+			 */
+			if ((size_t)(end - encoded) <= reader->max_encoded_len +
+			    CRDB_WORD_STUFF_HEADER_SIZE - 1)
+				goto refill;
+
+			/* Too long; skip to the next header. */
+			reader->first_record = false;
+			reader->start = (end - reader->buf) -
+			    (CRDB_WORD_STUFF_HEADER_SIZE - 1);
+			continue;
+		}
+
+		/*
+		 * We have the whole record, up to the next header or
+		 * EOF.  Consume it, and decode it: we're done with
+		 * the encoded bytes, so we can unstuff them in place.
+		 */
+		reader->first_record = false;
+		reader->start = next_header - reader->buf;
+		encoded_len = next_header - encoded;
+		if (encoded_len > reader->max_encoded_len)
+			continue;
+
+		if (crdb_record_stream_decode_inplace(
+		    reader->buf + (encoded - reader->buf), encoded_len,
+		    &view) == false)
+			continue;
+
+		*generation = view.generation;
+		*data = view.data;
+		*len = view.len;
+		return true;
+
+refill:
+		if (reader->eof == true) {
+			reader->done = true;
+			break;
+		}
+
+		if (reader_fill(reader, ce) == false)
+			return false;
+	}
+
+	return false;
+}
+
+bool
+crdb_record_stream_reader_eof(const struct crdb_record_stream_reader *reader)
+{
+
+	return reader->done;
+}
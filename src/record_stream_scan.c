@@ -0,0 +1,208 @@
+/*
+ * Copyright 2021 Backtrace I/O, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "record_stream.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "record_stream_internal.h"
+
+/*
+ * Don't bother spinning up a worker for less than this many bytes of
+ * records: thread creation would dominate the decoding work.
+ */
+#define MIN_CHUNK_SIZE (64UL << 10)
+
+/*
+ * Default range size for dynamically scheduled scans: small enough to
+ * balance skewed streams, large enough to amortise the initial header
+ * search in each range.
+ */
+#define DEFAULT_RANGE_SIZE (1UL << 20)
+
+struct scan_state {
+	crdb_record_stream_scan_fn *callback;
+	void *ctx;
+	/* Shared iterator; workers only ever scan copies. */
+	const struct crdb_record_stream_iterator *it;
+	/* Offset of the first byte to scan, and one past the last. */
+	size_t begin;
+	size_t end;
+	size_t range_size;
+	size_t num_ranges;
+	/* Index of the next unclaimed range. */
+	size_t next_range;
+	/* Flipped to true when any callback asks to stop. */
+	bool stop;
+};
+
+struct scan_worker {
+	struct scan_state *state;
+	pthread_t thread;
+	bool spawned;
+};
+
+/**
+ * Scans every record that starts in `[begin, end)`.
+ */
+static void
+scan_range(struct scan_state *state, size_t begin, size_t end)
+{
+	struct crdb_record_stream_iterator it = *state->it;
+	uint8_t buf[CRDB_RECORD_STREAM_BUF_LEN];
+	uint32_t generation;
+	size_t len;
+
+	if (crdb_record_stream_iterator_locate_at(&it, begin) == false)
+		return;
+
+	crdb_record_stream_iterator_stop_at(&it, end);
+	while (__atomic_load_n(&state->stop, __ATOMIC_RELAXED) == false &&
+	    crdb_record_stream_iterator_next_buf(&it, &generation, buf, &len)) {
+		if (state->callback(state->ctx, generation, buf, len) == false)
+			__atomic_store_n(&state->stop, true, __ATOMIC_RELAXED);
+	}
+
+	return;
+}
+
+/**
+ * Claims and scans ranges until there are none left.
+ */
+static void *
+scan_worker_run(void *arg)
+{
+	struct scan_worker *worker = arg;
+	struct scan_state *state = worker->state;
+
+	while (__atomic_load_n(&state->stop, __ATOMIC_RELAXED) == false) {
+		size_t index, begin, end;
+
+		index = __atomic_fetch_add(&state->next_range, 1,
+		    __ATOMIC_RELAXED);
+		if (index >= state->num_ranges)
+			break;
+
+		begin = state->begin + index * state->range_size;
+		end = (state->end - begin > state->range_size) ?
+		    begin + state->range_size : state->end;
+		scan_range(state, begin, end);
+	}
+
+	return NULL;
+}
+
+/**
+ * Scans `fd` with up to `nthreads` workers that claim `range_size`
+ * ranges from a shared cursor, or `nthreads` equal ranges if
+ * `range_size` is 0.
+ */
+static bool
+parallel_scan(int fd, size_t nthreads, size_t range_size,
+    crdb_record_stream_scan_fn *callback, void *ctx, crdb_error_t *ce)
+{
+	struct crdb_record_stream_iterator it;
+	struct scan_state state = {
+		.callback = callback,
+		.ctx = ctx,
+		.it = &it,
+	};
+	struct scan_worker *workers;
+	size_t num_workers;
+
+	if (crdb_record_stream_iterator_init_fd(&it, fd, ce) == false)
+		return false;
+
+	/* Nothing before the first non-zero byte can be a record. */
+	state.begin = it.first_nonzero - it.begin;
+	state.end = crdb_record_stream_iterator_size(&it);
+
+	num_workers = (nthreads > 0) ? nthreads : 1;
+	if (num_workers > 1 + (state.end - state.begin) / MIN_CHUNK_SIZE)
+		num_workers = 1 + (state.end - state.begin) / MIN_CHUNK_SIZE;
+
+	if (range_size == 0) {
+		range_size = (state.end - state.begin + num_workers - 1) /
+		    num_workers;
+	}
+
+	/* Avoid a division by zero on empty streams. */
+	state.range_size = (range_size > 0) ? range_size : 1;
+	state.num_ranges = (state.end - state.begin + state.range_size - 1) /
+	    state.range_size;
+	if (num_workers > state.num_ranges)
+		num_workers = (state.num_ranges > 0) ? state.num_ranges : 1;
+
+	workers = calloc(num_workers, sizeof(*workers));
+	if (workers == NULL) {
+		crdb_record_stream_iterator_deinit(&it);
+		return crdb_error_set(ce,
+		    "failed to allocate record stream scan workers");
+	}
+
+	/*
+	 * The caller is also a worker.  If we fail to spawn a thread,
+	 * the remaining workers simply claim more ranges: we degrade
+	 * to less parallelism, not to failure.
+	 */
+	for (size_t i = 0; i < num_workers; i++) {
+		workers[i].state = &state;
+		if (i > 0) {
+			workers[i].spawned = pthread_create(&workers[i].thread,
+			    NULL, scan_worker_run, &workers[i]) == 0;
+		}
+	}
+
+	scan_worker_run(&workers[0]);
+	for (size_t i = 1; i < num_workers; i++) {
+		if (workers[i].spawned)
+			pthread_join(workers[i].thread, NULL);
+	}
+
+	free(workers);
+	crdb_record_stream_iterator_deinit(&it);
+	if (state.stop)
+		return crdb_error_set(ce, "record stream scan stopped by callback");
+
+	return true;
+}
+
+bool
+crdb_record_stream_parallel_scan(int fd, size_t nthreads,
+    crdb_record_stream_scan_fn *callback, void *ctx, crdb_error_t *ce)
+{
+
+	return parallel_scan(fd, nthreads, 0, callback, ctx, ce);
+}
+
+bool
+crdb_record_stream_parallel_scan_dynamic(int fd, size_t nthreads,
+    size_t range_size, crdb_record_stream_scan_fn *callback, void *ctx,
+    crdb_error_t *ce)
+{
+
+	return parallel_scan(fd, nthreads,
+	    (range_size > 0) ? range_size : DEFAULT_RANGE_SIZE,
+	    callback, ctx, ce);
+}
@@ -0,0 +1,731 @@
+/*
+ * Copyright 2021 Backtrace I/O, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "record_stream_uring.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "record_stream_internal.h"
+
+/* Same as append_to_fd. */
+#define NUM_TRIES 3
+
+/*
+ * CQE user_data values are op pointers, tagged in the low bit to
+ * tell the fsync completion apart from the write's.
+ */
+#define SYNC_TAG 1UL
+
+struct uring_op {
+	crdb_record_stream_uring_cb *cb;
+	void *ctx;
+	/* Outstanding ops, so that destroy can fail them. */
+	struct uring_op *prev;
+	struct uring_op *next;
+	struct iovec iov[2];
+	uint8_t header[CRDB_WORD_STUFF_HEADER_SIZE];
+	size_t count;
+	size_t expected;
+	unsigned int tries;
+	/* Number of CQEs we're still waiting for. */
+	unsigned int pending;
+	/* Flip to true when at least one write was short. */
+	bool partial_write;
+	bool sync;
+	/* Best-effort header write after a failure: no callback. */
+	bool header_only;
+	int write_result;
+	int sync_result;
+	uint8_t encoded[];
+};
+
+struct crdb_record_stream_uring {
+	int fd;
+	int ring_fd;
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	unsigned int cq_entries;
+	struct io_uring_cqe *cqes;
+
+	void *sq_map;
+	size_t sq_map_size;
+	void *cq_map;
+	size_t cq_map_size;
+	size_t sqes_size;
+
+	/* SQEs queued but not yet passed to io_uring_enter. */
+	unsigned int to_submit;
+	/* CQEs we expect from the kernel. */
+	size_t inflight;
+	/* Appends whose callback hasn't run yet. */
+	size_t pending_ops;
+	/* Number of callbacks run in the current poll. */
+	size_t completed;
+	/* Every queued op that hasn't completed yet. */
+	struct uring_op *ops;
+	/* Set once destroy gives up on submitting. */
+	bool failed;
+};
+
+static int
+uring_enter(struct crdb_record_stream_uring *uring, unsigned int min_complete)
+{
+	int r;
+
+	do {
+		r = (int)syscall(__NR_io_uring_enter, uring->ring_fd,
+		    uring->to_submit, min_complete,
+		    (min_complete > 0) ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (r < 0 && errno == EINTR);
+
+	if (r > 0) {
+		assert((unsigned int)r <= uring->to_submit);
+		uring->to_submit -= r;
+	}
+
+	return r;
+}
+
+static bool process_cqe(struct crdb_record_stream_uring *,
+    uint64_t user_data, int res);
+
+/**
+ * Consumes every available CQE.  We release each CQE before
+ * processing it, since callbacks may re-enter the uring.
+ */
+static bool
+reap(struct crdb_record_stream_uring *uring, crdb_error_t *ce)
+{
+	bool ret = true;
+
+	for (;;) {
+		unsigned int head = *uring->cq_head;
+		struct io_uring_cqe *cqe;
+		uint64_t user_data;
+		int res;
+
+		if (head == __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE))
+			break;
+
+		cqe = &uring->cqes[head & uring->cq_mask];
+		user_data = cqe->user_data;
+		res = cqe->res;
+		__atomic_store_n(uring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+		assert(uring->inflight > 0);
+		uring->inflight--;
+		if (process_cqe(uring, user_data, res) == false && ret) {
+			ret = crdb_error_set(ce,
+			    "failed to resubmit record_stream io_uring write");
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * Submits queued SQEs, and waits for at least one completion if
+ * `wait` is true.
+ */
+static bool
+submit_and_reap(struct crdb_record_stream_uring *uring, bool wait,
+    crdb_error_t *ce)
+{
+	unsigned int min_complete = (wait && uring->inflight > 0) ? 1 : 0;
+
+	if (uring->to_submit > 0 || min_complete > 0) {
+		if (uring_enter(uring, min_complete) < 0 && errno != EAGAIN &&
+		    errno != EBUSY)
+			return crdb_error_set(ce,
+			    "record_stream io_uring_enter(2) failed.", errno);
+	}
+
+	return reap(uring, ce);
+}
+
+/**
+ * Waits until we can queue `num_sqes` more SQEs, without overflowing
+ * the completion queue.
+ */
+static bool
+reserve(struct crdb_record_stream_uring *uring, unsigned int num_sqes,
+    crdb_error_t *ce)
+{
+
+	for (;;) {
+		unsigned int used = *uring->sq_tail -
+		    __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+
+		if (used + num_sqes <= uring->sq_entries &&
+		    uring->inflight + num_sqes <= uring->cq_entries)
+			return true;
+
+		if (submit_and_reap(uring, true, ce) == false)
+			return false;
+	}
+}
+
+static void
+op_link(struct crdb_record_stream_uring *uring, struct uring_op *op)
+{
+
+	op->prev = NULL;
+	op->next = uring->ops;
+	if (uring->ops != NULL)
+		uring->ops->prev = op;
+	uring->ops = op;
+	return;
+}
+
+static void
+op_unlink(struct crdb_record_stream_uring *uring, struct uring_op *op)
+{
+
+	if (op->prev != NULL)
+		op->prev->next = op->next;
+	else
+		uring->ops = op->next;
+
+	if (op->next != NULL)
+		op->next->prev = op->prev;
+
+	op->prev = op->next = NULL;
+	return;
+}
+
+static struct io_uring_sqe *
+push_sqe(struct crdb_record_stream_uring *uring)
+{
+	unsigned int tail = *uring->sq_tail;
+	unsigned int index = tail & uring->sq_mask;
+	struct io_uring_sqe *sqe = &uring->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	uring->sq_array[index] = index;
+	__atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	uring->to_submit++;
+	uring->inflight++;
+	return sqe;
+}
+
+/**
+ * Queues the SQEs for `op`: a writev, optionally linked to an
+ * fdatasync.
+ */
+static bool
+queue_op(struct crdb_record_stream_uring *uring, struct uring_op *op,
+    crdb_error_t *ce)
+{
+	unsigned int num_sqes = op->sync ? 2 : 1;
+	struct io_uring_sqe *sqe;
+
+	if (uring->failed)
+		return crdb_error_set(ce,
+		    "record_stream io_uring failed while shutting down.");
+
+	if (reserve(uring, num_sqes, ce) == false)
+		return false;
+
+	op->pending = num_sqes;
+	op->write_result = 0;
+	op->sync_result = 0;
+
+	sqe = push_sqe(uring);
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = uring->fd;
+	/* The first write does not include a header. */
+	sqe->addr = (uintptr_t)((op->iov[0].iov_len > 0) ? &op->iov[0] : &op->iov[1]);
+	sqe->len = (op->iov[0].iov_len > 0) ? 2 : 1;
+	/*
+	 * O_APPEND ignores the offset.  Don't pass -1 ("current
+	 * position"): kernels before 5.6 reject it.
+	 */
+	sqe->off = 0;
+	sqe->user_data = (uintptr_t)op;
+
+	if (op->sync) {
+		sqe->flags |= IOSQE_IO_LINK;
+		sqe = push_sqe(uring);
+		sqe->opcode = IORING_OP_FSYNC;
+		sqe->fd = uring->fd;
+		sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+		sqe->user_data = (uintptr_t)op | SYNC_TAG;
+	}
+
+	return true;
+}
+
+/**
+ * Runs the callback for `op`, once it's no longer in the list of
+ * outstanding ops.
+ */
+static void
+op_callback(struct crdb_record_stream_uring *uring, struct uring_op *op,
+    const crdb_error_t *error)
+{
+
+	if (op->header_only == false) {
+		assert(uring->pending_ops > 0);
+		uring->pending_ops--;
+		uring->completed++;
+		if (op->cb != NULL)
+			op->cb(op->ctx, error == NULL, error);
+	}
+
+	return;
+}
+
+static void
+complete_op(struct crdb_record_stream_uring *uring, struct uring_op *op,
+    const crdb_error_t *error)
+{
+
+	op_unlink(uring, op);
+	op_callback(uring, op, error);
+	free(op);
+	return;
+}
+
+/**
+ * After a failure with partial writes, try to at least leave a header
+ * for the next writer.  This is best-effort, like in append_to_fd.
+ */
+static void
+queue_trailing_header(struct crdb_record_stream_uring *uring,
+    const struct uring_op *failed)
+{
+	struct uring_op *op;
+
+	op = calloc(1, sizeof(*op));
+	if (op == NULL)
+		return;
+
+	op->header_only = true;
+	op->tries = NUM_TRIES;
+	memcpy(op->header, failed->header, sizeof(op->header));
+	op->iov[0] = (struct iovec) {
+		.iov_base = op->header,
+		.iov_len = sizeof(op->header),
+	};
+	op->iov[1] = (struct iovec) { .iov_base = op->header };
+	op->expected = sizeof(op->header);
+	if (queue_op(uring, op, NULL) == false) {
+		free(op);
+		return;
+	}
+
+	op_link(uring, op);
+	return;
+}
+
+static bool
+process_cqe(struct crdb_record_stream_uring *uring, uint64_t user_data,
+    int res)
+{
+	struct uring_op *op = (struct uring_op *)(uintptr_t)(user_data & ~SYNC_TAG);
+	crdb_error_t error = CRDB_ERROR_INITIALIZER;
+	bool ret = true;
+
+	if (user_data & SYNC_TAG)
+		op->sync_result = res;
+	else
+		op->write_result = res;
+
+	assert(op->pending > 0);
+	if (--op->pending > 0)
+		return true;
+
+	if (op->write_result >= 0 && (size_t)op->write_result == op->expected) {
+		if (op->sync && op->sync_result < 0) {
+			crdb_error_set(&error,
+			    "record_stream io_uring fdatasync(2) failed.",
+			    -op->sync_result);
+			complete_op(uring, op, &error);
+		} else {
+			complete_op(uring, op, NULL);
+		}
+
+		return true;
+	}
+
+	if (op->write_result > 0 && op->header_only == false) {
+		size_t written = (size_t)op->write_result;
+		size_t resume;
+
+		/*
+		 * Same logic as append_to_fd: after a short write, we
+		 * can't assume the previous write left a header for
+		 * us, so we prepend one to the retries, which resume
+		 * at the first record that wasn't written whole.  A
+		 * partially written header is finished instead.
+		 */
+		op->partial_write = true;
+		if (written < op->iov[0].iov_len) {
+			op->iov[0].iov_base =
+			    (uint8_t *)op->iov[0].iov_base + written;
+			op->iov[0].iov_len -= written;
+			op->expected -= written;
+		} else {
+			written -= op->iov[0].iov_len;
+			resume = crdb_record_stream_resume_offset(&op->iov[1],
+			    1, written);
+			op->iov[1].iov_base =
+			    (uint8_t *)op->iov[1].iov_base + resume;
+			op->iov[1].iov_len -= resume;
+			op->count -= resume;
+
+			(void)crdb_word_stuff_header(op->header);
+			op->iov[0] = (struct iovec) {
+				.iov_base = op->header,
+				.iov_len = sizeof(op->header),
+			};
+			op->expected = op->count + sizeof(op->header);
+		}
+	}
+
+	if (++op->tries < NUM_TRIES) {
+		if (queue_op(uring, op, &error))
+			return true;
+
+		/*
+		 * Nothing will ever complete the op if we can't
+		 * resubmit it: fail it now, with the reason.
+		 */
+		ret = false;
+	} else if (op->write_result < 0) {
+		crdb_error_set(&error, "record_stream io_uring writev failed.",
+		    -op->write_result);
+	} else {
+		crdb_error_set(&error, "Short write in record_stream.");
+	}
+
+	if (op->partial_write)
+		queue_trailing_header(uring, op);
+
+	complete_op(uring, op, &error);
+	return ret;
+}
+
+static struct uring_op *
+op_create(size_t encoded_capacity, bool sync, crdb_record_stream_uring_cb *cb,
+    void *ctx, crdb_error_t *ce)
+{
+	struct uring_op *op;
+
+	op = calloc(1, sizeof(*op) + encoded_capacity);
+	if (op == NULL) {
+		crdb_error_set(ce, "failed to allocate record_stream io_uring op",
+		    errno);
+		return NULL;
+	}
+
+	op->cb = cb;
+	op->ctx = ctx;
+	op->sync = sync;
+	return op;
+}
+
+/**
+ * Queues `op` once its `encoded` buffer holds `count` bytes.
+ */
+static bool
+op_submit(struct crdb_record_stream_uring *uring, struct uring_op *op,
+    size_t count, crdb_error_t *ce)
+{
+
+	op->count = count;
+	op->expected = count;
+	op->iov[0] = (struct iovec) { .iov_base = op->header, .iov_len = 0 };
+	op->iov[1] = (struct iovec) { .iov_base = op->encoded, .iov_len = count };
+	if (queue_op(uring, op, ce) == false) {
+		free(op);
+		return false;
+	}
+
+	op_link(uring, op);
+	uring->pending_ops++;
+	return true;
+}
+
+bool
+crdb_record_stream_uring_append(struct crdb_record_stream_uring *uring,
+    uint32_t generation, const uint8_t *buf, size_t len, bool sync,
+    crdb_record_stream_uring_cb *cb, void *ctx, crdb_error_t *ce)
+{
+	struct uring_op *op;
+	size_t encoded_size;
+
+	op = op_create(CRDB_RECORD_STREAM_ENCODED_MAX, sync, cb, ctx, ce);
+	if (op == NULL)
+		return false;
+
+	if (crdb_record_stream_encode(op->encoded, &encoded_size, generation,
+	    buf, len, ce) == false) {
+		free(op);
+		return false;
+	}
+
+	return op_submit(uring, op, encoded_size, ce);
+}
+
+bool
+crdb_record_stream_uring_append_batch(struct crdb_record_stream_uring *uring,
+    const struct crdb_record_iov *records, size_t n, bool sync,
+    crdb_record_stream_uring_cb *cb, void *ctx, crdb_error_t *ce)
+{
+	struct uring_op *op;
+	size_t encoded_size = 0;
+
+	if (n == 0 || n > SIZE_MAX / CRDB_RECORD_STREAM_ENCODED_MAX)
+		return crdb_error_set(ce, "invalid crdb_record_stream batch size");
+
+	op = op_create(n * CRDB_RECORD_STREAM_ENCODED_MAX, sync, cb, ctx, ce);
+	if (op == NULL)
+		return false;
+
+	for (size_t i = 0; i < n; i++) {
+		size_t record_size;
+
+		if (crdb_record_stream_encode(op->encoded + encoded_size,
+		    &record_size, records[i].generation, records[i].buf,
+		    records[i].len, ce) == false) {
+			free(op);
+			return false;
+		}
+
+		encoded_size += record_size;
+	}
+
+	return op_submit(uring, op, encoded_size, ce);
+}
+
+size_t
+crdb_record_stream_uring_poll(struct crdb_record_stream_uring *uring,
+    size_t min_complete, crdb_error_t *ce)
+{
+
+	uring->completed = 0;
+	if (submit_and_reap(uring, false, ce) == false)
+		return SIZE_MAX;
+
+	while (uring->completed < min_complete && uring->inflight > 0) {
+		if (submit_and_reap(uring, true, ce) == false)
+			return SIZE_MAX;
+	}
+
+	return uring->completed;
+}
+
+size_t
+crdb_record_stream_uring_pending(const struct crdb_record_stream_uring *uring)
+{
+
+	return uring->pending_ops;
+}
+
+struct crdb_record_stream_uring *
+crdb_record_stream_uring_create(int fd, unsigned int depth, crdb_error_t *ce)
+{
+	struct crdb_record_stream_uring *uring;
+	struct io_uring_params params;
+	uint8_t *sq, *cq;
+
+	if (crdb_record_stream_append_initial(fd, ce) == false)
+		return NULL;
+
+	uring = calloc(1, sizeof(*uring));
+	if (uring == NULL) {
+		crdb_error_set(ce, "failed to allocate record_stream io_uring",
+		    errno);
+		return NULL;
+	}
+
+	uring->fd = fd;
+	memset(&params, 0, sizeof(params));
+	/* Each append may need a write and a linked fsync. */
+	uring->ring_fd = (int)syscall(__NR_io_uring_setup,
+	    2 * ((depth > 0) ? depth : 1), &params);
+	if (uring->ring_fd < 0) {
+		crdb_error_set(ce, "record_stream io_uring_setup(2) failed.",
+		    errno);
+		free(uring);
+		return NULL;
+	}
+
+	uring->sq_map_size = params.sq_off.array +
+	    params.sq_entries * sizeof(unsigned int);
+	uring->cq_map_size = params.cq_off.cqes +
+	    params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (uring->cq_map_size > uring->sq_map_size)
+			uring->sq_map_size = uring->cq_map_size;
+		uring->cq_map_size = 0;
+	}
+
+	uring->sq_map = mmap(NULL, uring->sq_map_size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_SQ_RING);
+	if (uring->sq_map == MAP_FAILED) {
+		crdb_error_set(ce, "failed to mmap record_stream io_uring",
+		    errno);
+		goto fail_sq;
+	}
+
+	uring->cq_map = uring->sq_map;
+	if (uring->cq_map_size > 0) {
+		uring->cq_map = mmap(NULL, uring->cq_map_size,
+		    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		    uring->ring_fd, IORING_OFF_CQ_RING);
+		if (uring->cq_map == MAP_FAILED) {
+			crdb_error_set(ce,
+			    "failed to mmap record_stream io_uring", errno);
+			goto fail_cq;
+		}
+	}
+
+	uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_SQES);
+	if (uring->sqes == MAP_FAILED) {
+		crdb_error_set(ce, "failed to mmap record_stream io_uring",
+		    errno);
+		goto fail_sqes;
+	}
+
+	sq = uring->sq_map;
+	uring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+	uring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+	uring->sq_mask = *(unsigned int *)(sq + params.sq_off.ring_mask);
+	uring->sq_entries = *(unsigned int *)(sq + params.sq_off.ring_entries);
+	uring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+
+	cq = uring->cq_map;
+	uring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+	uring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+	uring->cq_mask = *(unsigned int *)(cq + params.cq_off.ring_mask);
+	uring->cq_entries = *(unsigned int *)(cq + params.cq_off.ring_entries);
+	uring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	return uring;
+
+fail_sqes:
+	if (uring->cq_map != uring->sq_map)
+		munmap(uring->cq_map, uring->cq_map_size);
+fail_cq:
+	munmap(uring->sq_map, uring->sq_map_size);
+fail_sq:
+	close(uring->ring_fd);
+	free(uring);
+	return NULL;
+}
+
+/**
+ * Takes back the SQEs the kernel hasn't consumed yet, and processes
+ * them as cancelled.  Only safe once `failed` is set, so that nothing
+ * queues new SQEs.
+ */
+static void
+cancel_unsubmitted(struct crdb_record_stream_uring *uring)
+{
+	unsigned int head = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+	unsigned int tail = *uring->sq_tail;
+
+	assert(uring->failed);
+
+	/* Without SQPOLL, the kernel only reads the SQ in io_uring_enter. */
+	__atomic_store_n(uring->sq_tail, head, __ATOMIC_RELEASE);
+	uring->to_submit = 0;
+	for (unsigned int i = head; i != tail; i++) {
+		const struct io_uring_sqe *sqe;
+
+		sqe = &uring->sqes[uring->sq_array[i & uring->sq_mask]];
+		assert(uring->inflight > 0);
+		uring->inflight--;
+		(void)process_cqe(uring, sqe->user_data, -ECANCELED);
+	}
+
+	return;
+}
+
+void
+crdb_record_stream_uring_destroy(struct crdb_record_stream_uring *uring)
+{
+	crdb_error_t error = CRDB_ERROR_INITIALIZER;
+
+	if (uring == NULL)
+		return;
+
+	while (uring->inflight > 0) {
+		if (uring_enter(uring, 1) < 0 && errno != EAGAIN &&
+		    errno != EBUSY) {
+			crdb_error_set(&error,
+			    "record_stream io_uring_enter(2) failed.", errno);
+			if (uring->failed)
+				break;
+
+			/*
+			 * Stop submitting, but keep waiting for what
+			 * the kernel already has.
+			 */
+			uring->failed = true;
+			cancel_unsubmitted(uring);
+		}
+
+		/* Failed resubmissions also fail their op. */
+		(void)reap(uring, NULL);
+	}
+
+	/*
+	 * We couldn't even wait: fail the remaining appends.  The kernel
+	 * may still read from their buffers, so we leak them.
+	 */
+	while (uring->ops != NULL) {
+		struct uring_op *op = uring->ops;
+
+		op_unlink(uring, op);
+		op_callback(uring, op, &error);
+	}
+
+	munmap(uring->sqes, uring->sqes_size);
+	if (uring->cq_map != uring->sq_map)
+		munmap(uring->cq_map, uring->cq_map_size);
+	munmap(uring->sq_map, uring->sq_map_size);
+	close(uring->ring_fd);
+	free(uring);
+	return;
+}
@@ -0,0 +1,491 @@
+/*
+ * Copyright 2021 Backtrace I/O, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "record_stream_writer.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "record_stream.h"
+#include "record_stream_internal.h"
+
+#define DEFAULT_FLUSH_BYTES (64UL << 10)
+
+struct crdb_record_stream_writer {
+	pthread_mutex_t lock;
+	/* Signaled when the background thread may have work to do. */
+	pthread_cond_t wakeup;
+	pthread_t thread;
+	bool has_thread;
+	bool stopping;
+
+	int fd;
+	struct crdb_record_stream_writer_config config;
+
+	/*
+	 * Encoded records waiting to be written.  The buffer always
+	 * has room for one more encoded record once we're under the
+	 * flush threshold.
+	 */
+	uint8_t *buf;
+	size_t used;
+	size_t capacity;
+	/* Monotonic time at which the first buffered record was added. */
+	uint64_t oldest_us;
+
+	/*
+	 * Index entries for buffered records: each record's position in
+	 * `buf`, and a parallel array of index records, which we
+	 * complete with the records' offsets once they're written.
+	 * There's at most one entry every `index_interval` bytes, so
+	 * `index_capacity` entries always fit.
+	 */
+	size_t *index_positions;
+	struct crdb_record_iov *index_records;
+	uint8_t (*index_payloads)[8];
+	size_t index_count;
+	size_t index_capacity;
+	/* Bytes buffered or written since the last index entry. */
+	size_t unindexed;
+
+	/* Whether we wrote anything since the last sync. */
+	bool dirty;
+	uint64_t last_sync_us;
+
+	/* The first failure in a background flush or sync, if any. */
+	bool has_error;
+	crdb_error_t error;
+};
+
+static uint64_t
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Reports any pending background error to `ce`, and clears it.
+ *
+ * @return false if there was an error.
+ */
+static bool
+consume_error_locked(struct crdb_record_stream_writer *writer,
+    crdb_error_t *ce)
+{
+
+	if (writer->has_error == false)
+		return true;
+
+	writer->has_error = false;
+	if (ce != NULL)
+		*ce = writer->error;
+	return false;
+}
+
+/**
+ * Remembers the first background error, for the next caller.
+ */
+static void
+save_error_locked(struct crdb_record_stream_writer *writer,
+    const crdb_error_t *error)
+{
+
+	if (writer->has_error)
+		return;
+
+	writer->has_error = true;
+	writer->error = *error;
+	return;
+}
+
+/**
+ * Appends index entries for the buffered records that were just
+ * written, given the file offset right after them.
+ */
+static void
+index_flushed_locked(struct crdb_record_stream_writer *writer, off_t end)
+{
+	size_t count = 0;
+
+	/* O_APPEND writes leave the file position after our records. */
+	if (end < 0 || (size_t)end < writer->used)
+		return;
+
+	for (size_t i = 0; i < writer->index_count; i++) {
+		/* Entries point to the header before each record. */
+		size_t offset = (size_t)end - writer->used +
+		    writer->index_positions[i];
+
+		if (offset < CRDB_WORD_STUFF_HEADER_SIZE)
+			continue;
+
+		crdb_record_stream_index_entry_encode(
+		    writer->index_payloads[count],
+		    offset - CRDB_WORD_STUFF_HEADER_SIZE);
+		writer->index_records[count] = (struct crdb_record_iov) {
+			.generation = writer->index_records[i].generation,
+			.buf = writer->index_payloads[count],
+			.len = sizeof(writer->index_payloads[count]),
+		};
+		count++;
+	}
+
+	(void)crdb_record_stream_append_batch(writer->config.index_fd,
+	    writer->index_records, count, NULL);
+	return;
+}
+
+/**
+ * Writes out the buffer.  Buffered records are dropped even on
+ * failure: the write was already retried, and we expect write
+ * failures to be sticky.
+ */
+static bool
+flush_locked(struct crdb_record_stream_writer *writer, crdb_error_t *ce)
+{
+	bool ret;
+
+	if (writer->used == 0)
+		return true;
+
+	ret = crdb_record_stream_append_encoded(writer->fd, writer->buf,
+	    writer->used, ce);
+	if (ret && writer->index_count > 0)
+		index_flushed_locked(writer, lseek(writer->fd, 0, SEEK_CUR));
+
+	writer->index_count = 0;
+	writer->used = 0;
+	if (writer->dirty == false) {
+		writer->dirty = true;
+		/* Let the background thread schedule a sync. */
+		pthread_cond_signal(&writer->wakeup);
+	}
+
+	return ret;
+}
+
+/**
+ * Syncs the descriptor.  Must be called with the lock held, and
+ * releases it for the duration of the syscall.
+ */
+static bool
+sync_locked(struct crdb_record_stream_writer *writer, crdb_error_t *ce)
+{
+	int r;
+
+	writer->dirty = false;
+	writer->last_sync_us = now_us();
+	pthread_mutex_unlock(&writer->lock);
+	r = fdatasync(writer->fd);
+	pthread_mutex_lock(&writer->lock);
+	if (r != 0)
+		return crdb_error_set(ce, "record_stream fdatasync(2) failed.",
+		    errno);
+
+	return true;
+}
+
+static void *
+background_run(void *arg)
+{
+	struct crdb_record_stream_writer *writer = arg;
+	const struct crdb_record_stream_writer_config *config = &writer->config;
+
+	pthread_mutex_lock(&writer->lock);
+	while (writer->stopping == false) {
+		uint64_t now = now_us();
+		uint64_t deadline = UINT64_MAX;
+
+		if (config->flush_latency_us > 0 && writer->used > 0) {
+			uint64_t flush_at = writer->oldest_us +
+			    config->flush_latency_us;
+
+			if (now >= flush_at) {
+				crdb_error_t error = CRDB_ERROR_INITIALIZER;
+
+				if (flush_locked(writer, &error) == false)
+					save_error_locked(writer, &error);
+				continue;
+			}
+
+			deadline = flush_at;
+		}
+
+		if (config->sync_interval_us > 0 && writer->dirty) {
+			uint64_t sync_at = writer->last_sync_us +
+			    config->sync_interval_us;
+
+			if (now >= sync_at) {
+				crdb_error_t error = CRDB_ERROR_INITIALIZER;
+
+				if (sync_locked(writer, &error) == false)
+					save_error_locked(writer, &error);
+				continue;
+			}
+
+			if (sync_at < deadline)
+				deadline = sync_at;
+		}
+
+		if (deadline == UINT64_MAX) {
+			pthread_cond_wait(&writer->wakeup, &writer->lock);
+		} else {
+			struct timespec ts = {
+				.tv_sec = deadline / 1000000,
+				.tv_nsec = (deadline % 1000000) * 1000,
+			};
+
+			pthread_cond_timedwait(&writer->wakeup, &writer->lock,
+			    &ts);
+		}
+	}
+
+	pthread_mutex_unlock(&writer->lock);
+	return NULL;
+}
+
+struct crdb_record_stream_writer *
+crdb_record_stream_writer_create(int fd,
+    const struct crdb_record_stream_writer_config *config, crdb_error_t *ce)
+{
+	struct crdb_record_stream_writer *writer;
+	pthread_condattr_t attr;
+	int r;
+
+	if (crdb_record_stream_append_initial(fd, ce) == false)
+		return NULL;
+
+	writer = calloc(1, sizeof(*writer));
+	if (writer == NULL) {
+		crdb_error_set(ce, "failed to allocate record stream writer",
+		    errno);
+		return NULL;
+	}
+
+	writer->fd = fd;
+	if (config != NULL)
+		writer->config = *config;
+	if (writer->config.flush_bytes == 0)
+		writer->config.flush_bytes = DEFAULT_FLUSH_BYTES;
+
+	{
+		struct crdb_record_stream_config stream_config = {
+			.max_record_len = writer->config.max_record_len,
+		};
+
+		if (crdb_record_stream_config_max_len(&stream_config,
+		    &writer->config.max_record_len, ce) == false)
+			goto fail_buf;
+	}
+
+	writer->capacity = writer->config.flush_bytes +
+	    CRDB_RECORD_STREAM_ENCODED_BOUND(writer->config.max_record_len);
+	writer->buf = malloc(writer->capacity);
+	if (writer->buf == NULL) {
+		crdb_error_set(ce,
+		    "failed to allocate record stream writer buffer", errno);
+		goto fail_buf;
+	}
+
+	if (writer->config.index_interval > 0) {
+		size_t n = writer->capacity / writer->config.index_interval + 1;
+
+		if (crdb_record_stream_append_initial(writer->config.index_fd,
+		    ce) == false)
+			goto fail_index;
+
+		writer->index_capacity = n;
+		writer->index_positions = calloc(n,
+		    sizeof(*writer->index_positions));
+		writer->index_records = calloc(n,
+		    sizeof(*writer->index_records));
+		writer->index_payloads = calloc(n,
+		    sizeof(*writer->index_payloads));
+		if (writer->index_positions == NULL ||
+		    writer->index_records == NULL ||
+		    writer->index_payloads == NULL) {
+			crdb_error_set(ce,
+			    "failed to allocate record stream writer index",
+			    errno);
+			goto fail_index;
+		}
+
+		/* Always index the first record. */
+		writer->unindexed = writer->config.index_interval;
+	}
+
+	writer->last_sync_us = now_us();
+	pthread_mutex_init(&writer->lock, NULL);
+	/* Deadlines are computed on the monotonic clock. */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&writer->wakeup, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (writer->config.flush_latency_us > 0 ||
+	    writer->config.sync_interval_us > 0) {
+		r = pthread_create(&writer->thread, NULL, background_run,
+		    writer);
+		if (r != 0) {
+			crdb_error_set(ce,
+			    "failed to start record stream writer thread", r);
+			goto fail_thread;
+		}
+
+		writer->has_thread = true;
+	}
+
+	return writer;
+
+fail_thread:
+	pthread_cond_destroy(&writer->wakeup);
+	pthread_mutex_destroy(&writer->lock);
+fail_index:
+	free(writer->index_payloads);
+	free(writer->index_records);
+	free(writer->index_positions);
+	free(writer->buf);
+fail_buf:
+	free(writer);
+	return NULL;
+}
+
+bool
+crdb_record_stream_writer_destroy(struct crdb_record_stream_writer *writer,
+    crdb_error_t *ce)
+{
+	bool ret;
+
+	if (writer == NULL)
+		return true;
+
+	pthread_mutex_lock(&writer->lock);
+	writer->stopping = true;
+	pthread_cond_signal(&writer->wakeup);
+	pthread_mutex_unlock(&writer->lock);
+
+	if (writer->has_thread)
+		pthread_join(writer->thread, NULL);
+
+	/* The background thread is gone; we're the only user left. */
+	ret = consume_error_locked(writer, ce);
+	if (ret)
+		ret = flush_locked(writer, ce);
+	else
+		(void)flush_locked(writer, NULL);
+
+	pthread_cond_destroy(&writer->wakeup);
+	pthread_mutex_destroy(&writer->lock);
+	free(writer->index_payloads);
+	free(writer->index_records);
+	free(writer->index_positions);
+	free(writer->buf);
+	free(writer);
+	return ret;
+}
+
+bool
+crdb_record_stream_writer_append(struct crdb_record_stream_writer *writer,
+    uint32_t generation, const uint8_t *buf, size_t len, crdb_error_t *ce)
+{
+	size_t encoded_size;
+	bool ret = true;
+
+	pthread_mutex_lock(&writer->lock);
+	if (consume_error_locked(writer, ce) == false) {
+		ret = false;
+		goto out;
+	}
+
+	if (len > writer->config.max_record_len) {
+		ret = crdb_error_set(ce, "crdb_record_stream data too long");
+		goto out;
+	}
+
+	if (crdb_record_stream_encode_large(writer->buf + writer->used,
+	    &encoded_size, generation, buf, len, ce) == false) {
+		ret = false;
+		goto out;
+	}
+
+	if (writer->used == 0) {
+		writer->oldest_us = now_us();
+		/* Let the background thread schedule a flush. */
+		if (writer->config.flush_latency_us > 0)
+			pthread_cond_signal(&writer->wakeup);
+	}
+
+	if (writer->config.index_interval > 0) {
+		if (writer->unindexed >= writer->config.index_interval) {
+			assert(writer->index_count < writer->index_capacity);
+			writer->index_positions[writer->index_count] =
+			    writer->used;
+			writer->index_records[writer->index_count].generation =
+			    generation;
+			writer->index_count++;
+			writer->unindexed = 0;
+		}
+
+		writer->unindexed += encoded_size;
+	}
+
+	writer->used += encoded_size;
+	if (writer->used >= writer->config.flush_bytes)
+		ret = flush_locked(writer, ce);
+
+out:
+	pthread_mutex_unlock(&writer->lock);
+	return ret;
+}
+
+bool
+crdb_record_stream_writer_flush(struct crdb_record_stream_writer *writer,
+    crdb_error_t *ce)
+{
+	bool ret;
+
+	pthread_mutex_lock(&writer->lock);
+	ret = consume_error_locked(writer, ce) && flush_locked(writer, ce);
+	pthread_mutex_unlock(&writer->lock);
+	return ret;
+}
+
+bool
+crdb_record_stream_writer_sync(struct crdb_record_stream_writer *writer,
+    crdb_error_t *ce)
+{
+	bool ret;
+
+	pthread_mutex_lock(&writer->lock);
+	ret = consume_error_locked(writer, ce) && flush_locked(writer, ce) &&
+	    sync_locked(writer, ce);
+	pthread_mutex_unlock(&writer->lock);
+	return ret;
+}
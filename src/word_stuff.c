@@ -23,10 +23,18 @@
 
 #include "word_stuff.h"
 
+#include "crdb_crc32c.h"
+
 #include <assert.h>
 #include <limits.h>
 #include <string.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+#define CRDB_WORD_STUFF_X86
+#endif
+
 #define RADIX 0xFDUL
 
 /*
@@ -43,6 +51,27 @@
  */
 #define MAX_REMAINING_RUN ((RADIX * RADIX) - 1)
 
+/*
+ * Searches over at most this many bytes always use the scalar loop:
+ * even the SSE2 kernel needs 17 bytes for one full iteration.
+ */
+#define HEADER_FIND_SCALAR_LIMIT 16
+
+/* Header masks cover blocks of 64 bytes, one bit per byte. */
+#define HEADER_MASK_BLOCK 64
+
+/*
+ * Fused decoding copies and checksums long runs in blocks of this
+ * many bytes, to make sure the checksum reads from L1.
+ */
+#define FUSED_CRC_BLOCK 2048
+
+/*
+ * One-shot encoding of sources at least this long finds headers with
+ * block masks rather than repeated searches.
+ */
+#define ENCODE_MASKED_MIN 256
+
 /* Hardcode a reasonable cache line size. */
 #define CACHE_LINE_SIZE 64
 
@@ -61,8 +90,14 @@ static const uint8_t header[] = { RADIX + 1, RADIX };
 static_assert(sizeof(header) == CRDB_WORD_STUFF_HEADER_SIZE,
     "Header byte sequence does not match the header size.");
 
-inline const uint8_t *
-crdb_word_stuff_header_find(const uint8_t *data, size_t num)
+/*
+ * The scalar search is the reference implementation: every vectorised
+ * kernel must return exactly the same pointer.  The kernels also defer
+ * to narrower kernels (and eventually to this function) for the bytes
+ * that don't fill a full vector.
+ */
+static const uint8_t *
+header_find_scalar(const uint8_t *data, size_t num)
 {
 	const union {
 		uint8_t bytes[CRDB_WORD_STUFF_HEADER_SIZE];
@@ -91,6 +126,400 @@ crdb_word_stuff_header_find(const uint8_t *data, size_t num)
 	return data + num;
 }
 
+#ifdef CRDB_WORD_STUFF_X86
+/*
+ * The vectorised kernels compare a block of bytes against the first
+ * header byte, and the same block shifted by one byte against the
+ * second header byte.  Bit `i` in the AND of the two comparison masks
+ * is set iff the header begins at offset `i` in the block.
+ *
+ * Each iteration thus reads one byte past the block, and a kernel only
+ * handles blocks for which that byte exists; it passes the remainder
+ * to the next narrower kernel.
+ */
+static const uint8_t *
+header_find_sse2(const uint8_t *data, size_t num)
+{
+	const __m128i first = _mm_set1_epi8((char)header[0]);
+	const __m128i second = _mm_set1_epi8((char)header[1]);
+	size_t i;
+
+	for (i = 0; i + sizeof(__m128i) < num; i += sizeof(__m128i)) {
+		__m128i lo = _mm_loadu_si128((const __m128i *)(data + i));
+		__m128i hi = _mm_loadu_si128((const __m128i *)(data + i + 1));
+		unsigned int mask;
+
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(lo, first)) &
+		    _mm_movemask_epi8(_mm_cmpeq_epi8(hi, second));
+		if (mask != 0)
+			return data + i + __builtin_ctz(mask);
+	}
+
+	return header_find_scalar(data + i, num - i);
+}
+
+__attribute__((__target__("avx2")))
+static const uint8_t *
+header_find_avx2(const uint8_t *data, size_t num)
+{
+	const __m256i first = _mm256_set1_epi8((char)header[0]);
+	const __m256i second = _mm256_set1_epi8((char)header[1]);
+	size_t i;
+
+	for (i = 0; i + sizeof(__m256i) < num; i += sizeof(__m256i)) {
+		__m256i lo = _mm256_loadu_si256((const __m256i *)(data + i));
+		__m256i hi = _mm256_loadu_si256((const __m256i *)(data + i + 1));
+		unsigned int mask;
+
+		mask = (unsigned int)_mm256_movemask_epi8(
+		    _mm256_cmpeq_epi8(lo, first)) &
+		    (unsigned int)_mm256_movemask_epi8(
+		    _mm256_cmpeq_epi8(hi, second));
+		if (mask != 0)
+			return data + i + __builtin_ctz(mask);
+	}
+
+	/*
+	 * The SSE2 kernel uses legacy (non-VEX) encodings: clear the
+	 * upper halves of the ymm registers first, or every SSE
+	 * instruction pays for the dirty upper state.  GCC doesn't
+	 * insert the vzeroupper before tail calls.
+	 */
+	_mm256_zeroupper();
+	return header_find_sse2(data + i, num - i);
+}
+
+__attribute__((__target__("avx512bw")))
+static const uint8_t *
+header_find_avx512bw(const uint8_t *data, size_t num)
+{
+	const __m512i first = _mm512_set1_epi8((char)header[0]);
+	const __m512i second = _mm512_set1_epi8((char)header[1]);
+	size_t i;
+
+	for (i = 0; i + sizeof(__m512i) < num; i += sizeof(__m512i)) {
+		__m512i lo = _mm512_loadu_si512(data + i);
+		__m512i hi = _mm512_loadu_si512(data + i + 1);
+		__mmask64 mask;
+
+		mask = _mm512_cmpeq_epi8_mask(lo, first) &
+		    _mm512_cmpeq_epi8_mask(hi, second);
+		if (mask != 0)
+			return data + i + __builtin_ctzll(mask);
+	}
+
+	/* The AVX2 kernel clears the upper state before SSE2. */
+	return header_find_avx2(data + i, num - i);
+}
+
+/*
+ * The mask kernels compute one 64-bit header mask for each of the
+ * `num_blocks` 64-byte blocks in `data`, with the same shifted
+ * comparison as the search kernels.  The caller must guarantee that
+ * the byte after the last block, `data[64 * num_blocks]`, is readable.
+ */
+static void
+header_masks_sse2(uint64_t *masks, const uint8_t *data, size_t num_blocks)
+{
+	const __m128i first = _mm_set1_epi8((char)header[0]);
+	const __m128i second = _mm_set1_epi8((char)header[1]);
+
+	for (size_t i = 0; i < num_blocks; i++) {
+		const uint8_t *block = data + i * HEADER_MASK_BLOCK;
+		uint64_t mask = 0;
+
+		for (size_t j = 0; j < HEADER_MASK_BLOCK; j += sizeof(__m128i)) {
+			__m128i lo = _mm_loadu_si128(
+			    (const __m128i *)(block + j));
+			__m128i hi = _mm_loadu_si128(
+			    (const __m128i *)(block + j + 1));
+			uint64_t bits;
+
+			bits = _mm_movemask_epi8(_mm_cmpeq_epi8(lo, first)) &
+			    _mm_movemask_epi8(_mm_cmpeq_epi8(hi, second));
+			mask |= bits << j;
+		}
+
+		masks[i] = mask;
+	}
+
+	return;
+}
+
+__attribute__((__target__("avx2")))
+static void
+header_masks_avx2(uint64_t *masks, const uint8_t *data, size_t num_blocks)
+{
+	const __m256i first = _mm256_set1_epi8((char)header[0]);
+	const __m256i second = _mm256_set1_epi8((char)header[1]);
+
+	for (size_t i = 0; i < num_blocks; i++) {
+		const uint8_t *block = data + i * HEADER_MASK_BLOCK;
+		uint64_t mask = 0;
+
+		for (size_t j = 0; j < HEADER_MASK_BLOCK; j += sizeof(__m256i)) {
+			__m256i lo = _mm256_loadu_si256(
+			    (const __m256i *)(block + j));
+			__m256i hi = _mm256_loadu_si256(
+			    (const __m256i *)(block + j + 1));
+			uint64_t bits;
+
+			bits = (uint32_t)_mm256_movemask_epi8(
+			    _mm256_cmpeq_epi8(lo, first)) &
+			    (uint32_t)_mm256_movemask_epi8(
+			    _mm256_cmpeq_epi8(hi, second));
+			mask |= bits << j;
+		}
+
+		masks[i] = mask;
+	}
+
+	return;
+}
+
+__attribute__((__target__("avx512bw")))
+static void
+header_masks_avx512bw(uint64_t *masks, const uint8_t *data, size_t num_blocks)
+{
+	const __m512i first = _mm512_set1_epi8((char)header[0]);
+	const __m512i second = _mm512_set1_epi8((char)header[1]);
+
+	static_assert(sizeof(__m512i) == HEADER_MASK_BLOCK,
+	    "An AVX-512 vector must span exactly one mask block.");
+
+	for (size_t i = 0; i < num_blocks; i++) {
+		const uint8_t *block = data + i * HEADER_MASK_BLOCK;
+
+		masks[i] = _mm512_cmpeq_epi8_mask(_mm512_loadu_si512(block),
+		    first) &
+		    _mm512_cmpeq_epi8_mask(_mm512_loadu_si512(block + 1),
+		    second);
+	}
+
+	return;
+}
+#endif /* CRDB_WORD_STUFF_X86 */
+
+/*
+ * Computes the header mask for `data[0 ... num - 1]`; `num` may be
+ * at most one more than the block size, since a header at the end of
+ * the block ends in the next block.  Reference implementation for
+ * the mask kernels, which it also completes for the last partial
+ * block.
+ */
+static uint64_t
+header_mask_scalar(const uint8_t *data, size_t num)
+{
+	uint64_t mask = 0;
+
+	assert(num <= HEADER_MASK_BLOCK + 1);
+	for (size_t i = 0; i + 1 < num; i++) {
+		if (data[i] == header[0] && data[i + 1] == header[1])
+			mask |= 1ULL << i;
+	}
+
+	return mask;
+}
+
+#ifndef CRDB_WORD_STUFF_X86
+static void
+header_masks_scalar(uint64_t *masks, const uint8_t *data, size_t num_blocks)
+{
+
+	for (size_t i = 0; i < num_blocks; i++) {
+		/* We may read one byte past the block. */
+		masks[i] = header_mask_scalar(data + i * HEADER_MASK_BLOCK,
+		    HEADER_MASK_BLOCK + 1);
+	}
+
+	return;
+}
+#endif
+
+typedef const uint8_t *header_find_fn(const uint8_t *, size_t);
+typedef void header_masks_fn(uint64_t *, const uint8_t *, size_t);
+
+struct word_stuff_kernels {
+	header_find_fn *header_find;
+	header_masks_fn *header_masks;
+};
+
+static header_find_fn header_find_lazy;
+static header_masks_fn header_masks_lazy;
+
+static const struct word_stuff_kernels lazy_kernels = {
+	.header_find = header_find_lazy,
+	.header_masks = header_masks_lazy,
+};
+
+/*
+ * Points to the kernels for the widest instruction set the CPU
+ * supports once `kernels_resolve` has run (at load time, or on the
+ * first call, whichever comes first).
+ */
+static const struct word_stuff_kernels *kernels = &lazy_kernels;
+
+static const struct word_stuff_kernels *
+kernels_select(void)
+{
+#ifdef CRDB_WORD_STUFF_X86
+	static const struct word_stuff_kernels sse2 = {
+		.header_find = header_find_sse2,
+		.header_masks = header_masks_sse2,
+	};
+	static const struct word_stuff_kernels avx2 = {
+		.header_find = header_find_avx2,
+		.header_masks = header_masks_avx2,
+	};
+	static const struct word_stuff_kernels avx512bw = {
+		.header_find = header_find_avx512bw,
+		.header_masks = header_masks_avx512bw,
+	};
+
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512bw"))
+		return &avx512bw;
+
+	if (__builtin_cpu_supports("avx2"))
+		return &avx2;
+
+	return &sse2;
+#else
+	static const struct word_stuff_kernels scalar = {
+		.header_find = header_find_scalar,
+		.header_masks = header_masks_scalar,
+	};
+
+	return &scalar;
+#endif
+}
+
+static const struct word_stuff_kernels *
+kernels_resolve(void)
+{
+	const struct word_stuff_kernels *ret = kernels_select();
+
+	/* Every thread computes the same value, so races are benign. */
+	__atomic_store_n(&kernels, ret, __ATOMIC_RELAXED);
+	return ret;
+}
+
+static const uint8_t *
+header_find_lazy(const uint8_t *data, size_t num)
+{
+
+	return kernels_resolve()->header_find(data, num);
+}
+
+static void
+header_masks_lazy(uint64_t *masks, const uint8_t *data, size_t num_blocks)
+{
+
+	kernels_resolve()->header_masks(masks, data, num_blocks);
+	return;
+}
+
+__attribute__((__constructor__))
+static void
+kernels_init(void)
+{
+
+	(void)kernels_resolve();
+	return;
+}
+
+static inline const struct word_stuff_kernels *
+kernels_get(void)
+{
+
+	return __atomic_load_n(&kernels, __ATOMIC_RELAXED);
+}
+
+inline const uint8_t *
+crdb_word_stuff_header_find(const uint8_t *data, size_t num)
+{
+
+	/* Don't pay for an indirect call when there's nothing to vectorise. */
+	if (num <= HEADER_FIND_SCALAR_LIMIT)
+		return header_find_scalar(data, num);
+
+	return kernels_get()->header_find(data, num);
+}
+
+/*
+ * Computes header masks for all of `data[0 ... num - 1]`, in
+ * 64-byte blocks: one call to the mask kernel for every block that
+ * is followed by at least one more byte, and a scalar pass for the
+ * last (partial) block.
+ *
+ * @return the number of masks written, `ceil(num / 64)`.
+ */
+static size_t
+header_masks(uint64_t *masks, const uint8_t *data, size_t num)
+{
+	/* The kernel may read the byte after its last block. */
+	size_t num_full = (num == 0) ? 0 : (num - 1) / HEADER_MASK_BLOCK;
+	size_t tail = num - num_full * HEADER_MASK_BLOCK;
+
+	if (num_full > 0)
+		kernels_get()->header_masks(masks, data, num_full);
+
+	if (tail == 0)
+		return num_full;
+
+	masks[num_full] = header_mask_scalar(
+	    data + num_full * HEADER_MASK_BLOCK, tail);
+	return num_full + 1;
+}
+
+size_t
+crdb_word_stuff_header_bitmap(uint64_t *bitmap, const uint8_t *data,
+    size_t num)
+{
+	size_t num_masks;
+	size_t ret = 0;
+
+	num_masks = header_masks(bitmap, data, num);
+	for (size_t i = 0; i < num_masks; i++)
+		ret += __builtin_popcountll(bitmap[i]);
+
+	return ret;
+}
+
+size_t
+crdb_word_stuff_header_offsets(uint64_t *offsets, size_t capacity,
+    const uint8_t *data, size_t num)
+{
+	/*
+	 * Compute masks for up to 1 KB at a time.  Each batch also
+	 * looks at the first byte of the next batch, in case a header
+	 * straddles the boundary; the mask for that single byte is
+	 * always 0.
+	 */
+	enum { BATCH = 16 };
+	uint64_t masks[BATCH + 1];
+	size_t ret = 0;
+
+	for (size_t base = 0; base < num && ret < capacity;
+	     base += BATCH * HEADER_MASK_BLOCK) {
+		size_t num_masks;
+
+		num_masks = header_masks(masks, data + base,
+		    min(num - base, (size_t)BATCH * HEADER_MASK_BLOCK + 1));
+		for (size_t i = 0; i < num_masks; i++) {
+			uint64_t mask = masks[i];
+
+			while (mask != 0 && ret < capacity) {
+				offsets[ret++] = base + i * HEADER_MASK_BLOCK +
+				    __builtin_ctzll(mask);
+				mask &= mask - 1;
+			}
+		}
+	}
+
+	return ret;
+}
+
 size_t
 crdb_word_stuffed_size(size_t in_size, bool with_header)
 {
@@ -223,13 +652,183 @@ decode_run_size(const uint8_t src[static 2])
 		src_size -= consumed_;		\
 	} while (0)
 
-uint8_t *
-crdb_word_stuff_encode(uint8_t *dst, const void *vsrc, size_t src_size)
+/*
+ * Updates `*crc` with `data[0 ... n - 1]`, except for the first
+ * `*skip` bytes of the raw (decoded) stream, which are excluded from
+ * the checksum.
+ */
+static inline void
+crc_update_skip(uint32_t *crc, size_t *skip, const uint8_t *data, size_t n)
+{
+
+	if (CRDB_UNLIKELY(*skip > 0)) {
+		size_t skipped = min(*skip, n);
+
+		*skip -= skipped;
+		data += skipped;
+		n -= skipped;
+	}
+
+	*crc = crdb_crc32c_update(*crc, data, n);
+	return;
+}
+
+/*
+ * Copies a run of literals, and checksums them if `crc != NULL`.
+ *
+ * Long runs are copied and checksummed in blocks, so that each byte
+ * is still in L1 when we checksum it.
+ */
+__attribute__((__always_inline__))
+static inline void
+copy_run(uint8_t *dst, const uint8_t *src, size_t n, uint32_t *crc,
+    size_t *crc_skip)
+{
+
+	if (crc == NULL) {
+		short_memcpy(dst, src, n);
+		return;
+	}
+
+	while (n > FUSED_CRC_BLOCK) {
+		memcpy(dst, src, FUSED_CRC_BLOCK);
+		crc_update_skip(crc, crc_skip, src, FUSED_CRC_BLOCK);
+		dst += FUSED_CRC_BLOCK;
+		src += FUSED_CRC_BLOCK;
+		n -= FUSED_CRC_BLOCK;
+	}
+
+	short_memcpy(dst, src, n);
+	crc_update_skip(crc, crc_skip, src, n);
+	return;
+}
+
+/*
+ * Writes the size of a run of `n` literals, followed by the literals.
+ */
+__attribute__((__always_inline__))
+static inline uint8_t *
+emit_run(uint8_t *dst, const uint8_t *src, size_t n, bool first,
+    uint32_t *crc, size_t *crc_skip)
+{
+
+	if (first) {
+		assert(n <= MAX_INITIAL_RUN);
+		*dst++ = n;
+	} else {
+		dst = encode_run_size(dst, n);
+	}
+
+	copy_run(dst, src, n, crc, crc_skip);
+	return dst + n;
+}
+
+/*
+ * Encoding loop for longer sources.  Rather than restarting a header
+ * search after each forbidden sequence, we compute header masks for
+ * 1 KB of source at a time, and walk the set bits with ctz: the cost
+ * of finding headers is then independent of their density, and each
+ * match only costs a run size and a short copy.
+ *
+ * Headers never overlap (FE FD FE FD matches at 0 and 2, but a match
+ * at 1 would need FD == FE), so every mask bit is a header that
+ * `encode` would find, unless it is cut by a run's size limit: a
+ * header whose first byte is the last literal of a full run is
+ * invisible to `encode`'s bounded search, so we skip it here as well.
+ *
+ * The checksum covers every source byte, literal or header, in order,
+ * so we update it once per batch, while the batch is still in L1,
+ * instead of once per run.
+ */
+__attribute__((__always_inline__))
+static inline uint8_t *
+encode_masked(uint8_t *dst, const uint8_t *src, size_t src_size,
+    uint32_t *crc)
+{
+	enum { BATCH = 16 };
+	uint64_t masks[BATCH + 1];
+	const uint8_t *run = src;  /* First literal of the current run. */
+	const uint8_t *end = src + src_size;
+	size_t max_run_size = MAX_INITIAL_RUN;
+	size_t crc_skip = 0;
+
+#define FULL_RUN() do {							\
+		dst = emit_run(dst, run, max_run_size,			\
+		    max_run_size == MAX_INITIAL_RUN, NULL, NULL);	\
+		run += max_run_size;					\
+		max_run_size = MAX_REMAINING_RUN;			\
+	} while (0)
+
+	for (size_t base = 0; base < src_size;
+	     base += BATCH * HEADER_MASK_BLOCK) {
+		size_t batch_size;
+		size_t num_masks;
+
+		/* Also look at the next batch's first byte, as in offsets. */
+		num_masks = header_masks(masks, src + base,
+		    min(src_size - base, (size_t)BATCH * HEADER_MASK_BLOCK + 1));
+		batch_size = min(src_size - base,
+		    (size_t)BATCH * HEADER_MASK_BLOCK);
+		if (crc != NULL)
+			crc_update_skip(crc, &crc_skip, src + base, batch_size);
+
+		for (size_t i = 0; i < num_masks; i++) {
+			uint64_t mask = masks[i];
+
+			while (mask != 0) {
+				const uint8_t *match = src + base +
+				    i * HEADER_MASK_BLOCK +
+				    __builtin_ctzll(mask);
+
+				mask &= mask - 1;
+				/*
+				 * Emit full runs until the header starts
+				 * before the current run's last literal.
+				 */
+				while (match >= run &&
+				    (size_t)(match - run) >= max_run_size - 1)
+					FULL_RUN();
+
+				if (match < run)
+					continue;
+
+				dst = emit_run(dst, run, match - run,
+				    max_run_size == MAX_INITIAL_RUN,
+				    NULL, NULL);
+				run = match + CRDB_WORD_STUFF_HEADER_SIZE;
+				max_run_size = MAX_REMAINING_RUN;
+			}
+		}
+	}
+
+	/* And finish with a virtual header at the end of the source. */
+	while ((size_t)(end - run) >= max_run_size)
+		FULL_RUN();
+
+#undef FULL_RUN
+
+	return emit_run(dst, run, end - run, max_run_size == MAX_INITIAL_RUN,
+	    NULL, NULL);
+}
+
+/*
+ * Shared encoding loop.  When `crc` is non-NULL, the raw source bytes
+ * are also fed to the CRC32C accumulator `*crc` as they are copied or
+ * skipped; as for decoding, we always call this function with a
+ * constant `crc` argument.
+ */
+__attribute__((__always_inline__))
+static inline uint8_t *
+encode(uint8_t *dst, const void *vsrc, size_t src_size, uint32_t *crc)
 {
 	const uint8_t *src = vsrc;
 	uint8_t *ret = dst;
+	size_t crc_skip = 0;
 	bool first_header = true;
 
+	if (src_size >= ENCODE_MASKED_MIN)
+		return encode_masked(dst, src, src_size, crc);
+
 	/*
 	 * Encoding looks for the next forbidden (header) sequence
 	 * within the length that can be encoded in the current chunk:
@@ -272,7 +871,7 @@ crdb_word_stuff_encode(uint8_t *dst, const void *vsrc, size_t src_size)
 			ret = encode_run_size(ret, run_size);
 		}
 
-		short_memcpy(ret, src, run_size);
+		copy_run(ret, src, run_size, crc, &crc_skip);
 		ret += run_size;
 
 		CONSUME(run_size);
@@ -292,6 +891,9 @@ crdb_word_stuff_encode(uint8_t *dst, const void *vsrc, size_t src_size)
 			    src[0] == header[0] && src[1] == header[1] &&
 			    "If we stopped short, we must have found "
 			    "a forbidden header word.");
+			if (crc != NULL)
+				crc_update_skip(crc, &crc_skip, header,
+				    sizeof(header));
 			CONSUME(CRDB_WORD_STUFF_HEADER_SIZE);
 		}
 	}
@@ -300,7 +902,195 @@ crdb_word_stuff_encode(uint8_t *dst, const void *vsrc, size_t src_size)
 }
 
 uint8_t *
-crdb_word_stuff_decode(uint8_t *dst, const void *vsrc, size_t src_size)
+crdb_word_stuff_encode(uint8_t *dst, const void *src, size_t src_size)
+{
+
+	return encode(dst, src, src_size, NULL);
+}
+
+uint8_t *
+crdb_word_stuff_encode_crc32c(uint8_t *dst, const void *src, size_t src_size,
+    uint32_t *crc)
+{
+
+	return encode(dst, src, src_size, crc);
+}
+
+/*
+ * Reserves room for the size of a new run at the encoder's write
+ * pointer: one byte for the first run, two for the others.
+ */
+static inline void
+encoder_open_run(struct crdb_word_stuff_encoder *encoder)
+{
+
+	encoder->run_size_dst = encoder->dst;
+	encoder->dst += (encoder->max_run_size == 0) ? 1 : 2;
+	encoder->max_run_size = (encoder->max_run_size == 0) ?
+	    MAX_INITIAL_RUN : MAX_REMAINING_RUN;
+	encoder->run_size = 0;
+	return;
+}
+
+static inline void
+encoder_close_run(struct crdb_word_stuff_encoder *encoder)
+{
+
+	if (encoder->max_run_size == MAX_INITIAL_RUN) {
+		assert(encoder->run_size <= MAX_INITIAL_RUN);
+		encoder->run_size_dst[0] = encoder->run_size;
+	} else {
+		encode_run_size(encoder->run_size_dst, encoder->run_size);
+	}
+
+	return;
+}
+
+static inline void
+encoder_copy(struct crdb_word_stuff_encoder *encoder, const uint8_t *src,
+    size_t n)
+{
+	size_t crc_skip = 0;
+
+	copy_run(encoder->dst, src, n,
+	    encoder->checksum ? &encoder->crc : NULL, &crc_skip);
+	encoder->dst += n;
+	encoder->run_size += n;
+	return;
+}
+
+void
+crdb_word_stuff_encoder_init(struct crdb_word_stuff_encoder *encoder,
+    uint8_t *dst)
+{
+
+	*encoder = (struct crdb_word_stuff_encoder) {
+		.dst = dst,
+	};
+
+	encoder_open_run(encoder);
+	return;
+}
+
+void
+crdb_word_stuff_encoder_init_crc32c(struct crdb_word_stuff_encoder *encoder,
+    uint8_t *dst, uint32_t crc)
+{
+
+	crdb_word_stuff_encoder_init(encoder, dst);
+	encoder->crc = crc;
+	encoder->checksum = true;
+	return;
+}
+
+/*
+ * Mirrors `encode`, one piece at a time: each run ends either at a
+ * forbidden sequence, which is consumed, or when it reaches its
+ * maximum size.  A header byte at the very end of a piece may be the
+ * beginning of a forbidden sequence, so we hold on to it until we see
+ * the next byte, or the end of the input.
+ */
+void
+crdb_word_stuff_encoder_feed(struct crdb_word_stuff_encoder *encoder,
+    const void *vsrc, size_t src_size)
+{
+	const uint8_t *src = vsrc;
+
+	while (src_size > 0) {
+		const uint8_t *next_forbidden;
+		size_t available;
+		size_t run_size;
+
+		if (encoder->pending_header_byte) {
+			encoder->pending_header_byte = false;
+			if (src[0] == header[1]) {
+				if (encoder->checksum)
+					encoder->crc = crdb_crc32c_update(
+					    encoder->crc, header,
+					    sizeof(header));
+				CONSUME(1);
+				encoder_close_run(encoder);
+				encoder_open_run(encoder);
+				continue;
+			}
+
+			/* Just a literal. */
+			encoder_copy(encoder, header, 1);
+		}
+
+		available = encoder->max_run_size - encoder->run_size;
+		next_forbidden = crdb_word_stuff_header_find(src,
+		    min(available, src_size));
+		run_size = next_forbidden - src;
+
+		/*
+		 * The piece ends before the run is full: its last
+		 * byte may start a header that straddles into the
+		 * next piece.
+		 */
+		if (run_size == src_size && src_size < available &&
+		    src[src_size - 1] == header[0]) {
+			encoder_copy(encoder, src, run_size - 1);
+			encoder->pending_header_byte = true;
+			return;
+		}
+
+		encoder_copy(encoder, src, run_size);
+		CONSUME(run_size);
+		if (encoder->run_size == encoder->max_run_size) {
+			/* Full run, without any implicit header. */
+			encoder_close_run(encoder);
+			encoder_open_run(encoder);
+		} else if (src_size > 0) {
+			assert(src_size >= CRDB_WORD_STUFF_HEADER_SIZE &&
+			    src[0] == header[0] && src[1] == header[1] &&
+			    "If we stopped short, we must have found "
+			    "a forbidden header word.");
+			if (encoder->checksum)
+				encoder->crc = crdb_crc32c_update(encoder->crc,
+				    header, sizeof(header));
+			CONSUME(CRDB_WORD_STUFF_HEADER_SIZE);
+			encoder_close_run(encoder);
+			encoder_open_run(encoder);
+		}
+	}
+
+	return;
+}
+
+uint8_t *
+crdb_word_stuff_encoder_finish(struct crdb_word_stuff_encoder *encoder,
+    uint32_t *crc)
+{
+
+	if (encoder->pending_header_byte) {
+		encoder->pending_header_byte = false;
+		encoder_copy(encoder, header, 1);
+	}
+
+	/*
+	 * The last run is never full (we open a new run as soon as
+	 * one fills up), so it ends with the virtual terminating
+	 * header.
+	 */
+	assert(encoder->run_size < encoder->max_run_size);
+	encoder_close_run(encoder);
+	if (crc != NULL && encoder->checksum)
+		*crc = encoder->crc;
+
+	return encoder->dst;
+}
+
+/*
+ * Shared decoding loop.  When `crc` is non-NULL, the decoded bytes
+ * (except for the first `crc_skip`) are also fed to the CRC32C
+ * accumulator `*crc`; we always call this function with a constant
+ * `crc` argument, so the compiler specialises each version.
+ */
+__attribute__((__always_inline__))
+static inline uint8_t *
+decode(uint8_t *dst, const void *vsrc, size_t src_size, uint32_t *crc,
+    size_t crc_skip)
 {
 	const uint8_t *src = vsrc;
 	uint8_t *ret = dst;
@@ -357,7 +1147,7 @@ crdb_word_stuff_decode(uint8_t *dst, const void *vsrc, size_t src_size)
 		    run_size > max_run_size))
 			return NULL;
 
-		short_memcpy(ret, src, run_size);
+		copy_run(ret, src, run_size, crc, &crc_skip);
 		ret += run_size;
 		CONSUME(run_size);
 
@@ -379,10 +1169,384 @@ crdb_word_stuff_decode(uint8_t *dst, const void *vsrc, size_t src_size)
 				return NULL;
 
 			ret = crdb_word_stuff_header(ret);
+			if (crc != NULL)
+				crc_update_skip(crc, &crc_skip, header,
+				    sizeof(header));
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * State for `crdb_word_stuff_encode_iov`: the same logic as the
+ * incremental encoder, except that literals become iovecs into the
+ * source, and run sizes are written to the side buffer.
+ */
+struct iov_encoder {
+	struct iovec *dst;
+	size_t count;
+	size_t capacity;
+	uint8_t *meta;
+	uint8_t *meta_end;
+	uint8_t *run_size_dst;
+	size_t run_size;
+	size_t max_run_size;
+	bool pending_header_byte;
+	bool overflow;
+};
+
+/*
+ * Appends `data[0 ... n - 1]` to the output, as a new iovec, or by
+ * extending the last one when the bytes are adjacent in memory.
+ */
+static void
+iov_encoder_emit(struct iov_encoder *encoder, const uint8_t *data, size_t n)
+{
+	if (n == 0)
+		return;
+
+	if (encoder->count > 0) {
+		struct iovec *last = &encoder->dst[encoder->count - 1];
+
+		if ((const uint8_t *)last->iov_base + last->iov_len == data) {
+			last->iov_len += n;
+			return;
+		}
+	}
+
+	if (encoder->count == encoder->capacity) {
+		encoder->overflow = true;
+		return;
+	}
+
+	encoder->dst[encoder->count++] = (struct iovec) {
+		.iov_base = (void *)data,
+		.iov_len = n,
+	};
+	return;
+}
+
+static void
+iov_encoder_open_run(struct iov_encoder *encoder)
+{
+	size_t size_bytes = (encoder->max_run_size == 0) ? 1 : 2;
+
+	if ((size_t)(encoder->meta_end - encoder->meta) < size_bytes) {
+		encoder->overflow = true;
+		return;
+	}
+
+	encoder->run_size_dst = encoder->meta;
+	encoder->meta += size_bytes;
+	iov_encoder_emit(encoder, encoder->run_size_dst, size_bytes);
+	encoder->max_run_size = (encoder->max_run_size == 0) ?
+	    MAX_INITIAL_RUN : MAX_REMAINING_RUN;
+	encoder->run_size = 0;
+	return;
+}
+
+static void
+iov_encoder_close_run(struct iov_encoder *encoder)
+{
+
+	if (encoder->max_run_size == MAX_INITIAL_RUN) {
+		encoder->run_size_dst[0] = encoder->run_size;
+	} else {
+		encode_run_size(encoder->run_size_dst, encoder->run_size);
+	}
+
+	return;
+}
+
+static void
+iov_encoder_literals(struct iov_encoder *encoder, const uint8_t *data,
+    size_t n)
+{
+
+	iov_encoder_emit(encoder, data, n);
+	encoder->run_size += n;
+	return;
+}
+
+static void
+iov_encoder_next_run(struct iov_encoder *encoder)
+{
+
+	iov_encoder_close_run(encoder);
+	iov_encoder_open_run(encoder);
+	return;
+}
+
+bool
+crdb_word_stuff_encode_iov(struct iovec *dst, size_t dst_capacity,
+    size_t *dst_count, uint8_t *meta, size_t meta_capacity,
+    const struct iovec *iov, size_t iov_count)
+{
+	struct iov_encoder encoder = {
+		.dst = dst,
+		.capacity = dst_capacity,
+		.meta = meta,
+		.meta_end = meta + meta_capacity,
+	};
+
+	*dst_count = 0;
+	iov_encoder_open_run(&encoder);
+	for (size_t i = 0; i < iov_count && !encoder.overflow; i++) {
+		const uint8_t *src = iov[i].iov_base;
+		size_t src_size = iov[i].iov_len;
+
+		while (src_size > 0 && !encoder.overflow) {
+			const uint8_t *next_forbidden;
+			size_t available;
+			size_t run_size;
+
+			if (encoder.pending_header_byte) {
+				encoder.pending_header_byte = false;
+				if (src[0] == header[1]) {
+					CONSUME(1);
+					iov_encoder_next_run(&encoder);
+					continue;
+				}
+
+				iov_encoder_literals(&encoder, header, 1);
+			}
+
+			available = encoder.max_run_size - encoder.run_size;
+			next_forbidden = crdb_word_stuff_header_find(src,
+			    min(available, src_size));
+			run_size = next_forbidden - src;
+
+			/* See crdb_word_stuff_encoder_feed. */
+			if (run_size == src_size && src_size < available &&
+			    src[src_size - 1] == header[0]) {
+				iov_encoder_literals(&encoder, src,
+				    run_size - 1);
+				encoder.pending_header_byte = true;
+				break;
+			}
+
+			iov_encoder_literals(&encoder, src, run_size);
+			CONSUME(run_size);
+			if (encoder.run_size == encoder.max_run_size) {
+				iov_encoder_next_run(&encoder);
+			} else if (src_size > 0) {
+				CONSUME(CRDB_WORD_STUFF_HEADER_SIZE);
+				iov_encoder_next_run(&encoder);
+			}
 		}
 	}
 
+	if (encoder.pending_header_byte)
+		iov_encoder_literals(&encoder, header, 1);
+
+	if (encoder.overflow)
+		return false;
+
+	iov_encoder_close_run(&encoder);
+	*dst_count = encoder.count;
+	return true;
+}
+
+void
+crdb_word_stuff_decoder_init(struct crdb_word_stuff_decoder *decoder,
+    uint8_t *dst)
+{
+
+	*decoder = (struct crdb_word_stuff_decoder) {
+		.dst = dst,
+	};
+
+	return;
+}
+
+void
+crdb_word_stuff_decoder_init_crc32c(struct crdb_word_stuff_decoder *decoder,
+    uint8_t *dst, size_t crc_skip, uint32_t crc)
+{
+
+	crdb_word_stuff_decoder_init(decoder, dst);
+	decoder->crc = crc;
+	decoder->crc_skip = crc_skip;
+	decoder->checksum = true;
+	return;
+}
+
+/*
+ * Mirrors `decode`, one fragment at a time.  The decoder is either
+ * copying a run of literals (`run_remaining > 0`), or reading the
+ * next run's size.
+ */
+bool
+crdb_word_stuff_decoder_feed(struct crdb_word_stuff_decoder *decoder,
+    const void *vsrc, size_t src_size)
+{
+	const uint8_t *src = vsrc;
+	uint32_t *crc = decoder->checksum ? &decoder->crc : NULL;
+
+	if (decoder->failed)
+		return false;
+
+	while (src_size > 0) {
+		size_t run_size;
+
+		if (decoder->run_remaining > 0) {
+			size_t n = min(decoder->run_remaining, src_size);
+
+			copy_run(decoder->dst, src, n, crc,
+			    &decoder->crc_skip);
+			decoder->dst += n;
+			decoder->run_remaining -= n;
+			CONSUME(n);
+			continue;
+		}
+
+		if (decoder->max_run_size == 0) {
+			decoder->max_run_size = MAX_INITIAL_RUN;
+			run_size = src[0];
+			CONSUME(1);
+		} else if (decoder->has_run_size_low == false) {
+			decoder->has_run_size_low = true;
+			decoder->run_size_low = src[0];
+			CONSUME(1);
+			continue;
+		} else {
+			const uint8_t run_size_bytes[] = {
+				decoder->run_size_low, src[0],
+			};
+
+			decoder->has_run_size_low = false;
+			decoder->max_run_size = MAX_REMAINING_RUN;
+			run_size = decode_run_size(run_size_bytes);
+			CONSUME(1);
+		}
+
+		if (CRDB_UNLIKELY(run_size > decoder->max_run_size)) {
+			decoder->failed = true;
+			return false;
+		}
+
+		/*
+		 * The previous run had an implicit header, and it
+		 * wasn't the virtual terminating one.
+		 */
+		if (decoder->implicit_header) {
+			decoder->dst = crdb_word_stuff_header(decoder->dst);
+			if (crc != NULL)
+				crc_update_skip(crc, &decoder->crc_skip,
+				    header, sizeof(header));
+		}
+
+		decoder->implicit_header = run_size < decoder->max_run_size;
+		decoder->run_remaining = run_size;
+	}
+
+	return true;
+}
+
+uint8_t *
+crdb_word_stuff_decoder_finish(struct crdb_word_stuff_decoder *decoder,
+    uint32_t *crc)
+{
+
+	/*
+	 * We must be right after a short run: its implicit header is
+	 * the virtual terminating one.
+	 */
+	if (decoder->failed || decoder->run_remaining > 0 ||
+	    decoder->has_run_size_low || decoder->implicit_header == false)
+		return NULL;
+
+	if (crc != NULL && decoder->checksum)
+		*crc = decoder->crc;
+
+	return decoder->dst;
+}
+
+uint8_t *
+crdb_word_stuff_decode(uint8_t *dst, const void *src, size_t src_size)
+{
+
+	return decode(dst, src, src_size, NULL, 0);
+}
+
+uint8_t *
+crdb_word_stuff_decode_inplace(uint8_t *buf, size_t size)
+{
+	const uint8_t *src = buf;
+	size_t src_size = size;
+	uint8_t *ret = buf;
+	size_t max_run_size = MAX_INITIAL_RUN;
+	size_t run_size;
+
+	/*
+	 * Same logic as `decode`, except that we must read the next
+	 * run size before writing the previous run's implicit header
+	 * over it.  Writes never overtake reads: the write pointer
+	 * starts one byte (the first run size) behind `src`, an
+	 * implicit header takes exactly the room of the run size we
+	 * just consumed, and the gap grows by two bytes after every
+	 * full run, whose size and header we drop.  Runs may still
+	 * overlap their destination, hence memmove.
+	 */
+	if (CRDB_UNLIKELY(src_size < 1))
+		return NULL;
+
+	run_size = src[0];
+	CONSUME(1);
+	for (;;) {
+		bool implicit_header;
+
+		if (CRDB_UNLIKELY(src_size < run_size ||
+		    run_size > max_run_size))
+			return NULL;
+
+		memmove(ret, src, run_size);
+		ret += run_size;
+		CONSUME(run_size);
+
+		implicit_header = run_size < max_run_size;
+		/* The virtual terminating header. */
+		if (implicit_header && src_size == 0)
+			break;
+
+		if (CRDB_UNLIKELY(src_size < CRDB_WORD_STUFF_HEADER_SIZE))
+			return NULL;
+
+		run_size = decode_run_size(src);
+		CONSUME(CRDB_WORD_STUFF_HEADER_SIZE);
+		max_run_size = MAX_REMAINING_RUN;
+
+		if (implicit_header)
+			ret = crdb_word_stuff_header(ret);
+	}
+
 	return ret;
 }
 
+const uint8_t *
+crdb_word_stuff_decode_view(const void *vsrc, size_t src_size, size_t *len)
+{
+	const uint8_t *src = vsrc;
+
+	/*
+	 * A single short run, immediately followed by the virtual
+	 * terminating header, decodes to exactly its literal bytes.
+	 */
+	if (src_size == 0 || src[0] >= MAX_INITIAL_RUN ||
+	    src[0] != src_size - 1)
+		return NULL;
+
+	*len = src[0];
+	return src + 1;
+}
+
+uint8_t *
+crdb_word_stuff_decode_crc32c(uint8_t *dst, const void *src, size_t src_size,
+    size_t crc_skip, uint32_t *crc)
+{
+
+	return decode(dst, src, src_size, crc, crc_skip);
+}
+
 #undef CONSUME
@@ -0,0 +1,183 @@
+/*
+ * Copyright 2021 Backtrace I/O, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Checks the serial and interleaved CRC32C loops, and the dispatched
+ * `crdb_crc32c_update`, against a bitwise CRC32C, for lengths around
+ * INTERLEAVE_MIN and multiples of both block sizes, at random starting
+ * accumulators and alignments.  This covers the shift constants
+ * computed at load time and the carry-less multiplications that merge
+ * the three partial CRCs.
+ *
+ * We include the source file to reach the static loops.
+ */
+
+#include "../src/crdb_crc32c.c"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MAX_ALIGN 16
+#define TRIALS 4
+
+/* Longest checked input: a few long rounds, short rounds and a tail. */
+#define MAX_LEN (4 * 3 * LONG_BLOCK + 3 * 3 * SHORT_BLOCK + 64)
+
+struct crc32c_impl {
+	const char *name;
+	crc32c_fn *fn;
+	bool supported;
+};
+
+static uint32_t rng_state = 2654435761U;
+
+/* xorshift32. */
+static uint32_t
+random_u32(void)
+{
+
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+static uint32_t
+crc32c_bitwise(uint32_t acc, const uint8_t *buf, size_t len)
+{
+
+	for (size_t i = 0; i < len; i++) {
+		acc ^= buf[i];
+		for (size_t bit = 0; bit < 8; bit++)
+			acc = (acc >> 1) ^ (POLY & -(acc & 1));
+	}
+
+	return acc;
+}
+
+static size_t failures;
+
+static void
+check(const struct crc32c_impl *impls, size_t num_impls,
+    const uint8_t *buf, size_t len)
+{
+	uint32_t acc = random_u32();
+	uint32_t expected = crc32c_bitwise(acc, buf, len);
+	size_t split = (len > 0) ? random_u32() % len : 0;
+	uint32_t actual;
+
+	for (size_t i = 0; i < num_impls; i++) {
+		if (impls[i].supported == false)
+			continue;
+
+		actual = impls[i].fn(acc, buf, len);
+		if (actual == expected)
+			continue;
+
+		fprintf(stderr, "crc32c_%s: len %zu align %zu acc %08x: "
+		    "%08x instead of %08x\n", impls[i].name, len,
+		    (size_t)((uintptr_t)buf % MAX_ALIGN), acc, actual,
+		    expected);
+		failures++;
+	}
+
+	/* The dispatched entry point, also piecewise. */
+	actual = crdb_crc32c_update(acc, buf, len);
+	if (actual != expected) {
+		fprintf(stderr, "crdb_crc32c_update: len %zu align %zu "
+		    "acc %08x: %08x instead of %08x\n", len,
+		    (size_t)((uintptr_t)buf % MAX_ALIGN), acc, actual,
+		    expected);
+		failures++;
+	}
+
+	actual = crdb_crc32c_update(crdb_crc32c_update(acc, buf, split),
+	    buf + split, len - split);
+	if (actual != expected) {
+		fprintf(stderr, "crdb_crc32c_update: len %zu split at %zu: "
+		    "%08x instead of %08x\n", len, split, actual, expected);
+		failures++;
+	}
+
+	return;
+}
+
+int
+main(void)
+{
+	static const size_t boundaries[] = {
+		INTERLEAVE_MIN,
+		2 * 3 * SHORT_BLOCK,
+		3 * LONG_BLOCK,
+		3 * LONG_BLOCK + 3 * SHORT_BLOCK,
+		2 * 3 * LONG_BLOCK + 2 * 3 * SHORT_BLOCK,
+		MAX_LEN - 64,
+	};
+	const struct crc32c_impl impls[] = {
+		{ "serial", crc32c_serial_fn, true },
+		{ "pclmul", crc32c_pclmul, __builtin_cpu_supports("pclmul") },
+	};
+	const size_t num_impls = sizeof(impls) / sizeof(impls[0]);
+	uint8_t *buf;
+
+	for (size_t i = 0; i < num_impls; i++) {
+		printf("crc32c_%s: %s\n", impls[i].name,
+		    impls[i].supported ? "checking" : "unsupported");
+	}
+
+	buf = malloc(MAX_LEN + MAX_ALIGN);
+	if (buf == NULL) {
+		perror("malloc");
+		return 1;
+	}
+
+	for (size_t i = 0; i < MAX_LEN + MAX_ALIGN; i++)
+		buf[i] = (uint8_t)random_u32();
+
+	/* Every length up to a few short rounds... */
+	for (size_t len = 0; len <= 3 * 3 * SHORT_BLOCK + 8; len++)
+		check(impls, num_impls, buf + len % MAX_ALIGN, len);
+
+	/* ... and around the long round boundaries. */
+	for (size_t i = 0; i < sizeof(boundaries) / sizeof(boundaries[0]);
+	     i++) {
+		for (size_t len = boundaries[i] - 8; len <= boundaries[i] + 8;
+		     len++) {
+			for (size_t trial = 0; trial < TRIALS; trial++) {
+				size_t align = random_u32() % MAX_ALIGN;
+
+				check(impls, num_impls, buf + align, len);
+			}
+		}
+	}
+
+	free(buf);
+	if (failures != 0) {
+		fprintf(stderr, "%zu mismatches\n", failures);
+		return 1;
+	}
+
+	printf("crc32c matches the bitwise reference\n");
+	return 0;
+}
@@ -0,0 +1,271 @@
+/*
+ * Copyright 2021 Backtrace I/O, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Cuts the first writes of `crdb_record_stream_append_batch` and
+ * `crdb_record_stream_append_large` short, at every byte offset, and
+ * checks that readers then see every record exactly once, in order:
+ * retries must resume at the first record that wasn't written whole.
+ *
+ * We interpose writev(2) to cut writes short.
+ */
+
+#define _GNU_SOURCE /* For syscall */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "record_stream.h"
+#include "word_stuff.h"
+
+#define NUM_RECORDS 6
+#define LARGE_LEN 3000
+
+/* Cut the next writev calls to these many bytes, if non-zero. */
+static size_t cuts[2];
+static size_t num_writes;
+
+ssize_t
+writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	struct iovec copy[IOV_MAX];
+	size_t limit = (num_writes < 2) ? cuts[num_writes] : 0;
+	size_t total = 0;
+	int n = 0;
+
+	num_writes++;
+	if (limit == 0)
+		return syscall(SYS_writev, fd, iov, iovcnt);
+
+	for (; n < iovcnt && total < limit; n++) {
+		copy[n] = iov[n];
+		if (copy[n].iov_len > limit - total)
+			copy[n].iov_len = limit - total;
+		total += copy[n].iov_len;
+	}
+
+	return syscall(SYS_writev, fd, copy, n);
+}
+
+static int
+temp_fd(void)
+{
+	char path[4096];
+	const char *tmpdir;
+	int fd;
+
+	tmpdir = getenv("TMPDIR");
+	snprintf(path, sizeof(path), "%s/record_stream_append_test.XXXXXX",
+	    (tmpdir != NULL) ? tmpdir : "/tmp");
+	fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		exit(1);
+	}
+
+	/* Appends need O_APPEND. */
+	unlink(path);
+	if (fcntl(fd, F_SETFL, O_APPEND) != 0) {
+		perror("fcntl");
+		exit(1);
+	}
+
+	return fd;
+}
+
+/*
+ * Returns whether the stream in `fd` contains exactly the `n` records
+ * in `records`.
+ */
+static bool
+check_stream(int fd, const struct crdb_record_iov *records, size_t n,
+    const struct crdb_record_stream_config *config)
+{
+	struct crdb_record_stream_iterator it;
+	crdb_error_t ce;
+	size_t found = 0;
+	bool ret = true;
+
+	if (crdb_record_stream_iterator_init_fd(&it, fd, &ce) == false ||
+	    crdb_record_stream_iterator_configure(&it, config, &ce) == false) {
+		fprintf(stderr, "iterator failed: %s\n", ce.message);
+		exit(1);
+	}
+
+	for (;;) {
+		const uint8_t *data;
+		uint32_t generation;
+		size_t len;
+
+		if (crdb_record_stream_iterator_next_large(&it, &generation,
+		    &data, &len) == false)
+			break;
+
+		if (found >= n || generation != records[found].generation ||
+		    len != records[found].len ||
+		    memcmp(data, records[found].buf, len) != 0) {
+			ret = false;
+			break;
+		}
+
+		found++;
+	}
+
+	crdb_record_stream_iterator_deinit(&it);
+	return ret && found == n;
+}
+
+static size_t
+check_batch(const struct crdb_record_iov *records, size_t n)
+{
+	const struct crdb_record_stream_config config = { 0 };
+	size_t failures = 0;
+	size_t total;
+	int fd;
+
+	/* Find out how many bytes the batch takes in one write. */
+	fd = temp_fd();
+	cuts[0] = cuts[1] = 0;
+	if (crdb_record_stream_append_batch(fd, records, n, NULL) == false) {
+		fprintf(stderr, "append_batch failed\n");
+		exit(1);
+	}
+
+	total = (size_t)lseek(fd, 0, SEEK_END);
+	close(fd);
+
+	for (size_t first = 1; first < total; first++) {
+		/* The retry starts with a header, so cut at 1 too. */
+		for (size_t second = 0; second <= 1; second++) {
+			fd = temp_fd();
+			cuts[0] = first;
+			cuts[1] = second;
+			num_writes = 0;
+			if (crdb_record_stream_append_batch(fd, records, n,
+			    NULL) == false ||
+			    check_stream(fd, records, n, &config) == false) {
+				fprintf(stderr, "batch: cut at %zu, then %zu\n",
+				    first, second);
+				failures++;
+			}
+
+			close(fd);
+		}
+	}
+
+	return failures;
+}
+
+static size_t
+check_large(const struct crdb_record_iov *record)
+{
+	const struct crdb_record_stream_config config = {
+		.max_record_len = LARGE_LEN,
+	};
+	size_t failures = 0;
+	size_t total;
+	int fd;
+
+	fd = temp_fd();
+	cuts[0] = cuts[1] = 0;
+	if (crdb_record_stream_append_large(fd, &config, record->generation,
+	    record->buf, record->len, NULL) == false) {
+		fprintf(stderr, "append_large failed\n");
+		exit(1);
+	}
+
+	total = (size_t)lseek(fd, 0, SEEK_END);
+	close(fd);
+
+	for (size_t first = 1; first < total; first++) {
+		fd = temp_fd();
+		cuts[0] = first;
+		cuts[1] = 0;
+		num_writes = 0;
+		if (crdb_record_stream_append_large(fd, &config,
+		    record->generation, record->buf, record->len,
+		    NULL) == false ||
+		    check_stream(fd, record, 1, &config) == false) {
+			fprintf(stderr, "large: cut at %zu\n", first);
+			failures++;
+		}
+
+		close(fd);
+	}
+
+	return failures;
+}
+
+int
+main(void)
+{
+	static uint8_t payloads[NUM_RECORDS][CRDB_RECORD_STREAM_MAX_LEN];
+	static uint8_t large[LARGE_LEN];
+	struct crdb_record_iov records[NUM_RECORDS];
+	uint8_t header[CRDB_WORD_STUFF_HEADER_SIZE];
+	uint32_t state = 2654435761U;
+	size_t failures = 0;
+
+	crdb_word_stuff_header(header);
+	for (size_t i = 0; i < NUM_RECORDS; i++) {
+		/* Short and long records, some full of headers. */
+		size_t len = (i % 2 == 0) ? 3 + i : 100 + 50 * i;
+
+		for (size_t j = 0; j < len; j++) {
+			state = state * 1103515245U + 12345U;
+			payloads[i][j] = (i % 3 == 1) ?
+			    header[j % 2] : (uint8_t)(state >> 24);
+		}
+
+		records[i] = (struct crdb_record_iov) {
+			.generation = (uint32_t)(100 + i),
+			.buf = payloads[i],
+			.len = len,
+		};
+	}
+
+	for (size_t j = 0; j < sizeof(large); j++)
+		large[j] = (j % 7 == 0) ? header[0] : (uint8_t)j;
+
+	failures += check_batch(records, NUM_RECORDS);
+	failures += check_batch(records, 1);
+	failures += check_large(&(const struct crdb_record_iov) {
+		.generation = 7,
+		.buf = large,
+		.len = sizeof(large),
+	});
+
+	if (failures != 0) {
+		fprintf(stderr, "%zu failures\n", failures);
+		return 1;
+	}
+
+	printf("short writes never duplicate or lose records\n");
+	return 0;
+}
@@ -0,0 +1,766 @@
+/*
+ * Copyright 2021 Backtrace I/O, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Builds record streams with k-sorted generations, interleaved with
+ * gaps of garbage and zeros, and checks that iterators that move
+ * around the stream agree with a linear `next_large` scan:
+ *
+ * - an iterator that follows the stream as it grows a few bytes at a
+ *   time, including through partially written trailing records, must
+ *   return every record exactly once;
+ * - after `crdb_record_stream_release_before` a record's offset, by
+ *   punching a hole or collapsing the range, iterators must return
+ *   exactly the records from the first one the release left intact;
+ * - `crdb_record_stream_iterator_seek_generation` must move to the
+ *   first record with a generation at least the target in stream
+ *   order, for every target, with the stream's k-slack or more, and
+ *   with or without a stop offset;
+ * - `crdb_record_stream_index_seek` must agree with the same linear
+ *   search, with an index rebuilt in memory or loaded from a file,
+ *   and with a stale index for a stream whose records all moved,
+ *   which it must then report as stale.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "record_stream.h"
+#include "record_stream_index.h"
+#include "word_stuff.h"
+
+#define NUM_RECORDS 3000
+#define MAX_PAYLOAD 300
+
+/* Generations advance by STEP per record, plus up to K_SLACK. */
+#define STEP 3
+#define K_SLACK 40
+
+/* Small enough for a hundred index entries. */
+#define INDEX_INTERVAL 4096
+
+/* One record in the linear scan. */
+struct record {
+	uint32_t generation;
+	size_t offset;
+	size_t len;
+	/* Checksum of the payload. */
+	uint32_t hash;
+};
+
+struct scan {
+	struct record *records;
+	size_t count;
+};
+
+static uint32_t rng_state = 2654435761U;
+static size_t failures;
+
+/* xorshift32. */
+static uint32_t
+random_u32(void)
+{
+
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+static size_t
+random_below(size_t n)
+{
+
+	return (n == 0) ? 0 : random_u32() % n;
+}
+
+static uint32_t
+payload_hash(const uint8_t *data, size_t len)
+{
+	uint32_t ret = 2166136261U;
+
+	/* FNV-1a. */
+	for (size_t i = 0; i < len; i++)
+		ret = (ret ^ data[i]) * 16777619U;
+
+	return ret;
+}
+
+static int
+temp_fd(void)
+{
+	char path[4096];
+	const char *tmpdir;
+	int fd;
+
+	tmpdir = getenv("TMPDIR");
+	snprintf(path, sizeof(path), "%s/record_stream_iterator_test.XXXXXX",
+	    (tmpdir != NULL) ? tmpdir : "/tmp");
+	fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		exit(1);
+	}
+
+	unlink(path);
+	return fd;
+}
+
+static void
+write_all(int fd, const void *buf, size_t len)
+{
+
+	if (write(fd, buf, len) != (ssize_t)len) {
+		perror("write");
+		exit(1);
+	}
+
+	return;
+}
+
+/*
+ * Writes a gap between records: header-dense junk or zeros, and a
+ * header to make sure the next record is framed.
+ */
+static void
+write_gap(int fd)
+{
+	static uint8_t junk[8192];
+	uint8_t header[CRDB_WORD_STUFF_HEADER_SIZE];
+	size_t len;
+
+	crdb_word_stuff_header(header);
+	if (random_below(2) == 0) {
+		len = 1 + random_below(600);
+		for (size_t i = 0; i < len; i++) {
+			uint32_t r = random_u32();
+
+			junk[i] = ((r & 3) == 0) ?
+			    header[(r >> 2) & 1] : (uint8_t)(r >> 8);
+		}
+	} else {
+		len = 1 + random_below(sizeof(junk));
+		memset(junk, 0, len);
+	}
+
+	write_all(fd, junk, len);
+	write_all(fd, header, sizeof(header));
+	return;
+}
+
+/*
+ * Appends NUM_RECORDS records with generations k-sorted within
+ * K_SLACK, and random gaps, to `fd`, and returns their generations
+ * and payload hashes, without offsets.
+ */
+static struct record *
+build_stream(int fd)
+{
+	struct record *ret;
+	uint8_t payload[MAX_PAYLOAD];
+	crdb_error_t ce;
+
+	ret = calloc(NUM_RECORDS, sizeof(*ret));
+	if (ret == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+
+	for (size_t i = 0; i < NUM_RECORDS; i++) {
+		uint32_t generation = (uint32_t)(i * STEP +
+		    random_below(K_SLACK + 1));
+		size_t len = random_below(sizeof(payload) + 1);
+
+		for (size_t j = 0; j < len; j++)
+			payload[j] = (random_below(4) == 0) ?
+			    0xFE : (uint8_t)random_u32();
+
+		if (random_below(64) == 0)
+			write_gap(fd);
+
+		if (crdb_record_stream_append_buf(fd, generation, payload, len,
+		    &ce) == false) {
+			fprintf(stderr, "append failed: %s\n", ce.message);
+			exit(1);
+		}
+
+		ret[i] = (struct record) {
+			.generation = generation,
+			.len = len,
+			.hash = payload_hash(payload, len),
+		};
+	}
+
+	return ret;
+}
+
+static void
+iterator_init(struct crdb_record_stream_iterator *it, int fd)
+{
+	crdb_error_t ce;
+
+	if (crdb_record_stream_iterator_init_fd(it, fd, &ce) == false ||
+	    crdb_record_stream_iterator_configure(it, NULL, &ce) == false) {
+		fprintf(stderr, "iterator failed: %s\n", ce.message);
+		exit(1);
+	}
+
+	return;
+}
+
+/*
+ * Appends every record left in `it` to `scan`, which must have room
+ * for NUM_RECORDS.
+ */
+static void
+scan_rest(struct crdb_record_stream_iterator *it, struct scan *scan)
+{
+	const uint8_t *data;
+	uint32_t generation;
+	size_t len;
+
+	while (crdb_record_stream_iterator_next_large(it, &generation, &data,
+	    &len)) {
+		if (scan->count >= NUM_RECORDS) {
+			fprintf(stderr, "too many records\n");
+			failures++;
+			return;
+		}
+
+		scan->records[scan->count++] = (struct record) {
+			.generation = generation,
+			.offset = crdb_record_stream_iterator_record_offset(it),
+			.len = len,
+			.hash = payload_hash(data, len),
+		};
+	}
+
+	return;
+}
+
+static struct scan
+scan_fd(int fd)
+{
+	struct crdb_record_stream_iterator it;
+	struct scan ret = {
+		.records = calloc(NUM_RECORDS, sizeof(struct record)),
+	};
+
+	if (ret.records == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+
+	iterator_init(&it, fd);
+	scan_rest(&it, &ret);
+	crdb_record_stream_iterator_deinit(&it);
+	return ret;
+}
+
+static bool
+same_record(const struct record *x, const struct record *y, size_t shift)
+{
+
+	return x->generation == y->generation && x->len == y->len &&
+	    x->hash == y->hash && x->offset + shift == y->offset;
+}
+
+/*
+ * Returns whether `actual` is exactly `expected[first ... count - 1]`,
+ * with offsets `shift` bytes lower.
+ */
+static bool
+same_suffix(const struct scan *expected, size_t first,
+    const struct scan *actual, size_t shift)
+{
+
+	if (actual->count != expected->count - first)
+		return false;
+
+	for (size_t i = 0; i < actual->count; i++) {
+		if (!same_record(&actual->records[i],
+		    &expected->records[first + i], shift))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Copies the stream in `src_fd` to an empty file a few bytes at a
+ * time, and follows it with a single iterator.
+ */
+static void
+check_follow(int src_fd, const struct scan *expected)
+{
+	struct crdb_record_stream_iterator it;
+	struct scan actual = {
+		.records = calloc(NUM_RECORDS, sizeof(struct record)),
+	};
+	off_t size = lseek(src_fd, 0, SEEK_END);
+	uint8_t chunk[512];
+	size_t num_follows = 0;
+	int fd;
+
+	if (actual.records == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+
+	fd = temp_fd();
+	iterator_init(&it, fd);
+	for (off_t copied = 0; copied < size; ) {
+		size_t len;
+		crdb_error_t ce;
+
+		/* Mostly single bytes and short chunks. */
+		switch (random_below(3)) {
+		case 0:
+			len = 1;
+			break;
+		case 1:
+			len = 1 + random_below(16);
+			break;
+		default:
+			len = 1 + random_below(sizeof(chunk));
+			break;
+		}
+
+		if (len > (size_t)(size - copied))
+			len = (size_t)(size - copied);
+
+		if (pread(src_fd, chunk, len, copied) != (ssize_t)len) {
+			perror("pread");
+			exit(1);
+		}
+
+		write_all(fd, chunk, len);
+		copied += len;
+		if (crdb_record_stream_iterator_follow(&it, fd, &ce) == false) {
+			fprintf(stderr, "follow failed: %s\n", ce.message);
+			exit(1);
+		}
+
+		num_follows++;
+		scan_rest(&it, &actual);
+	}
+
+	if (same_suffix(expected, 0, &actual, 0) == false) {
+		fprintf(stderr, "follow: %zu records instead of %zu\n",
+		    actual.count, expected->count);
+		failures++;
+	}
+
+	printf("followed %zu records over %zu extensions\n", actual.count,
+	    num_follows);
+	crdb_record_stream_iterator_deinit(&it);
+	close(fd);
+	free(actual.records);
+	return;
+}
+
+/* Appends the contents of `src_fd` to `fd`. */
+static void
+append_fd(int fd, int src_fd)
+{
+	off_t size = lseek(src_fd, 0, SEEK_END);
+	uint8_t buf[65536];
+
+	for (off_t copied = 0; copied < size; ) {
+		ssize_t r;
+
+		r = pread(src_fd, buf, sizeof(buf), copied);
+		if (r <= 0) {
+			perror("pread");
+			exit(1);
+		}
+
+		write_all(fd, buf, (size_t)r);
+		copied += r;
+	}
+
+	return;
+}
+
+static int
+copy_fd(int src_fd)
+{
+	int fd;
+
+	fd = temp_fd();
+	append_fd(fd, src_fd);
+	return fd;
+}
+
+/*
+ * Releases the stream in a copy of `src_fd` before `offset`, and
+ * returns false if the file system doesn't support `flags`.
+ */
+static bool
+check_release_at(int src_fd, const struct scan *expected, size_t offset,
+    unsigned int flags)
+{
+	const bool collapse =
+	    (flags & CRDB_RECORD_STREAM_RELEASE_COLLAPSE) != 0;
+	struct scan actual;
+	struct stat before, after;
+	size_t released;
+	size_t first;
+	crdb_error_t ce;
+	int fd;
+
+	fd = copy_fd(src_fd);
+	if (fstat(fd, &before) != 0) {
+		perror("fstat");
+		exit(1);
+	}
+
+	if (crdb_record_stream_release_before(fd, offset, flags, &released,
+	    &ce) == false) {
+		close(fd);
+		if (ce.error == EOPNOTSUPP)
+			return false;
+
+		fprintf(stderr, "release_before %zu: %s\n", offset,
+		    ce.message);
+		failures++;
+		return true;
+	}
+
+	if (fstat(fd, &after) != 0) {
+		perror("fstat");
+		exit(1);
+	}
+
+	if (released != offset - offset % (size_t)before.st_blksize ||
+	    after.st_size != before.st_size -
+	    (collapse ? (off_t)released : 0)) {
+		fprintf(stderr, "release_before %zu: released %zu, "
+		    "size %lld\n", offset, released,
+		    (long long)after.st_size);
+		failures++;
+	}
+
+	/* Records that start after the released prefix are intact. */
+	for (first = 0; first < expected->count; first++) {
+		if (expected->records[first].offset >= released)
+			break;
+	}
+
+	actual = scan_fd(fd);
+	if (same_suffix(expected, first, &actual,
+	    collapse ? released : 0) == false) {
+		fprintf(stderr, "release_before %zu%s: %zu records instead "
+		    "of %zu\n", offset, collapse ? " (collapse)" : "",
+		    actual.count, expected->count - first);
+		failures++;
+	}
+
+	free(actual.records);
+	close(fd);
+	return true;
+}
+
+static void
+check_release(int src_fd, const struct scan *expected)
+{
+	static const unsigned int flags[] = {
+		0, CRDB_RECORD_STREAM_RELEASE_COLLAPSE,
+	};
+	size_t size = (size_t)lseek(src_fd, 0, SEEK_END);
+
+	for (size_t i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+		bool supported = true;
+
+		/* The first records, random ones, the last, and EOF. */
+		for (size_t trial = 0; trial < 12 && supported; trial++) {
+			size_t index;
+
+			if (trial < 2)
+				index = trial;
+			else if (trial < 10)
+				index = random_below(expected->count);
+			else
+				index = expected->count - 1;
+
+			supported = check_release_at(src_fd, expected,
+			    (trial < 11) ? expected->records[index].offset :
+			    size, flags[i]);
+		}
+
+		if (supported == false)
+			printf("release_before: flags %u unsupported\n",
+			    flags[i]);
+	}
+
+	return;
+}
+
+static uint32_t
+max_generation(const struct scan *expected)
+{
+	uint32_t ret = 0;
+
+	for (size_t i = 0; i < expected->count; i++) {
+		if (expected->records[i].generation > ret)
+			ret = expected->records[i].generation;
+	}
+
+	return ret;
+}
+
+/*
+ * Returns the index of the first record in `expected[0 ... stop - 1]`
+ * with a generation at least `generation`, or `stop` if none.
+ */
+static size_t
+expected_seek(const struct scan *expected, size_t stop, uint32_t generation)
+{
+
+	for (size_t i = 0; i < stop; i++) {
+		if (expected->records[i].generation >= generation)
+			return i;
+	}
+
+	return stop;
+}
+
+/*
+ * Checks that `found`, the return value of a seek for `generation`
+ * on `it` (stopped before `expected->records[stop]`), matches the
+ * linear scan.
+ */
+static void
+check_seek_result(struct crdb_record_stream_iterator *it,
+    const struct scan *expected, size_t stop, uint32_t generation,
+    bool found, const char *what)
+{
+	size_t want = expected_seek(expected, stop, generation);
+	struct record actual;
+	const uint8_t *data;
+	size_t len;
+
+	if (found != (want < stop)) {
+		fprintf(stderr, "%s %u: returned %d\n", what, generation,
+		    (int)found);
+		failures++;
+		return;
+	}
+
+	if (found == false)
+		return;
+
+	if (crdb_record_stream_iterator_next_large(it, &actual.generation,
+	    &data, &len) == false) {
+		fprintf(stderr, "%s %u: no record\n", what, generation);
+		failures++;
+		return;
+	}
+
+	actual.offset = crdb_record_stream_iterator_record_offset(it);
+	actual.len = len;
+	actual.hash = payload_hash(data, len);
+	if (!same_record(&actual, &expected->records[want], 0)) {
+		fprintf(stderr, "%s %u: generation %u at %zu instead of %u "
+		    "at %zu\n", what, generation, actual.generation,
+		    actual.offset, expected->records[want].generation,
+		    expected->records[want].offset);
+		failures++;
+	}
+
+	return;
+}
+
+static void
+check_seek(int fd, const struct scan *expected)
+{
+	struct crdb_record_stream_iterator it;
+	size_t size = (size_t)lseek(fd, 0, SEEK_END);
+	const uint32_t last = max_generation(expected) + 2;
+
+	iterator_init(&it, fd);
+	for (uint32_t generation = 0; generation <= last; generation++) {
+		uint32_t k_slack = (generation % 2 == 0) ?
+		    K_SLACK : 2 * K_SLACK;
+		size_t stop = expected->count;
+		bool found;
+
+		/* Every third seek stops before a random record. */
+		if (generation % 3 == 0) {
+			stop = random_below(expected->count);
+			crdb_record_stream_iterator_stop_at(&it,
+			    expected->records[stop].offset);
+		} else {
+			crdb_record_stream_iterator_stop_at(&it, size);
+		}
+
+		found = crdb_record_stream_iterator_seek_generation(&it,
+		    generation, k_slack);
+		check_seek_result(&it, expected, stop, generation, found,
+		    "seek_generation");
+	}
+
+	crdb_record_stream_iterator_deinit(&it);
+	return;
+}
+
+/*
+ * Seeks every generation in the stream under `it` with `index`, and
+ * returns whether the index is stale afterwards.
+ */
+static bool
+check_index_seeks(struct crdb_record_stream_index *index,
+    struct crdb_record_stream_iterator *it, const struct scan *expected,
+    const char *what)
+{
+	const uint32_t last = max_generation(expected) + 2;
+
+	for (uint32_t generation = 0; generation <= last; generation++) {
+		uint32_t k_slack = (generation % 2 == 0) ?
+		    K_SLACK : 2 * K_SLACK;
+		bool found;
+
+		found = crdb_record_stream_index_seek(index, it, generation,
+		    k_slack);
+		check_seek_result(it, expected, expected->count, generation,
+		    found, what);
+	}
+
+	return crdb_record_stream_index_stale(index);
+}
+
+static void
+check_index(int fd, const struct scan *expected)
+{
+	struct crdb_record_stream_iterator it;
+	struct crdb_record_stream_index *index, *loaded;
+	struct scan shifted_scan;
+	crdb_error_t ce;
+	int index_fd, shifted_fd;
+	size_t num_entries;
+
+	index_fd = temp_fd();
+	if (fcntl(index_fd, F_SETFL, O_APPEND) != 0) {
+		perror("fcntl");
+		exit(1);
+	}
+
+	iterator_init(&it, fd);
+	index = crdb_record_stream_index_load(-1, &ce);
+	if (index == NULL || crdb_record_stream_index_rebuild(index, &it,
+	    index_fd, INDEX_INTERVAL, &ce) == false) {
+		fprintf(stderr, "index failed: %s\n", ce.message);
+		exit(1);
+	}
+
+	num_entries = crdb_record_stream_index_size(index);
+	if (num_entries < expected->records[expected->count - 1].offset /
+	    (2 * INDEX_INTERVAL)) {
+		fprintf(stderr, "index: only %zu entries\n", num_entries);
+		failures++;
+	}
+
+	if (check_index_seeks(index, &it, expected, "index_seek")) {
+		fprintf(stderr, "index_seek: fresh index is stale\n");
+		failures++;
+	}
+
+	loaded = crdb_record_stream_index_load(index_fd, &ce);
+	if (loaded == NULL) {
+		fprintf(stderr, "index_load failed: %s\n", ce.message);
+		exit(1);
+	}
+
+	if (crdb_record_stream_index_size(loaded) != num_entries ||
+	    check_index_seeks(loaded, &it, expected, "loaded index_seek")) {
+		fprintf(stderr, "index_seek: loaded index differs\n");
+		failures++;
+	}
+
+	crdb_record_stream_index_destroy(loaded);
+	crdb_record_stream_iterator_deinit(&it);
+
+	/* Move every record by a gap: each index entry is now wrong. */
+	shifted_fd = temp_fd();
+	write_gap(shifted_fd);
+	append_fd(shifted_fd, fd);
+	shifted_scan = scan_fd(shifted_fd);
+	iterator_init(&it, shifted_fd);
+	if (check_index_seeks(index, &it, &shifted_scan,
+	    "stale index_seek") == false) {
+		fprintf(stderr, "index_seek: stale index not detected\n");
+		failures++;
+	}
+
+	printf("seeked with %zu index entries\n", num_entries);
+	crdb_record_stream_iterator_deinit(&it);
+	crdb_record_stream_index_destroy(index);
+	free(shifted_scan.records);
+	close(shifted_fd);
+	close(index_fd);
+	return;
+}
+
+int
+main(void)
+{
+	struct record *appended;
+	struct scan expected;
+	int fd;
+
+	fd = temp_fd();
+	appended = build_stream(fd);
+	expected = scan_fd(fd);
+
+	/* The linear scan itself must find every record. */
+	for (size_t i = 0; i < NUM_RECORDS; i++) {
+		if (i < expected.count &&
+		    same_record(&appended[i], &expected.records[i],
+		    expected.records[i].offset))
+			continue;
+
+		fprintf(stderr, "linear scan: missing record %zu\n", i);
+		return 1;
+	}
+
+	check_follow(fd, &expected);
+	check_release(fd, &expected);
+	check_seek(fd, &expected);
+	check_index(fd, &expected);
+
+	close(fd);
+	free(expected.records);
+	free(appended);
+	if (failures != 0) {
+		fprintf(stderr, "%zu failures\n", failures);
+		return 1;
+	}
+
+	printf("record stream iterators agree with a linear scan\n");
+	return 0;
+}
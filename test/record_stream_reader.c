@@ -0,0 +1,202 @@
+/*
+ * Copyright 2021 Backtrace I/O, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Feeds a streaming reader, over a non-blocking pipe, one valid
+ * record, its trailing header, and then header-free junk around the
+ * longest run of bytes the reader holds on to while waiting for the
+ * rest of a record: `max_encoded_len + 1` bytes after a header.  The
+ * reader must return the record, fail with EAGAIN, and skip the junk
+ * once the pipe is closed.
+ */
+
+#define _GNU_SOURCE /* For pipe2 */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "record_stream.h"
+#include "record_stream_reader.h"
+#include "../src/record_stream_internal.h"
+
+#define GENERATION 42
+
+static const uint8_t payload[] = "record stream reader boundary";
+
+/*
+ * Returns a malloc-ed copy of a stream with a single record, as
+ * written by `crdb_record_stream_append_buf`, in `*size`.
+ */
+static uint8_t *
+valid_stream(size_t *size)
+{
+	char path[4096];
+	const char *tmpdir;
+	uint8_t *ret;
+	crdb_error_t ce;
+	off_t end;
+	int fd;
+
+	tmpdir = getenv("TMPDIR");
+	snprintf(path, sizeof(path), "%s/record_stream_reader_test.XXXXXX",
+	    (tmpdir != NULL) ? tmpdir : "/tmp");
+	fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		exit(1);
+	}
+
+	/* Appends need O_APPEND. */
+	unlink(path);
+	if (fcntl(fd, F_SETFL, O_APPEND) != 0) {
+		perror("fcntl");
+		exit(1);
+	}
+
+	if (crdb_record_stream_append_buf(fd, GENERATION, payload,
+	    sizeof(payload), &ce) == false) {
+		fprintf(stderr, "append failed: %s\n", ce.message);
+		exit(1);
+	}
+
+	end = lseek(fd, 0, SEEK_END);
+	ret = malloc(end);
+	if (end <= 0 || ret == NULL ||
+	    pread(fd, ret, end, 0) != end) {
+		perror("pread");
+		exit(1);
+	}
+
+	close(fd);
+	*size = (size_t)end;
+	return ret;
+}
+
+static bool
+check_one(const struct crdb_record_stream_config *config,
+    const uint8_t *stream, size_t stream_size, size_t junk_size)
+{
+	struct crdb_record_stream_reader *reader;
+	crdb_error_t ce = CRDB_ERROR_INITIALIZER;
+	const uint8_t *data;
+	uint32_t generation;
+	size_t len;
+	uint8_t *junk;
+	int fds[2];
+	bool ret = false;
+
+	/* Anything without a 0xFE byte is free of headers. */
+	junk = malloc(junk_size);
+	if (junk == NULL)
+		return false;
+	memset(junk, 'x', junk_size);
+
+	if (pipe2(fds, O_NONBLOCK) != 0) {
+		perror("pipe2");
+		exit(1);
+	}
+
+	if (write(fds[1], stream, stream_size) != (ssize_t)stream_size ||
+	    write(fds[1], junk, junk_size) != (ssize_t)junk_size) {
+		perror("write");
+		exit(1);
+	}
+
+	reader = crdb_record_stream_reader_create(fds[0], config, &ce);
+	if (reader == NULL) {
+		fprintf(stderr, "reader_create failed: %s\n", ce.message);
+		exit(1);
+	}
+
+	if (crdb_record_stream_reader_next(reader, &generation, &data, &len,
+	    &ce) == false || generation != GENERATION ||
+	    len != sizeof(payload) || memcmp(data, payload, len) != 0) {
+		fprintf(stderr, "junk %zu: missing valid record\n", junk_size);
+		goto out;
+	}
+
+	/* The junk may be the beginning of a record: wait for more. */
+	if (crdb_record_stream_reader_next(reader, &generation, &data, &len,
+	    &ce) == true || crdb_record_stream_reader_eof(reader) ||
+	    ce.error != EAGAIN) {
+		fprintf(stderr, "junk %zu: expected EAGAIN\n", junk_size);
+		goto out;
+	}
+
+	close(fds[1]);
+	fds[1] = -1;
+	ce = CRDB_ERROR_INITIALIZER;
+	if (crdb_record_stream_reader_next(reader, &generation, &data, &len,
+	    &ce) == true || crdb_record_stream_reader_eof(reader) == false) {
+		fprintf(stderr, "junk %zu: expected EOF\n", junk_size);
+		goto out;
+	}
+
+	ret = true;
+
+out:
+	crdb_record_stream_reader_destroy(reader);
+	if (fds[1] >= 0)
+		close(fds[1]);
+	close(fds[0]);
+	free(junk);
+	return ret;
+}
+
+int
+main(void)
+{
+	static const size_t max_lens[] = {
+		CRDB_RECORD_STREAM_MAX_LEN, 4096, 16384,
+	};
+	size_t stream_size;
+	uint8_t *stream;
+	size_t failures = 0;
+
+	stream = valid_stream(&stream_size);
+	for (size_t i = 0; i < sizeof(max_lens) / sizeof(max_lens[0]); i++) {
+		struct crdb_record_stream_config config = {
+			.max_record_len = max_lens[i],
+		};
+		size_t boundary;
+
+		/* The most bytes the reader keeps after a header. */
+		boundary = crdb_record_stream_max_encoded_len(max_lens[i]) + 1;
+		for (size_t junk = boundary - 2; junk <= boundary + 2; junk++)
+			failures += !check_one(&config, stream, stream_size,
+			    junk);
+	}
+
+	free(stream);
+	if (failures != 0) {
+		fprintf(stderr, "%zu failures\n", failures);
+		return 1;
+	}
+
+	printf("record stream reader handles the refill boundary\n");
+	return 0;
+}
@@ -0,0 +1,694 @@
+/*
+ * Copyright 2021 Backtrace I/O, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Checks every word stuffing encoder and decoder against a plain
+ * transcription of the original, one-shot `crdb_word_stuff_encode`
+ * and `crdb_word_stuff_decode`.
+ *
+ * Encoders (one-shot and mask-driven, incremental with random
+ * pieces, iovec) must produce exactly the reference bytes, for
+ * payloads with headers around the 252 and 64008-byte run size
+ * limits.  Decoders (one-shot, checksummed, resumable with random
+ * fragments, in-place, view) must produce exactly the reference
+ * bytes and fail on exactly the same inputs, for valid, truncated,
+ * corrupted and random encodings, without ever writing more than
+ * `src_size - 1` bytes.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "crdb_crc32c.h"
+#include "word_stuff.h"
+
+#define MAX_INITIAL_RUN 252
+#define MAX_REMAINING_RUN (253 * 253 - 1)
+
+/* Room for a payload with two full remaining runs, and then some. */
+#define MAX_PAYLOAD (3 * MAX_REMAINING_RUN)
+
+/* Decoders must not touch these bytes after `src_size - 1`. */
+#define GUARD_SIZE 64
+#define GUARD_BYTE 0xA5
+
+#define MAX_PIECES 8
+
+/* Inputs up to that size are also fed one byte at a time. */
+#define BYTEWISE_MAX 600
+
+static const uint8_t header[] = { 0xFE, 0xFD };
+
+static uint32_t rng_state = 2654435761U;
+static size_t failures;
+static size_t num_encoded;
+static size_t num_decoded;
+
+/* xorshift32. */
+static uint32_t
+random_u32(void)
+{
+
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+static size_t
+random_below(size_t n)
+{
+
+	return (n == 0) ? 0 : random_u32() % n;
+}
+
+static void *
+xmalloc(size_t size)
+{
+	void *ret;
+
+	ret = malloc((size == 0) ? 1 : size);
+	if (ret == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	return ret;
+}
+
+/*
+ * Transcription of the original `crdb_word_stuff_encode`.  Returns
+ * the number of bytes written to `dst`.
+ */
+static size_t
+reference_encode(uint8_t *dst, const uint8_t *src, size_t src_size)
+{
+	uint8_t *out = dst;
+	bool first = true;
+
+	for (;;) {
+		size_t max_run_size =
+		    first ? MAX_INITIAL_RUN : MAX_REMAINING_RUN;
+		size_t limit =
+		    (src_size < max_run_size) ? src_size : max_run_size;
+		size_t run_size = 0;
+
+		/* The first header that fits entirely in `limit` bytes. */
+		while (run_size < limit &&
+		    !(run_size + 1 < limit && src[run_size] == header[0] &&
+		    src[run_size + 1] == header[1]))
+			run_size++;
+
+		if (first) {
+			*out++ = (uint8_t)run_size;
+		} else {
+			*out++ = (uint8_t)(run_size % 253);
+			*out++ = (uint8_t)(run_size / 253);
+		}
+
+		first = false;
+		memcpy(out, src, run_size);
+		out += run_size;
+		src += run_size;
+		src_size -= run_size;
+		if (run_size < max_run_size) {
+			if (src_size == 0)
+				break;
+
+			src += sizeof(header);
+			src_size -= sizeof(header);
+		}
+	}
+
+	return out - dst;
+}
+
+/*
+ * Transcription of the original `crdb_word_stuff_decode`.  Returns
+ * false on invalid input, and the decoded size in `*len` otherwise.
+ */
+static bool
+reference_decode(uint8_t *dst, const uint8_t *src, size_t src_size,
+    size_t *len)
+{
+	uint8_t *out = dst;
+	bool first = true;
+
+	for (;;) {
+		size_t max_run_size;
+		size_t run_size;
+
+		if (first) {
+			if (src_size < 1)
+				return false;
+
+			max_run_size = MAX_INITIAL_RUN;
+			run_size = src[0];
+			src += 1;
+			src_size -= 1;
+		} else {
+			if (src_size < 2)
+				return false;
+
+			max_run_size = MAX_REMAINING_RUN;
+			run_size = src[0] + 253 * (size_t)src[1];
+			src += 2;
+			src_size -= 2;
+		}
+
+		first = false;
+		if (src_size < run_size || run_size > max_run_size)
+			return false;
+
+		memcpy(out, src, run_size);
+		out += run_size;
+		src += run_size;
+		src_size -= run_size;
+		if (run_size < max_run_size) {
+			if (src_size == 0)
+				break;
+
+			if (src_size < sizeof(header))
+				return false;
+
+			memcpy(out, header, sizeof(header));
+			out += sizeof(header);
+		}
+	}
+
+	*len = out - dst;
+	return true;
+}
+
+/*
+ * Populates `cuts[0 ... ret - 1]` with increasing split points in
+ * `(0, size)`, for at most MAX_PIECES pieces.
+ */
+static size_t
+random_cuts(size_t *cuts, size_t size)
+{
+	size_t n = random_below(MAX_PIECES);
+	size_t ret = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		size_t cut = 1 + random_below(size);
+		size_t j;
+
+		if (cut >= size)
+			continue;
+
+		/* Insertion sort, without duplicates. */
+		for (j = ret; j > 0 && cuts[j - 1] > cut; j--)
+			cuts[j] = cuts[j - 1];
+
+		if (j > 0 && cuts[j - 1] == cut) {
+			memmove(&cuts[j], &cuts[j + 1],
+			    (ret - j) * sizeof(cuts[0]));
+			continue;
+		}
+
+		cuts[j] = cut;
+		ret++;
+	}
+
+	return ret;
+}
+
+static void
+report(const char *what, const char *name, size_t size)
+{
+
+	fprintf(stderr, "%s (%s): size %zu\n", what, name, size);
+	failures++;
+	return;
+}
+
+static bool
+guard_intact(const uint8_t *guard)
+{
+
+	for (size_t i = 0; i < GUARD_SIZE; i++) {
+		if (guard[i] != GUARD_BYTE)
+			return false;
+	}
+
+	return true;
+}
+
+static void
+check_encoder(const uint8_t *src, size_t src_size, const uint8_t *expected,
+    size_t expected_size, uint8_t *dst, const char *name, bool bytewise)
+{
+	struct crdb_word_stuff_encoder encoder;
+	size_t cuts[MAX_PIECES];
+	size_t num_cuts;
+	size_t begin = 0;
+	uint32_t crc = random_u32();
+	uint32_t expected_crc = crdb_crc32c_update(crc, src, src_size);
+	uint8_t *end;
+
+	if (bytewise) {
+		crdb_word_stuff_encoder_init(&encoder, dst);
+		for (size_t i = 0; i < src_size; i++)
+			crdb_word_stuff_encoder_feed(&encoder, src + i, 1);
+
+		end = crdb_word_stuff_encoder_finish(&encoder, NULL);
+		if ((size_t)(end - dst) != expected_size ||
+		    memcmp(dst, expected, expected_size) != 0)
+			report("encoder bytewise", name, src_size);
+	}
+
+	num_cuts = random_cuts(cuts, src_size);
+	crdb_word_stuff_encoder_init_crc32c(&encoder, dst, crc);
+	for (size_t i = 0; i <= num_cuts; i++) {
+		size_t cut = (i < num_cuts) ? cuts[i] : src_size;
+
+		crdb_word_stuff_encoder_feed(&encoder, src + begin,
+		    cut - begin);
+		begin = cut;
+	}
+
+	end = crdb_word_stuff_encoder_finish(&encoder, &crc);
+	if ((size_t)(end - dst) != expected_size ||
+	    memcmp(dst, expected, expected_size) != 0)
+		report("encoder", name, src_size);
+
+	if (crc != expected_crc)
+		report("encoder crc32c", name, src_size);
+
+	return;
+}
+
+static void
+check_encode_iov(const uint8_t *src, size_t src_size, const uint8_t *expected,
+    size_t expected_size, uint8_t *dst, const char *name)
+{
+	struct iovec in[MAX_PIECES + 1];
+	struct iovec *out;
+	size_t cuts[MAX_PIECES];
+	size_t num_cuts;
+	size_t out_capacity = src_size + 16;
+	size_t out_count;
+	size_t begin = 0;
+	size_t total = 0;
+	uint8_t *meta;
+
+	num_cuts = random_cuts(cuts, src_size);
+	for (size_t i = 0; i <= num_cuts; i++) {
+		size_t cut = (i < num_cuts) ? cuts[i] : src_size;
+
+		in[i] = (struct iovec) {
+			.iov_base = (void *)(src + begin),
+			.iov_len = cut - begin,
+		};
+		begin = cut;
+	}
+
+	out = xmalloc(out_capacity * sizeof(*out));
+	meta = xmalloc(out_capacity);
+	if (crdb_word_stuff_encode_iov(out, out_capacity, &out_count, meta,
+	    out_capacity, in, num_cuts + 1) == false) {
+		report("encode_iov failed", name, src_size);
+		goto out;
+	}
+
+	for (size_t i = 0; i < out_count; i++) {
+		if (total + out[i].iov_len > expected_size)
+			break;
+
+		memcpy(dst + total, out[i].iov_base, out[i].iov_len);
+		total += out[i].iov_len;
+	}
+
+	if (total != expected_size || memcmp(dst, expected, total) != 0)
+		report("encode_iov", name, src_size);
+
+out:
+	free(meta);
+	free(out);
+	return;
+}
+
+/*
+ * Checks every decoder on `src[0 ... src_size - 1]` against the
+ * reference decoding.
+ */
+static void
+check_decode(const uint8_t *src, size_t src_size, const char *name)
+{
+	struct crdb_word_stuff_decoder decoder;
+	size_t room = (src_size > 0) ? src_size - 1 : 0;
+	size_t cuts[MAX_PIECES];
+	size_t num_cuts;
+	size_t begin = 0;
+	size_t crc_skip;
+	size_t expected_size = 0;
+	uint8_t *expected, *dst, *inplace;
+	const uint8_t *view;
+	uint32_t crc, expected_crc = 0, initial_crc;
+	uint8_t *end;
+	size_t view_len;
+	bool valid;
+
+	num_decoded++;
+	expected = xmalloc(room + GUARD_SIZE);
+	dst = xmalloc(room + GUARD_SIZE);
+	inplace = xmalloc(src_size);
+
+	valid = reference_decode(expected, src, src_size, &expected_size);
+	if (valid && expected_size > room) {
+		report("reference overflow", name, src_size);
+		goto out;
+	}
+
+#define CHECK_RESULT(WHAT) do {						\
+		if (guard_intact(dst + room) == false)			\
+			report(WHAT " overflow", name, src_size);	\
+		if ((end != NULL) != valid)				\
+			report(WHAT " validity", name, src_size);	\
+		else if (valid && ((size_t)(end - dst) != expected_size || \
+		    memcmp(dst, expected, expected_size) != 0))		\
+			report(WHAT, name, src_size);			\
+	} while (0)
+
+	memset(dst + room, GUARD_BYTE, GUARD_SIZE);
+	end = crdb_word_stuff_decode(dst, src, src_size);
+	CHECK_RESULT("decode");
+
+	crc_skip = random_below(8);
+	initial_crc = random_u32();
+	crc = initial_crc;
+	memset(dst + room, GUARD_BYTE, GUARD_SIZE);
+	end = crdb_word_stuff_decode_crc32c(dst, src, src_size, crc_skip,
+	    &crc);
+	CHECK_RESULT("decode_crc32c");
+	if (valid) {
+		size_t skip = (crc_skip < expected_size) ?
+		    crc_skip : expected_size;
+
+		expected_crc = crdb_crc32c_update(initial_crc,
+		    expected + skip, expected_size - skip);
+		if (crc != expected_crc)
+			report("decode_crc32c checksum", name, src_size);
+	}
+
+	/* Fragments split anywhere, including inside run sizes. */
+	num_cuts = random_cuts(cuts, src_size);
+	crc = initial_crc;
+	memset(dst + room, GUARD_BYTE, GUARD_SIZE);
+	crdb_word_stuff_decoder_init_crc32c(&decoder, dst, crc_skip, crc);
+	for (size_t i = 0; i <= num_cuts; i++) {
+		size_t cut = (i < num_cuts) ? cuts[i] : src_size;
+		bool fed;
+
+		fed = crdb_word_stuff_decoder_feed(&decoder, src + begin,
+		    cut - begin);
+		begin = cut;
+		if (fed == false && valid)
+			report("decoder feed", name, src_size);
+	}
+
+	end = crdb_word_stuff_decoder_finish(&decoder, &crc);
+	CHECK_RESULT("decoder");
+	if (valid && end != NULL && crc != expected_crc)
+		report("decoder checksum", name, src_size);
+
+	if (src_size <= BYTEWISE_MAX) {
+		memset(dst + room, GUARD_BYTE, GUARD_SIZE);
+		crdb_word_stuff_decoder_init(&decoder, dst);
+		for (size_t i = 0; i < src_size; i++)
+			(void)crdb_word_stuff_decoder_feed(&decoder, src + i,
+			    1);
+
+		end = crdb_word_stuff_decoder_finish(&decoder, NULL);
+		CHECK_RESULT("decoder bytewise");
+	}
+
+#undef CHECK_RESULT
+
+	memcpy(inplace, src, src_size);
+	end = crdb_word_stuff_decode_inplace(inplace, src_size);
+	if ((end != NULL) != valid)
+		report("decode_inplace validity", name, src_size);
+	else if (valid && ((size_t)(end - inplace) != expected_size ||
+	    memcmp(inplace, expected, expected_size) != 0))
+		report("decode_inplace", name, src_size);
+
+	/* Views only handle a single short run, but always do. */
+	view = crdb_word_stuff_decode_view(src, src_size, &view_len);
+	if (view != NULL) {
+		if (valid == false || view_len != expected_size ||
+		    memcmp(view, expected, view_len) != 0)
+			report("decode_view", name, src_size);
+	} else if (src_size > 0 && src[0] < MAX_INITIAL_RUN &&
+	    src[0] == src_size - 1) {
+		report("decode_view missed", name, src_size);
+	}
+
+out:
+	free(inplace);
+	free(dst);
+	free(expected);
+	return;
+}
+
+/* Decodes `encoded`, truncated, corrupted, and with trailing bytes. */
+static void
+check_decode_variants(const uint8_t *encoded, size_t encoded_size,
+    const char *name)
+{
+	static const uint8_t special[] = {
+		0, 1, 251, 252, 253, 254, 255, 0xFE, 0xFD,
+	};
+	uint8_t *copy = xmalloc(encoded_size + 4);
+
+	check_decode(encoded, encoded_size, name);
+
+	/* Every prefix of short encodings, a few of longer ones. */
+	if (encoded_size <= BYTEWISE_MAX) {
+		for (size_t len = 0; len < encoded_size; len++)
+			check_decode(encoded, len, name);
+	} else {
+		for (size_t i = 0; i < 8; i++)
+			check_decode(encoded, random_below(encoded_size), name);
+		check_decode(encoded, encoded_size - 1, name);
+		check_decode(encoded, encoded_size - 2, name);
+	}
+
+	for (size_t i = 0; i < 8 && encoded_size > 0; i++) {
+		size_t pos = (i == 0) ? 0 : random_below(encoded_size);
+
+		memcpy(copy, encoded, encoded_size);
+		copy[pos] = (i % 2 == 0) ?
+		    special[random_below(sizeof(special))] :
+		    copy[pos] ^ (uint8_t)(1 + random_below(255));
+		check_decode(copy, encoded_size, name);
+	}
+
+	for (size_t extra = 1; extra <= 3; extra++) {
+		memcpy(copy, encoded, encoded_size);
+		for (size_t i = 0; i < extra; i++)
+			copy[encoded_size + i] = (uint8_t)random_u32();
+		check_decode(copy, encoded_size + extra, name);
+	}
+
+	free(copy);
+	return;
+}
+
+/*
+ * Encodes `src[0 ... src_size - 1]` with every encoder, and decodes
+ * the result and its variants with every decoder.
+ */
+static void
+check_payload(const uint8_t *src, size_t src_size, const char *name)
+{
+	size_t bound = crdb_word_stuffed_size(src_size, false);
+	size_t expected_size = 0;
+	uint8_t *expected, *dst, *end;
+	uint32_t crc, expected_crc;
+
+	num_encoded++;
+	expected = xmalloc(bound + GUARD_SIZE);
+	dst = xmalloc(bound + GUARD_SIZE);
+
+	expected_size = reference_encode(expected, src, src_size);
+	if (expected_size > bound)
+		report("reference bound", name, src_size);
+
+	end = crdb_word_stuff_encode(dst, src, src_size);
+	if ((size_t)(end - dst) != expected_size ||
+	    memcmp(dst, expected, expected_size) != 0)
+		report("encode", name, src_size);
+
+	crc = random_u32();
+	expected_crc = crdb_crc32c_update(crc, src, src_size);
+	end = crdb_word_stuff_encode_crc32c(dst, src, src_size, &crc);
+	if ((size_t)(end - dst) != expected_size ||
+	    memcmp(dst, expected, expected_size) != 0)
+		report("encode_crc32c", name, src_size);
+	if (crc != expected_crc)
+		report("encode_crc32c checksum", name, src_size);
+
+	check_encoder(src, src_size, expected, expected_size, dst, name,
+	    src_size <= BYTEWISE_MAX);
+	check_encode_iov(src, src_size, expected, expected_size, dst, name);
+	check_decode_variants(expected, expected_size, name);
+
+	free(dst);
+	free(expected);
+	return;
+}
+
+/* Random bytes, a quarter of which are header bytes. */
+static void
+fill_dense(uint8_t *buf, size_t len)
+{
+
+	for (size_t i = 0; i < len; i++) {
+		uint32_t r = random_u32();
+
+		buf[i] = ((r & 3) == 0) ?
+		    header[(r >> 2) & 1] : (uint8_t)(r >> 8);
+	}
+
+	return;
+}
+
+/* Random bytes without any header[0], so without any header. */
+static void
+fill_sparse(uint8_t *buf, size_t len)
+{
+
+	for (size_t i = 0; i < len; i++) {
+		uint8_t byte = (uint8_t)random_u32();
+
+		buf[i] = (byte == header[0]) ? header[1] : byte;
+	}
+
+	return;
+}
+
+/*
+ * Header-free payloads of `len` bytes, with a header planted at each
+ * position in `positions` that fits.
+ */
+static void
+check_planted(uint8_t *buf, size_t len, const size_t *positions,
+    size_t num_positions, const char *name)
+{
+
+	fill_sparse(buf, len);
+	for (size_t i = 0; i < num_positions; i++) {
+		if (positions[i] + sizeof(header) <= len)
+			memcpy(buf + positions[i], header, sizeof(header));
+	}
+
+	check_payload(buf, len, name);
+	return;
+}
+
+int
+main(void)
+{
+	/* Sizes around both run size limits, and their multiples. */
+	static const size_t long_sizes[] = {
+		MAX_REMAINING_RUN - 1,
+		MAX_REMAINING_RUN,
+		MAX_REMAINING_RUN + 1,
+		MAX_INITIAL_RUN + MAX_REMAINING_RUN - 1,
+		MAX_INITIAL_RUN + MAX_REMAINING_RUN,
+		MAX_INITIAL_RUN + MAX_REMAINING_RUN + 1,
+		MAX_INITIAL_RUN + MAX_REMAINING_RUN + 2,
+		MAX_INITIAL_RUN + 2 * MAX_REMAINING_RUN,
+		MAX_INITIAL_RUN + 2 * MAX_REMAINING_RUN + 3,
+	};
+	uint8_t *storage, *buf;
+
+	storage = xmalloc(MAX_PAYLOAD + 64);
+
+	/* Every short size, dense in header bytes or header-free. */
+	for (size_t len = 0; len <= 2 * MAX_INITIAL_RUN + 8; len++) {
+		buf = storage + random_below(64);
+		fill_dense(buf, len);
+		check_payload(buf, len, "dense");
+		fill_sparse(buf, len);
+		check_payload(buf, len, "sparse");
+	}
+
+	/* Headers on either side of the end of the first run. */
+	for (size_t pos = MAX_INITIAL_RUN - 3; pos <= MAX_INITIAL_RUN + 1;
+	     pos++) {
+		for (size_t len = pos; len <= pos + 4; len++)
+			check_planted(storage, len, &pos, 1, "first run");
+	}
+
+	/* Consecutive and back-to-back headers. */
+	for (size_t len = 0; len <= 16; len++) {
+		for (size_t i = 0; i < len; i++)
+			storage[i] = header[i % 2];
+		check_payload(storage, len, "headers");
+	}
+
+	for (size_t i = 0; i < sizeof(long_sizes) / sizeof(long_sizes[0]);
+	     i++) {
+		size_t len = long_sizes[i];
+		size_t positions[] = {
+			MAX_INITIAL_RUN - 1,
+			MAX_INITIAL_RUN + MAX_REMAINING_RUN - 1,
+			MAX_INITIAL_RUN + MAX_REMAINING_RUN,
+			len - 2,
+		};
+
+		buf = storage + random_below(64);
+		fill_sparse(buf, len);
+		check_payload(buf, len, "long sparse");
+		fill_dense(buf, len);
+		check_payload(buf, len, "long dense");
+		check_planted(buf, len, positions,
+		    sizeof(positions) / sizeof(positions[0]), "long planted");
+	}
+
+	/* Random junk, mostly invalid. */
+	for (size_t i = 0; i < 4096; i++) {
+		size_t len = random_below(BYTEWISE_MAX);
+
+		fill_dense(storage, len);
+		if (len > 0 && (i & 1))
+			storage[0] = (uint8_t)random_below(MAX_INITIAL_RUN + 4);
+		check_decode(storage, len, "random");
+	}
+
+	free(storage);
+	if (failures != 0) {
+		fprintf(stderr, "%zu failures\n", failures);
+		return 1;
+	}
+
+	printf("word stuffing matches the reference codec on %zu payloads "
+	    "and %zu encodings\n", num_encoded, num_decoded);
+	return 0;
+}
@@ -0,0 +1,426 @@
+/*
+ * Copyright 2021 Backtrace I/O, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Checks every header search and header mask kernel the CPU supports
+ * against the scalar reference, for buffers at every alignment and of
+ * every length up to MAX_LEN bytes: random buffers dense in 0xFE and
+ * 0xFD bytes, and header-free filler with a single header planted at
+ * each position, so that headers straddle every vector and block
+ * boundary.  `crdb_word_stuff_header_bitmap` and
+ * `crdb_word_stuff_header_offsets` are checked on the same buffers
+ * against repeated scalar searches, including the bitmap's tail bits
+ * and searches resumed after filling `offsets` to capacity.
+ *
+ * Buffers also end right before a PROT_NONE page, to catch kernels
+ * that read past the end of their input.
+ *
+ * We include the source file to reach the static kernels.
+ */
+
+#include "../src/word_stuff.c"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define MAX_LEN 256
+#define MAX_ALIGN 64
+#define DENSE_TRIALS 8
+
+/* Mask kernels are checked on up to that many blocks. */
+#define MAX_MASK_BLOCKS 4
+
+/*
+ * `crdb_word_stuff_header_offsets` works in 1 KB batches: framing is
+ * also checked on buffers up to that long, with headers around the
+ * batch boundaries.
+ */
+#define MAX_FRAMING_LEN 2100
+
+/* Headers never overlap. */
+#define MAX_HEADERS (MAX_FRAMING_LEN / CRDB_WORD_STUFF_HEADER_SIZE)
+#define BITMAP_WORDS ((MAX_FRAMING_LEN + 63) / 64)
+
+/* Poison for output words the functions must overwrite. */
+#define POISON 0xA5A5A5A5A5A5A5A5ULL
+
+struct find_kernel {
+	const char *name;
+	header_find_fn *fn;
+	bool supported;
+};
+
+struct masks_kernel {
+	const char *name;
+	header_masks_fn *fn;
+	bool supported;
+};
+
+static uint32_t rng_state = 2654435761U;
+
+static uint8_t
+random_byte(void)
+{
+
+	rng_state = rng_state * 1103515245U + 12345U;
+	return (uint8_t)(rng_state >> 24);
+}
+
+/* Half the bytes are header bytes, the rest random. */
+static void
+fill_dense(uint8_t *buf, size_t len)
+{
+
+	for (size_t i = 0; i < len; i++) {
+		uint8_t byte = random_byte();
+
+		if (byte < 64)
+			buf[i] = header[0];
+		else if (byte < 128)
+			buf[i] = header[1];
+		else
+			buf[i] = random_byte();
+	}
+
+	return;
+}
+
+/* Random bytes without any header[0], so without any header. */
+static void
+fill_sparse(uint8_t *buf, size_t len)
+{
+
+	for (size_t i = 0; i < len; i++) {
+		uint8_t byte = random_byte();
+
+		buf[i] = (byte == header[0]) ? header[1] : byte;
+	}
+
+	return;
+}
+
+static size_t failures;
+
+/*
+ * Checks the bitmap and offsets of every header in `data[0 ... len - 1]`
+ * against `expected[0 ... num_expected - 1]`.
+ */
+static void
+check_framing(const uint8_t *data, size_t len, const uint64_t *expected,
+    size_t num_expected, const char *what)
+{
+	static const size_t capacities[] = { 1, 2, 3, MAX_HEADERS };
+	uint64_t bitmap[BITMAP_WORDS + 1];
+	size_t num_words = (len + 63) / 64;
+	size_t found;
+
+	for (size_t i = 0; i <= BITMAP_WORDS; i++)
+		bitmap[i] = POISON;
+
+	found = crdb_word_stuff_header_bitmap(bitmap, data, len);
+	if (found != num_expected) {
+		fprintf(stderr, "header_bitmap (%s): len %zu align %zu: "
+		    "%zu headers instead of %zu\n", what, len,
+		    (size_t)((uintptr_t)data % MAX_ALIGN), found,
+		    num_expected);
+		failures++;
+	}
+
+	/* Every bit of the first `num_words` words, and nothing past. */
+	for (size_t i = 0, next = 0; i < num_words * 64; i++) {
+		bool set = (bitmap[i / 64] >> (i % 64)) & 1;
+		bool header_at = next < num_expected && expected[next] == i;
+
+		next += header_at;
+		if (set == header_at)
+			continue;
+
+		fprintf(stderr, "header_bitmap (%s): len %zu align %zu: "
+		    "bit %zu is %d\n", what, len,
+		    (size_t)((uintptr_t)data % MAX_ALIGN), i, (int)set);
+		failures++;
+		break;
+	}
+
+	if (bitmap[num_words] != POISON) {
+		fprintf(stderr, "header_bitmap (%s): len %zu: wrote past "
+		    "word %zu\n", what, len, num_words);
+		failures++;
+	}
+
+	for (size_t i = 0; i < sizeof(capacities) / sizeof(capacities[0]);
+	     i++) {
+		uint64_t offsets[MAX_HEADERS + 1];
+		size_t capacity = capacities[i];
+		size_t base = 0;
+		size_t total = 0;
+
+		/* Resume after each full batch, as documented. */
+		for (;;) {
+			offsets[capacity] = POISON;
+			found = crdb_word_stuff_header_offsets(offsets,
+			    capacity, data + base, len - base);
+			if (found > capacity || offsets[capacity] != POISON)
+				goto mismatch;
+
+			for (size_t j = 0; j < found; j++) {
+				if (total + j >= num_expected ||
+				    base + offsets[j] != expected[total + j])
+					goto mismatch;
+			}
+
+			total += found;
+			if (found < capacity)
+				break;
+
+			base += offsets[capacity - 1] +
+			    CRDB_WORD_STUFF_HEADER_SIZE;
+		}
+
+		if (total == num_expected)
+			continue;
+
+mismatch:
+		fprintf(stderr, "header_offsets (%s): len %zu align %zu: "
+		    "capacity %zu: mismatch after %zu headers\n", what, len,
+		    (size_t)((uintptr_t)data % MAX_ALIGN), capacity, total);
+		failures++;
+	}
+
+	return;
+}
+
+static void
+check_find(const struct find_kernel *kernels, size_t num_kernels,
+    const uint8_t *data, size_t len, const char *what)
+{
+	const uint8_t *expected = header_find_scalar(data, len);
+	const uint8_t *dispatched = crdb_word_stuff_header_find(data, len);
+	uint64_t offsets[MAX_HEADERS];
+	size_t num_offsets = 0;
+
+	for (const uint8_t *cursor = expected; cursor < data + len;
+	     cursor = header_find_scalar(cursor + CRDB_WORD_STUFF_HEADER_SIZE,
+	     data + len - cursor - CRDB_WORD_STUFF_HEADER_SIZE))
+		offsets[num_offsets++] = (uint64_t)(cursor - data);
+
+	check_framing(data, len, offsets, num_offsets, what);
+
+	if (dispatched != expected) {
+		fprintf(stderr, "header_find (%s): len %zu align %zu: "
+		    "%td instead of %td\n", what, len,
+		    (size_t)((uintptr_t)data % MAX_ALIGN),
+		    dispatched - data, expected - data);
+		failures++;
+	}
+
+	for (size_t i = 0; i < num_kernels; i++) {
+		const uint8_t *actual;
+
+		if (kernels[i].supported == false)
+			continue;
+
+		actual = kernels[i].fn(data, len);
+		if (actual == expected)
+			continue;
+
+		fprintf(stderr, "header_find_%s (%s): len %zu align %zu: "
+		    "%td instead of %td\n", kernels[i].name, what, len,
+		    (size_t)((uintptr_t)data % MAX_ALIGN),
+		    actual - data, expected - data);
+		failures++;
+	}
+
+	return;
+}
+
+/*
+ * Checks `data[0 ... len - 1]` densely populated, and sparse with
+ * a header planted at every position.
+ */
+static void
+check_find_buffer(const struct find_kernel *kernels, size_t num_kernels,
+    uint8_t *data, size_t len)
+{
+
+	for (size_t trial = 0; trial < DENSE_TRIALS; trial++) {
+		fill_dense(data, len);
+		check_find(kernels, num_kernels, data, len, "dense");
+	}
+
+	fill_sparse(data, len);
+	check_find(kernels, num_kernels, data, len, "none");
+	for (size_t i = 0; i + CRDB_WORD_STUFF_HEADER_SIZE <= len; i++) {
+		uint8_t saved[CRDB_WORD_STUFF_HEADER_SIZE];
+
+		memcpy(saved, data + i, sizeof(saved));
+		memcpy(data + i, header, sizeof(header));
+		check_find(kernels, num_kernels, data, len, "single");
+		memcpy(data + i, saved, sizeof(saved));
+	}
+
+	return;
+}
+
+static void
+check_masks(const struct masks_kernel *kernels, size_t num_kernels,
+    const uint8_t *data, size_t num_blocks)
+{
+
+	for (size_t i = 0; i < num_kernels; i++) {
+		uint64_t masks[MAX_MASK_BLOCKS];
+
+		if (kernels[i].supported == false)
+			continue;
+
+		kernels[i].fn(masks, data, num_blocks);
+		for (size_t j = 0; j < num_blocks; j++) {
+			uint64_t expected;
+
+			expected = header_mask_scalar(
+			    data + j * HEADER_MASK_BLOCK,
+			    HEADER_MASK_BLOCK + 1);
+			if (masks[j] == expected)
+				continue;
+
+			fprintf(stderr, "header_masks_%s: block %zu/%zu "
+			    "align %zu: %016" PRIx64 " instead of %016" PRIx64
+			    "\n", kernels[i].name, j, num_blocks,
+			    (size_t)((uintptr_t)data % MAX_ALIGN),
+			    masks[j], expected);
+			failures++;
+		}
+	}
+
+	return;
+}
+
+int
+main(void)
+{
+#ifdef CRDB_WORD_STUFF_X86
+	const struct find_kernel find_kernels[] = {
+		{ "sse2", header_find_sse2, true },
+		{ "avx2", header_find_avx2,
+		  __builtin_cpu_supports("avx2") },
+		{ "avx512bw", header_find_avx512bw,
+		  __builtin_cpu_supports("avx512bw") },
+	};
+	const struct masks_kernel masks_kernels[] = {
+		{ "sse2", header_masks_sse2, true },
+		{ "avx2", header_masks_avx2,
+		  __builtin_cpu_supports("avx2") },
+		{ "avx512bw", header_masks_avx512bw,
+		  __builtin_cpu_supports("avx512bw") },
+	};
+#else
+	const struct find_kernel find_kernels[] = {
+		{ "scalar", header_find_scalar, true },
+	};
+	const struct masks_kernel masks_kernels[] = {
+		{ "scalar", header_masks_scalar, true },
+	};
+#endif
+	const size_t num_find = sizeof(find_kernels) / sizeof(find_kernels[0]);
+	const size_t num_masks =
+	    sizeof(masks_kernels) / sizeof(masks_kernels[0]);
+	size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+	uint8_t *page, *guard;
+
+	/* One page for the buffers, then a guard page. */
+	page = mmap(NULL, 2 * page_size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (page == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	guard = page + page_size;
+	if (mprotect(guard, page_size, PROT_NONE) != 0) {
+		perror("mprotect");
+		return 1;
+	}
+
+	for (size_t i = 0; i < num_find; i++) {
+		printf("header_find_%s: %s\n", find_kernels[i].name,
+		    find_kernels[i].supported ? "checking" : "unsupported");
+	}
+
+	for (size_t len = 0; len <= MAX_LEN; len++) {
+		/* Every alignment, away from the guard page... */
+		for (size_t align = 0; align < MAX_ALIGN; align++)
+			check_find_buffer(find_kernels, num_find,
+			    page + align, len);
+
+		/* ... and right against it. */
+		check_find_buffer(find_kernels, num_find, guard - len, len);
+	}
+
+	for (size_t len = 1030; len <= MAX_FRAMING_LEN; len += 530) {
+		for (size_t align = 0; align < MAX_ALIGN; align += 7) {
+			uint8_t *data = guard - len - align;
+
+			fill_dense(data, len);
+			check_find(find_kernels, num_find, data, len, "dense");
+
+			/* Headers straddling the 1 KB and 2 KB batches. */
+			for (size_t i = 1020; i <= 1026; i++) {
+				fill_sparse(data, len);
+				memcpy(data + i, header, sizeof(header));
+				if (i + 1024 + sizeof(header) <= len)
+					memcpy(data + i + 1024, header,
+					    sizeof(header));
+				check_find(find_kernels, num_find, data, len,
+				    "batch");
+			}
+		}
+	}
+
+	for (size_t num_blocks = 0; num_blocks <= MAX_MASK_BLOCKS;
+	     num_blocks++) {
+		/* The kernels read one byte past the last block. */
+		size_t len = num_blocks * HEADER_MASK_BLOCK + 1;
+
+		for (size_t align = 0; align < MAX_ALIGN; align++) {
+			uint8_t *data = guard - len - align;
+
+			for (size_t trial = 0; trial < DENSE_TRIALS; trial++) {
+				fill_dense(data, len);
+				check_masks(masks_kernels, num_masks, data,
+				    num_blocks);
+			}
+		}
+	}
+
+	munmap(page, 2 * page_size);
+	if (failures != 0) {
+		fprintf(stderr, "%zu mismatches\n", failures);
+		return 1;
+	}
+
+	printf("word stuffing kernels match the scalar reference\n");
+	return 0;
+}